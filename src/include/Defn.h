@@ -104,8 +104,6 @@ extern0 SEXP    R_dot_Class;  /* ".Class" */
 extern0 SEXP    R_dot_GenericCallEnv;  /* ".GenericCallEnv" */
 extern0 SEXP    R_dot_GenericDefEnv;  /* ".GenericDefEnv" */
 
-extern0 SEXP	R_StringHash;       /* Global hash of CHARSXPs */
-
 
  /* writable char access for R internal use only */
 #define CHAR_RW(x)	((char *) CHAR(x))
@@ -146,10 +144,8 @@ int ENC_KNOWN(SEXP x);
 int SET_CACHED(SEXP x);
 int IS_CACHED(SEXP x);
 #endif
-/* macros and declarations for managing CHARSXP cache */
-# define CXHEAD(x) (x)
-# define CXTAIL(x) ATTRIB(x)
-SEXP (SET_CXTAIL)(SEXP x, SEXP y);
+/* the garbage collector's interface to the CHARSXP cache */
+void R_StringHashPurge(Rboolean (*dead)(SEXP));
 
 #include "Errormsg.h"
 
@@ -826,6 +822,17 @@ extern0 int R_disable_bytecode INI_as(0);
 extern SEXP R_cmpfun1(SEXP); /* unconditional fresh compilation */
 extern void R_init_jit_enabled(void);
 extern void R_initAssignSymbols(void);
+
+/* function lookup and dispatch caches, see envir.c */
+extern0 R_xlen_t R_FunCacheVersion INI_as(1);
+extern0 R_xlen_t R_MethodsCacheVersion INI_as(1);
+#define IS_FUNCACHE_FUNFRAME(e) \
+    (HASHTAB(e) == R_NilValue && (e) != R_BaseEnv && (e) != R_BaseNamespace)
+void R_FlushFunCache(SEXP, SEXP);
+SEXP R_findFunCached(SEXP, SEXP);
+Rboolean R_FunCacheFrameLoc(SEXP, SEXP, SEXP *);
+Rboolean R_MethodsCacheFrameLoc(SEXP, SEXP, SEXP *);
+R_xlen_t R_GetMethodsCacheVersion(void);
 #ifdef R_USE_SIGNALS
 extern SEXP R_findBCInterpreterSrcref(RCNTXT*);
 #endif
@@ -1408,6 +1415,9 @@ void dt_invalidate_locale(); /* from Rstrptime.h */
 extern int R_OutputCon; /* from connections.c */
 extern int R_InitReadItemDepth, R_ReadItemDepth; /* from serialize.c */
 void get_current_mem(size_t *,size_t *,size_t *); /* from memory.c */
+double R_GetVallocBytes(void); /* from memory.c */
+void R_gc_idle_sweep(void); /* from memory.c */
+Rboolean R_SetLargeVecPolicy(const char *); /* from memory.c */
 unsigned long get_duplicate_counter(void);  /* from duplicate.c */
 void reset_duplicate_counter(void);  /* from duplicate.c */
 void BindDomain(char *); /* from main.c */
@@ -91,5 +91,14 @@ int Rsockselect(int nsock, int *insockfd, int *ready, int *write, double timeout
 
 #define set_iconv Rf_set_iconv
 void set_iconv(Rconnection con);
+
+/* compressed files coded by several threads, in connections.c */
+typedef struct mtzfile *Rmtzfile;
+Rmtzfile R_mtz_open(const char *path, Rboolean write, int type, int level,
+		    int threads);
+size_t R_mtz_read(Rmtzfile z, void *ptr, size_t n);
+void R_mtz_write(Rmtzfile z, const void *ptr, size_t n);
+void R_mtz_finish(Rmtzfile z);
+void R_mtz_free(Rmtzfile z);
 #endif
 
@@ -1248,6 +1248,8 @@ typedef enum {
 cetype_t Rf_getCharCE(SEXP);
 SEXP Rf_mkCharCE(const char *, cetype_t);
 SEXP Rf_mkCharLenCE(const char *, int, cetype_t);
+void Rf_mkCharBatch(SEXP, R_xlen_t, R_xlen_t, const char * const *,
+		   const int *, cetype_t);
 const char *Rf_reEnc(const char *x, cetype_t ce_in, cetype_t ce_out, int subst);
 
 				/* match(.) NOT reached : for -Wall */
@@ -1368,7 +1370,8 @@ typedef enum {
     R_pstream_ascii_format,
     R_pstream_binary_format,
     R_pstream_xdr_format,
-    R_pstream_asciihex_format
+    R_pstream_asciihex_format,
+    R_pstream_aligned_format
 } R_pstream_format_t;
 
 typedef struct R_outpstream_st *R_outpstream_t;
@@ -1441,6 +1444,8 @@ void R_InitConnInPStream(R_inpstream_t stream,  Rconnection con,
 
 void R_Serialize(SEXP s, R_outpstream_t ops);
 SEXP R_Unserialize(R_inpstream_t ips);
+SEXP R_UnserializeEach(R_inpstream_t ips,
+		       SEXP (*fun)(SEXP, R_xlen_t, void *), void *data);
 SEXP R_SerializeInfo(R_inpstream_t ips);
 
 /* slot management (in attrib.c) */
@@ -1471,6 +1476,15 @@ void R_PreserveInMSet(SEXP x, SEXP mset);
 void R_ReleaseFromMSet(SEXP x, SEXP mset);
 void R_ReleaseMSet(SEXP mset, int keepSize);
 
+/* allocation of atomic vectors by worker threads, adopted into the
+   heap by the main thread */
+typedef struct R_WorkerArena_st *R_WorkerArena;
+R_WorkerArena R_NewWorkerArena(int nworkers, size_t size);
+SEXP R_WorkerAllocVector(R_WorkerArena arena, int worker,
+			 SEXPTYPE type, R_xlen_t length);
+SEXP R_AdoptWorkerVectors(R_WorkerArena arena);
+void R_FreeWorkerArena(R_WorkerArena arena);
+
 /* Shutdown actions */
 void R_dot_Last(void);		/* in main.c */
 void R_RunExitFinalizers(void);	/* in memory.c */
@@ -1640,6 +1654,7 @@ void R_orderVector1(int *indx, int n, SEXP x,       Rboolean nalast, Rboolean de
 #define mkChar			Rf_mkChar
 #define mkCharCE		Rf_mkCharCE
 #define mkCharLen		Rf_mkCharLen
+#define mkCharBatch		Rf_mkCharBatch
 #define mkCharLenCE		Rf_mkCharLenCE
 #define mkNamed			Rf_mkNamed
 #define mkString		Rf_mkString
@@ -52,6 +52,7 @@ static const R_CallMethodDef CallEntries[] = {
     CALLDEF(Rf_allocS4Object, 0),
     CALLDEF(R_set_method_dispatch, 1),
     CALLDEF(R_get_primname, 1),
+    CALLDEF(R_dispatch_cache_stats, 1),
     CALLDEF(new_object, 1),
     {NULL, NULL, 0}
 };
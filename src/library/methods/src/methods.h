@@ -54,4 +54,5 @@ SEXP do_substitute_direct(SEXP f, SEXP env);
 SEXP Rf_allocS4Object();
 SEXP R_set_method_dispatch(SEXP onOff);
 SEXP R_get_primname(SEXP object);
+SEXP R_dispatch_cache_stats(SEXP reset);
 SEXP new_object(SEXP class_def);
@@ -313,6 +313,135 @@ SEXP R_quick_method_check(SEXP args, SEXP mlist, SEXP fdef)
     return(retValue);
 }
 
+/* Native dispatch cache
+
+   Table dispatch maps the classes of the signature arguments to a
+   label such as "numeric#character" and looks the label up in the
+   generic's .AllMTable.  The cache maps the table and the class name
+   CHARSXPs, which are interned, directly to the binding of the label
+   in the table, so that a hit needs neither the label nor the lookup.
+   The method is read from the binding on each use.  The table and the
+   label are marked with R_MethodsCacheFrameLoc, so that adding or
+   removing a binding of the label, as setMethod(), removeMethod() and
+   the resetting of inherited methods do, advances the version of this
+   cache and invalidates its entries.  The version is separate from
+   that of the function lookup and S3 dispatch caches, which therefore
+   survive the bindings added to the tables by dispatch on new
+   classes.
+   Tables holding methods for classes of the same name from different
+   packages are not cached. */
+
+#define DISPATCH_CACHE_SIZE 4096
+
+static SEXP dispatch_cache = NULL;
+static double dispatch_cache_hits = 0, dispatch_cache_misses = 0;
+
+static R_INLINE int dispatchCacheIndex(SEXP mtable, SEXP *classes, int n)
+{
+    uintptr_t h = (uintptr_t) mtable >> 4;
+    for (int i = 0; i < n; i++)
+	h = h * 31 + ((uintptr_t) classes[i] >> 4);
+    return (int) ((h ^ (h >> 17)) % DISPATCH_CACHE_SIZE);
+}
+
+static R_INLINE SEXP dispatchCacheLocValue(SEXP loc)
+{
+    if (BNDCELL_TAG(loc))
+	return R_NilValue;
+    SEXP val = CAR(loc);
+    if (TYPEOF(val) == PROMSXP)
+	val = PRVALUE(val);
+    return val;
+}
+
+/* The method cached for 'classes' in 'mtable', or NULL */
+static SEXP dispatchCacheGet(SEXP mtable, SEXP *classes, int n)
+{
+    if (dispatch_cache != NULL) {
+	SEXP entry = VECTOR_ELT(dispatch_cache,
+				dispatchCacheIndex(mtable, classes, n));
+	if (entry != R_NilValue &&
+	    TRUELENGTH(entry) == R_GetMethodsCacheVersion() &&
+	    VECTOR_ELT(entry, 0) == mtable && XLENGTH(entry) == n + 2) {
+	    int i;
+	    for (i = 0; i < n; i++)
+		if (VECTOR_ELT(entry, i + 2) != classes[i])
+		    break;
+	    if (i == n) {
+		SEXP method = dispatchCacheLocValue(VECTOR_ELT(entry, 1));
+		switch (TYPEOF(method)) {
+		case CLOSXP: case SPECIALSXP: case BUILTINSXP:
+		    dispatch_cache_hits++;
+		    return method;
+		default:
+		    break;
+		}
+	    }
+	}
+    }
+    dispatch_cache_misses++;
+    return NULL;
+}
+
+/* Remember that the binding of 'label' in 'mtable' holds 'method' */
+static void dispatchCachePut(SEXP mtable, SEXP *classes, int n, SEXP label,
+			     SEXP method)
+{
+    SEXP loc;
+    if (TYPEOF(mtable) != ENVSXP ||
+	!R_MethodsCacheFrameLoc(mtable, label, &loc) || loc == R_NilValue ||
+	TYPEOF(loc) != LISTSXP || IS_ACTIVE_BINDING(loc) ||
+	dispatchCacheLocValue(loc) != method)
+	return;
+    if (dispatch_cache == NULL) {
+	SEXP cache = allocVector(VECSXP, DISPATCH_CACHE_SIZE);
+	R_PreserveObject(cache);
+	dispatch_cache = cache;
+    }
+    PROTECT(loc);
+    SEXP entry = allocVector(VECSXP, n + 2);
+    SET_VECTOR_ELT(entry, 0, mtable);
+    SET_VECTOR_ELT(entry, 1, loc);
+    for (int i = 0; i < n; i++)
+	SET_VECTOR_ELT(entry, i + 2, classes[i]);
+    SET_TRUELENGTH(entry, R_GetMethodsCacheVersion());
+    SET_VECTOR_ELT(dispatch_cache, dispatchCacheIndex(mtable, classes, n),
+		   entry);
+    UNPROTECT(1); /* loc */
+}
+
+SEXP R_dispatch_cache_stats(SEXP reset)
+{
+    int doreset = asLogical(reset);
+    if (doreset == NA_LOGICAL)
+	error(_("invalid '%s' argument"), "reset");
+    double entries = 0;
+    if (dispatch_cache != NULL)
+	for (int i = 0; i < DISPATCH_CACHE_SIZE; i++) {
+	    SEXP entry = VECTOR_ELT(dispatch_cache, i);
+	    if (entry != R_NilValue &&
+		TRUELENGTH(entry) == R_GetMethodsCacheVersion())
+		entries++;
+	}
+    SEXP ans = PROTECT(allocVector(REALSXP, 3));
+    SEXP nms = PROTECT(allocVector(STRSXP, 3));
+    REAL(ans)[0] = dispatch_cache_hits;
+    REAL(ans)[1] = dispatch_cache_misses;
+    REAL(ans)[2] = entries;
+    SET_STRING_ELT(nms, 0, mkChar("hits"));
+    SET_STRING_ELT(nms, 1, mkChar("misses"));
+    SET_STRING_ELT(nms, 2, mkChar("entries"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    if (doreset) {
+	dispatch_cache_hits = dispatch_cache_misses = 0;
+	if (dispatch_cache != NULL)
+	    for (int i = 0; i < DISPATCH_CACHE_SIZE; i++)
+		SET_VECTOR_ELT(dispatch_cache, i, R_NilValue);
+    }
+    UNPROTECT(2); /* ans, nms */
+    return ans;
+}
+
 SEXP R_quick_dispatch(SEXP args, SEXP genericEnv, SEXP fdef)
 {
     /* Match the list of (possibly promised) args to the methods table. */
@@ -359,16 +488,22 @@ SEXP R_quick_dispatch(SEXP args, SEXP genericEnv, SEXP fdef)
     }
     buf[0] = '\0'; ptr = buf;
     nargs = 0;
+    /* the class names, for the dispatch cache */
+    SEXP classes[nsig > 0 ? (nsig < NBUF ? nsig : NBUF) : 1];
+    int nprotect = 1; /* mtable */
     while(!isNull(args) && nargs < nsig) {
 	object = CAR(args); args = CDR(args);
 	if(TYPEOF(object) == PROMSXP)
 	    object = eval(object, Methods_Namespace);
 	if(object == R_MissingArg)
-	    class = "missing";
-	else
-	    class = CHAR(STRING_ELT(R_data_class(object, TRUE), 0));
+	    classes[nargs] = STRING_ELT(s_missing, 0);
+	else {
+	    classes[nargs] = STRING_ELT(R_data_class(object, TRUE), 0);
+	    PROTECT(classes[nargs]); nprotect++;
+	}
+	class = CHAR(classes[nargs]);
 	if(ptr - buf + strlen(class) + 2 > NBUF) {
-	    UNPROTECT(1); /* mtable */
+	    UNPROTECT(nprotect);
 	    return R_NilValue;
 	}
 	/* NB:  this code replicates .SigLabel().
@@ -381,16 +516,23 @@ SEXP R_quick_dispatch(SEXP args, SEXP genericEnv, SEXP fdef)
     }
     for(; nargs < nsig; nargs++) {
 	if(ptr - buf + strlen("missing") + 2 > NBUF) {
-	    UNPROTECT(1); /* mtable */
+	    UNPROTECT(nprotect);
 	    return R_NilValue;
 	}
 	ptr = strcpy(ptr, "#"); ptr +=1;
 	ptr = strcpy(ptr, "missing"); ptr += strlen("missing");
+	classes[nargs] = STRING_ELT(s_missing, 0);
     }
-    value = findVarInFrame(mtable, install(buf));
-    if(value == R_UnboundValue)
-	value = R_NilValue;
-    UNPROTECT(1); /* mtable */
+    value = dispatchCacheGet(mtable, classes, nsig);
+    if(value == NULL) {
+	SEXP label = install(buf);
+	value = findVarInFrame(mtable, label);
+	if(value == R_UnboundValue)
+	    value = R_NilValue;
+	else if(isFunction(value))
+	    dispatchCachePut(mtable, classes, nsig, label, value);
+    }
+    UNPROTECT(nprotect);
     return(value);
 }
 
@@ -1096,27 +1238,39 @@ SEXP R_dispatchGeneric(SEXP fname, SEXP ev, SEXP fdef)
 	SET_VECTOR_ELT(classes, i, thisClass);
 	lwidth += (int) strlen(STRING_VALUE(thisClass)) + 1;
     }
-    /* make the label */
-    const void *vmax = vmaxget();
-    buf = (char *) R_alloc(lwidth + 1, sizeof(char));
-    bufptr = buf;
-    for(i = 0; i<nargs; i++) {
-	if(i > 0)
-	    *bufptr++ = '#';
-	thisClass = VECTOR_ELT(classes, i);
-	strcpy(bufptr, STRING_VALUE(thisClass));
-	while(*bufptr)
-	    bufptr++;
-    }
-    method = findVarInFrame(mtable, install(buf));
-    vmaxset(vmax);
-    if(DUPLICATE_CLASS_CASE(method)) {
-	PROTECT(method);
-	method = R_selectByPackage(method, classes, nargs);
-	UNPROTECT(1);
-    }
-    if(method == R_UnboundValue) {
-	method = do_inherited_table(classes, fdef, mtable, ev);
+    SEXP classnames[nargs > 0 ? nargs : 1];
+    for(i = 0; i < nargs; i++)
+	classnames[i] = STRING_ELT(VECTOR_ELT(classes, i), 0);
+    method = dispatchCacheGet(mtable, classnames, nargs);
+    if(method == NULL) {
+	/* make the label */
+	const void *vmax = vmaxget();
+	buf = (char *) R_alloc(lwidth + 1, sizeof(char));
+	bufptr = buf;
+	for(i = 0; i<nargs; i++) {
+	    if(i > 0)
+		*bufptr++ = '#';
+	    thisClass = VECTOR_ELT(classes, i);
+	    strcpy(bufptr, STRING_VALUE(thisClass));
+	    while(*bufptr)
+		bufptr++;
+	}
+	SEXP label = install(buf);
+	method = findVarInFrame(mtable, label);
+	vmaxset(vmax);
+	if(DUPLICATE_CLASS_CASE(method)) {
+	    PROTECT(method);
+	    method = R_selectByPackage(method, classes, nargs);
+	    UNPROTECT(1);
+	}
+	else if(isFunction(method)) {
+	    PROTECT(method);
+	    dispatchCachePut(mtable, classnames, nargs, label, method);
+	    UNPROTECT(1);
+	}
+	if(method == R_UnboundValue) {
+	    method = do_inherited_table(classes, fdef, mtable, ev);
+	}
     }
     /* the rest of this is identical to R_standardGeneric;
        hence the f=method to remind us  */
@@ -34,6 +34,7 @@
 static const R_CallMethodDef CallEntries[] = {
     CALLDEF(crc64, 1),
     CALLDEF(flushconsole, 0),
+    CALLDEF(heapDominators, 4),
     CALLDEF(menu, 1),
     CALLDEF(nsl, 1),
     CALLDEF(objectSize, 1),
@@ -79,8 +80,9 @@ static const R_ExternalMethodDef ExtEntries[] = {
     EXTDEF(download, 6),
 #endif
     EXTDEF(unzip, 7),
-    EXTDEF(Rprof, 9),
+    EXTDEF(Rprof, 11),
     EXTDEF(Rprofmem, 3),
+    EXTDEF(heapSnapshot, 1),
 
     EXTDEF(countfields, 6),
     EXTDEF(readtablehead, 7),
@@ -1,6 +1,6 @@
 /*
  *  R : A Computer Language for Statistical Data Analysis
- *  Copyright (C) 2000-2014  The R Core Team
+ *  Copyright (C) 2000-2020  The R Core Team
  *
  *  This program is free software; you can redistribute it and/or modify
  *  it under the terms of the GNU General Public License as published by
@@ -26,6 +26,8 @@
 #endif
 
 #include <Defn.h>
+#undef _
+#include "utils.h"
 
 /* A count of the memory used by an object. The following assumptions
    are made.
@@ -167,3 +169,168 @@ SEXP objectSize(SEXP x)
 {
     return ScalarReal( (double) objectsize(x) );
 }
+
+/* Dominators of the graph of a heap snapshot (see heapSnapshot), by
+   the algorithm of Lengauer & Tarjan (1979) with simple path
+   compression.  Node i has nrefs[i] references, stored consecutively
+   in refs as 0-based numbers; a virtual root refers to the roots.
+   Returns the immediate dominator of each node (as a 1-based number,
+   0 for the virtual root) and the size retained by it, that is the
+   total size of the nodes it dominates. */
+
+static void compress(int v, int *ancestor, int *label, int *semi, int *stack)
+{
+    int sp = 0;
+    while (ancestor[ancestor[v]] >= 0) {
+	stack[sp++] = v;
+	v = ancestor[v];
+    }
+    while (sp > 0) {
+	v = stack[--sp];
+	int a = ancestor[v];
+	if (semi[label[a]] < semi[label[v]])
+	    label[v] = label[a];
+	ancestor[v] = ancestor[a];
+    }
+}
+
+static R_INLINE int dom_eval(int v, int *ancestor, int *label, int *semi,
+			     int *stack)
+{
+    if (ancestor[v] < 0)
+	return v;
+    compress(v, ancestor, label, semi, stack);
+    return label[v];
+}
+
+SEXP heapDominators(SEXP snrefs, SEXP srefs, SEXP sroots, SEXP ssize)
+{
+    if (TYPEOF(snrefs) != INTSXP || TYPEOF(srefs) != INTSXP ||
+	TYPEOF(sroots) != INTSXP || TYPEOF(ssize) != REALSXP ||
+	XLENGTH(ssize) != XLENGTH(snrefs))
+	error(_("invalid heap snapshot"));
+    int n = LENGTH(snrefs), N = n + 1, r = n, nroots = LENGTH(sroots);
+    const int *nrefs = INTEGER(snrefs), *refs = INTEGER(srefs),
+	*roots = INTEGER(sroots);
+    const double *size = REAL(ssize);
+
+    /* references out of and into each node, the root last */
+    R_xlen_t *off = (R_xlen_t *) R_alloc(N + 1, sizeof(R_xlen_t));
+    off[0] = 0;
+    for (int i = 0; i < n; i++)
+	off[i + 1] = off[i] + nrefs[i];
+    if (off[n] != XLENGTH(srefs))
+	error(_("invalid heap snapshot"));
+    off[N] = off[n] + nroots;
+#define REF(e) ((e) < off[n] ? refs[e] : roots[(e) - off[n]])
+#define VALID(w) ((w) >= 0 && (w) < n)
+    R_xlen_t *poff = (R_xlen_t *) R_alloc(N + 1, sizeof(R_xlen_t));
+    for (int i = 0; i <= N; i++)
+	poff[i] = 0;
+    for (R_xlen_t e = 0; e < off[N]; e++)
+	if (VALID(REF(e)))
+	    poff[REF(e) + 1]++;
+    for (int i = 0; i < N; i++)
+	poff[i + 1] += poff[i];
+    int *pred = (int *) R_alloc(poff[N] > 0 ? poff[N] : 1, sizeof(int));
+    R_xlen_t *pfill = (R_xlen_t *) R_alloc(N, sizeof(R_xlen_t));
+    for (int i = 0; i < N; i++)
+	pfill[i] = poff[i];
+    for (int v = 0; v < N; v++)
+	for (R_xlen_t e = off[v]; e < off[v + 1]; e++)
+	    if (VALID(REF(e)))
+		pred[pfill[REF(e)]++] = v;
+
+    /* depth-first numbering from the root */
+    int *dfnum = (int *) R_alloc(N, sizeof(int));
+    int *vertex = (int *) R_alloc(N, sizeof(int));
+    int *parent = (int *) R_alloc(N, sizeof(int));
+    int *stack = (int *) R_alloc(N, sizeof(int));
+    R_xlen_t *next = (R_xlen_t *) R_alloc(N, sizeof(R_xlen_t));
+    for (int i = 0; i < N; i++)
+	dfnum[i] = -1;
+    int cnt = 0, sp = 0;
+    dfnum[r] = cnt;
+    vertex[cnt++] = r;
+    parent[r] = -1;
+    stack[sp] = r;
+    next[sp++] = off[r];
+    while (sp > 0) {
+	int v = stack[sp - 1];
+	if (next[sp - 1] == off[v + 1]) {
+	    sp--;
+	    continue;
+	}
+	int w = REF(next[sp - 1]);
+	next[sp - 1]++;
+	if (VALID(w) && dfnum[w] < 0) {
+	    dfnum[w] = cnt;
+	    vertex[cnt++] = w;
+	    parent[w] = v;
+	    stack[sp] = w;
+	    next[sp++] = off[w];
+	}
+    }
+
+    /* semidominators, and immediate dominators implicitly */
+    int *semi = (int *) R_alloc(N, sizeof(int));
+    int *label = (int *) R_alloc(N, sizeof(int));
+    int *ancestor = (int *) R_alloc(N, sizeof(int));
+    int *idom = (int *) R_alloc(N, sizeof(int));
+    int *bucket = (int *) R_alloc(N, sizeof(int));
+    int *bnext = (int *) R_alloc(N, sizeof(int));
+    for (int i = 0; i < N; i++) {
+	semi[i] = dfnum[i];
+	label[i] = i;
+	ancestor[i] = -1;
+	idom[i] = -1;
+	bucket[i] = -1;
+    }
+    for (int i = cnt - 1; i > 0; i--) {
+	int w = vertex[i], p = parent[w];
+	for (R_xlen_t e = poff[w]; e < poff[w + 1]; e++) {
+	    int v = pred[e];
+	    if (dfnum[v] < 0)
+		continue;
+	    int u = dom_eval(v, ancestor, label, semi, stack);
+	    if (semi[u] < semi[w])
+		semi[w] = semi[u];
+	}
+	int s = vertex[semi[w]];
+	bnext[w] = bucket[s];
+	bucket[s] = w;
+	ancestor[w] = p;
+	for (int v = bucket[p]; v >= 0; v = bnext[v]) {
+	    int u = dom_eval(v, ancestor, label, semi, stack);
+	    idom[v] = semi[u] < semi[v] ? u : p;
+	}
+	bucket[p] = -1;
+    }
+    for (int i = 1; i < cnt; i++) {
+	int w = vertex[i];
+	if (idom[w] != vertex[semi[w]])
+	    idom[w] = idom[idom[w]];
+    }
+
+    /* retained sizes, accumulated up the dominator tree */
+    SEXP val = PROTECT(allocVector(VECSXP, 2));
+    SEXP sidom = allocVector(INTSXP, n);
+    SET_VECTOR_ELT(val, 0, sidom);
+    SEXP sret = allocVector(REALSXP, n);
+    SET_VECTOR_ELT(val, 1, sret);
+    int *pidom = INTEGER(sidom);
+    double *ret = REAL(sret);
+    for (int i = 0; i < n; i++) {
+	pidom[i] = dfnum[i] < 0 ? NA_INTEGER : (idom[i] == r ? 0 : idom[i] + 1);
+	ret[i] = dfnum[i] < 0 ? NA_REAL : size[i];
+    }
+    for (int i = cnt - 1; i > 0; i--) {
+	int w = vertex[i];
+	if (idom[w] != r)
+	    ret[idom[w]] += ret[w];
+    }
+#undef REF
+#undef VALID
+    UNPROTECT(1);
+    return val;
+}
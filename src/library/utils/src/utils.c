@@ -42,6 +42,12 @@ SEXP Rprofmem(SEXP args)
     return do_Rprofmem(CDR(args));
 }
 
+SEXP do_heapsnapshot(SEXP args);
+SEXP heapSnapshot(SEXP args)
+{
+    return do_heapsnapshot(CDR(args));
+}
+
 /* from src/main/dounzip.c */
 SEXP Runzip(SEXP args);
 
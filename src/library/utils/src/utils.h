@@ -25,9 +25,11 @@
 #endif
 
 SEXP objectSize(SEXP s);
+SEXP heapDominators(SEXP nrefs, SEXP refs, SEXP roots, SEXP size);
 SEXP unzip(SEXP args);
 SEXP Rprof(SEXP args);
 SEXP Rprofmem(SEXP args);
+SEXP heapSnapshot(SEXP args);
 
 SEXP countfields(SEXP args);
 SEXP flushconsole(void);
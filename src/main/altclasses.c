@@ -933,6 +933,7 @@ static SEXP make_mmap_state(SEXP file, size_t size, int type,
     switch(type) {
     case INTSXP: dsizes[1] = size / sizeof(int); break;
     case REALSXP: dsizes[1] = size / sizeof(double); break;
+    case RAWSXP: dsizes[1] = size; break;
     default: error("mmap for %s not supported yet", type2char(type));
     }
 
@@ -1273,6 +1274,17 @@ static SEXP mmap_file(SEXP file, int type, Rboolean ptrOK, Rboolean wrtOK,
 {
     error("mmap objects not supported on Windows yet");
 }
+
+SEXP attribute_hidden R_mmap_file_map(SEXP file, void **addr, size_t *size)
+{
+    error("mmap objects not supported on Windows yet");
+}
+
+SEXP attribute_hidden R_mmap_view(SEXP map, size_t offset, int type,
+				  R_xlen_t length)
+{
+    error("mmap objects not supported on Windows yet");
+}
 #else
 /* derived from the example in
   https://www.safaribooksonline.com/library/view/linux-system-programming/0596009585/ch04s03.html */
@@ -1334,6 +1346,67 @@ static SEXP mmap_file(SEXP file, int type, Rboolean ptrOK, Rboolean wrtOK,
 
     return make_mmap(p, file, sb.st_size, type, ptrOK, wrtOK, serOK);
 }
+
+#ifndef SIMPLEMMAP
+/* Used by readRDS(mmap = TRUE).  The whole file is mapped copy-on-write,
+   so the pages are shared with the page cache (and other processes
+   mapping the file) unless written to.  The mapping is held by an
+   external pointer registered like those of mmap objects; views into it
+   made by R_mmap_view keep it alive via the tags of their own external
+   pointers, and are unmapped when the last of them is collected. */
+SEXP attribute_hidden R_mmap_file_map(SEXP file, void **addr, size_t *size)
+{
+    const char *efn = R_ExpandFileName(translateCharFP(STRING_ELT(file, 0)));
+    struct stat sb;
+
+    int fd = open(efn, O_RDONLY);
+    if (fd == -1)
+	error("open: %s", strerror(errno));
+    if (fstat(fd, &sb) != 0 || ! S_ISREG(sb.st_mode) || sb.st_size == 0) {
+	close(fd);
+	error("%s is not a non-empty regular file", efn);
+    }
+    void *p = mmap(0, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd); /* don't care if this fails */
+    if (p == MAP_FAILED)
+	error("mmap: %s", strerror(errno));
+
+    SEXP state = PROTECT(make_mmap_state(file, sb.st_size, RAWSXP,
+					 TRUE, FALSE, FALSE));
+    SEXP eptr = PROTECT(R_MakeExternalPtr(p, R_NilValue, state));
+    register_mmap_eptr(eptr);
+    UNPROTECT(2); /* state, eptr */
+    *addr = p;
+    *size = sb.st_size;
+    return eptr;
+}
+
+SEXP attribute_hidden R_mmap_view(SEXP map, size_t offset, int type,
+				  R_xlen_t length)
+{
+    size_t size = length * (type == INTSXP ? sizeof(int) : sizeof(double));
+    SEXP state = PROTECT(make_mmap_state(MMAP_STATE_FILE(MMAP_EPTR_STATE(map)),
+					 size, type, TRUE, FALSE, FALSE));
+    void *p = (char *) R_ExternalPtrAddr(map) + offset;
+    SEXP eptr = PROTECT(R_MakeExternalPtr(p, map, state));
+    SEXP ans = R_new_altrep(type == INTSXP ? mmap_integer_class :
+			    mmap_real_class, eptr, state);
+    MARK_NOT_MUTABLE(ans);
+    UNPROTECT(2); /* state, eptr */
+    return ans;
+}
+#else
+SEXP attribute_hidden R_mmap_file_map(SEXP file, void **addr, size_t *size)
+{
+    error("memory-mapped reading is not supported in this build");
+}
+
+SEXP attribute_hidden R_mmap_view(SEXP map, size_t offset, int type,
+				  R_xlen_t length)
+{
+    error("memory-mapped reading is not supported in this build");
+}
+#endif
 #endif
 
 static Rboolean asLogicalNA(SEXP x, Rboolean dflt)
@@ -1395,6 +1468,8 @@ SEXP attribute_hidden do_munmap_file(SEXP call, SEXP op, SEXP args, SEXP env)
 
     /* using the finalizer is a cheat to avoid yet another #ifdef Windows */
     SEXP eptr = MMAP_EPTR(x);
+    if (TYPEOF(R_ExternalPtrTag(eptr)) != WEAKREFSXP)
+	error("cannot unmap a vector read by 'readRDS(mmap = TRUE)'");
     errno = 0;
     R_RunWeakRefFinalizer(R_ExternalPtrTag(eptr));
     if (errno)
@@ -426,6 +426,7 @@ SEXP attribute_hidden do_parentenvgets(SEXP call, SEXP op, SEXP args, SEXP rho)
 	!isEnvironment((parent = simple_as_environment(parent))))
 	error(_("'parent' is not an environment"));
 
+    R_FlushFunCache(env, R_NilValue);
     SET_ENCLOS(env, parent);
 
     return( CAR(args) );
@@ -1683,8 +1683,63 @@ typedef struct gzconn {
 typedef struct gzfileconn {
     void *fp;
     int compress;
+    int threads;
+    Rmtzfile mtz;	/* used instead of 'fp' with several threads */
 } *Rgzfileconn;
 
+/* gzfile and xzfile connections opened for reading or writing (but not
+   appending) with 'threads > 1' use the coders of saveRDS(threads = ),
+   below.  The file is opened here first so failure gives a warning. */
+static Rmtzfile mtz_open_con(Rconnection con, int type, int compress,
+			     int threads)
+{
+    const char *name = R_ExpandFileName(con->description);
+    Rboolean write = con->mode[0] == 'w';
+    FILE *fp;
+
+    errno = 0; /* precaution */
+    if (isDirPath(name)) {
+	warning(_("cannot open file '%s': it is a directory"), name);
+	return NULL;
+    }
+    if (!(fp = R_fopen(name, write ? "wb" : "rb"))) {
+	warning(_("cannot open compressed file '%s', probable reason '%s'"),
+		name, strerror(errno));
+	return NULL;
+    }
+    fclose(fp);
+    Rmtzfile z = R_mtz_open(con->description, write, type, compress, threads);
+    con->isopen = TRUE;
+    con->canwrite = write;
+    con->canread = !write;
+    con->canseek = FALSE;
+    con->text = strchr(con->mode, 'b') ? FALSE : TRUE;
+    set_buffer(con);
+    set_iconv(con);
+    con->save = -1000;
+    return z;
+}
+
+static void mtz_cleanup(void *data)
+{
+    R_mtz_free(data);
+}
+
+/* R_mtz_finish can signal an error, but the file is closed anyway */
+static void mtz_close_con(Rconnection con, Rmtzfile z)
+{
+    RCNTXT cntxt;
+
+    con->isopen = FALSE;
+    begincontext(&cntxt, CTXT_CCODE, R_NilValue, R_BaseEnv, R_BaseEnv,
+		 R_NilValue, R_NilValue);
+    cntxt.cend = &mtz_cleanup;
+    cntxt.cenddata = z;
+    R_mtz_finish(z);
+    endcontext(&cntxt);
+    R_mtz_free(z);
+}
+
 static Rboolean gzfile_open(Rconnection con)
 {
     gzFile fp;
@@ -1692,6 +1747,11 @@ static Rboolean gzfile_open(Rconnection con)
     Rgzfileconn gzcon = con->private;
     const char *name;
 
+    if (gzcon->threads > 1 && con->mode[0] != 'a') {
+	gzcon->mtz = mtz_open_con(con, 1, gzcon->compress, gzcon->threads);
+	return gzcon->mtz != NULL;
+    }
+
     strcpy(mode, con->mode);
     /* Must open as binary */
     if(strchr(con->mode, 'w')) snprintf(mode, 6, "wb%1d", gzcon->compress);
@@ -1724,15 +1784,25 @@ static Rboolean gzfile_open(Rconnection con)
 
 static void gzfile_close(Rconnection con)
 {
-    R_gzclose(((Rgzfileconn)(con->private))->fp);
+    Rgzfileconn gzcon = con->private;
+    if (gzcon->mtz) {
+	Rmtzfile z = gzcon->mtz;
+	gzcon->mtz = NULL;
+	mtz_close_con(con, z);
+	return;
+    }
+    R_gzclose(gzcon->fp);
     con->isopen = FALSE;
 }
 
 static int gzfile_fgetc_internal(Rconnection con)
 {
-    gzFile fp = ((Rgzfileconn)(con->private))->fp;
+    Rgzfileconn gzcon = con->private;
+    gzFile fp = gzcon->fp;
     unsigned char c;
 
+    if (gzcon->mtz)
+	return R_mtz_read(gzcon->mtz, &c, 1) == 1 ? c : R_EOF;
     return R_gzread(fp, &c, 1) == 1 ? c : R_EOF;
 }
 
@@ -1741,6 +1811,8 @@ static int gzfile_fgetc_internal(Rconnection con)
 static double gzfile_seek(Rconnection con, double where, int origin, int rw)
 {
     gzFile  fp = ((Rgzfileconn)(con->private))->fp;
+    if (((Rgzfileconn)(con->private))->mtz)
+	error(_("seek is not supported for connections using several threads"));
     Rz_off_t pos = R_gztell(fp);
     int res, whence = SEEK_SET;
 
@@ -1766,6 +1838,9 @@ static size_t gzfile_read(void *ptr, size_t size, size_t nitems,
 			Rconnection con)
 {
     gzFile fp = ((Rgzfileconn)(con->private))->fp;
+    if (((Rgzfileconn)(con->private))->mtz)
+	return R_mtz_read(((Rgzfileconn)(con->private))->mtz, ptr,
+			  size * nitems) / size;
     /* uses 'unsigned' for len */
     if ((double) size * (double) nitems > UINT_MAX)
 	error(_("too large a block specified"));
@@ -1776,6 +1851,10 @@ static size_t gzfile_write(const void *ptr, size_t size, size_t nitems,
 			   Rconnection con)
 {
     gzFile fp = ((Rgzfileconn)(con->private))->fp;
+    if (((Rgzfileconn)(con->private))->mtz) {
+	R_mtz_write(((Rgzfileconn)(con->private))->mtz, ptr, size * nitems);
+	return nitems;
+    }
     /* uses 'unsigned' for len */
     if ((double) size * (double) nitems > UINT_MAX)
 	error(_("too large a block specified"));
@@ -1783,7 +1862,7 @@ static size_t gzfile_write(const void *ptr, size_t size, size_t nitems,
 }
 
 static Rconnection newgzfile(const char *description, const char *mode,
-			     int compress)
+			     int compress, int threads)
 {
     Rconnection new;
     new = (Rconnection) malloc(sizeof(struct Rconn));
@@ -1820,6 +1899,8 @@ static Rconnection newgzfile(const char *description, const char *mode,
 	/* for Solaris 12.5 */ new = NULL;
     }
     ((Rgzfileconn)new->private)->compress = compress;
+    ((Rgzfileconn)new->private)->threads = threads;
+    ((Rgzfileconn)new->private)->mtz = NULL;
     return new;
 }
 
@@ -2023,6 +2104,8 @@ typedef struct xzfileconn {
     lzma_action action;
     int compress;
     int type;
+    int threads;
+    Rmtzfile mtz;	/* used instead of 'fp' with several threads */
     lzma_filter filters[2];
     lzma_options_lzma opt_lzma;
     unsigned char buf[BUFSIZE];
@@ -2035,6 +2118,11 @@ static Rboolean xzfile_open(Rconnection con)
     char mode[] = "rb";
     const char *name;
 
+    /* not for lzma (type 1) files */
+    if (xz->threads > 1 && con->mode[0] != 'a' && xz->type != 1) {
+	xz->mtz = mtz_open_con(con, 3, xz->compress, xz->threads);
+	return xz->mtz != NULL;
+    }
     con->canwrite = (con->mode[0] == 'w' || con->mode[0] == 'a');
     con->canread = !con->canwrite;
     /* regardless of the R view of the file, the file must be opened in
@@ -2094,6 +2182,12 @@ static void xzfile_close(Rconnection con)
 {
     Rxzfileconn xz = con->private;
 
+    if (xz->mtz) {
+	Rmtzfile z = xz->mtz;
+	xz->mtz = NULL;
+	mtz_close_con(con, z);
+	return;
+    }
     if(con->canwrite) {
 	lzma_ret ret;
 	lzma_stream *strm = &(xz->stream);
@@ -2123,6 +2217,7 @@ static size_t xzfile_read(void *ptr, size_t size, size_t nitems,
     unsigned char *p = ptr;
 
     if (!s) return 0;
+    if (xz->mtz) return R_mtz_read(xz->mtz, ptr, s) / size;
 
     while(1) {
 	if (strm->avail_in == 0 && xz->action != LZMA_FINISH) {
@@ -2179,6 +2274,10 @@ static size_t xzfile_write(const void *ptr, size_t size, size_t nitems,
     unsigned char buf[BUFSIZE];
 
     if (!s) return 0;
+    if (xz->mtz) {
+	R_mtz_write(xz->mtz, ptr, s);
+	return nitems;
+    }
 
     strm->avail_in = s;
     strm->next_in = p;
@@ -2203,7 +2302,8 @@ static size_t xzfile_write(const void *ptr, size_t size, size_t nitems,
 }
 
 static Rconnection
-newxzfile(const char *description, const char *mode, int type, int compress)
+newxzfile(const char *description, const char *mode, int type, int compress,
+	  int threads)
 {
     Rconnection new;
     new = (Rconnection) malloc(sizeof(struct Rconn));
@@ -2242,15 +2342,571 @@ newxzfile(const char *description, const char *mode, int type, int compress)
     }
     ((Rxzfileconn) new->private)->type = type;
     ((Rxzfileconn) new->private)->compress = compress;
+    ((Rxzfileconn) new->private)->threads = threads;
     return new;
 }
 
+/* Compressed files coded by several threads, used by saveRDS() and
+   readRDS() with 'threads > 1'.
+
+   gzip files are written as a series of gzip members, each holding up
+   to MTZ_BLOCKSIZE bytes of input and recording its own length in an
+   'RB' subfield of the gzip extra field.  The members are compressed
+   independently by the threads, and as the length of each can be
+   found without decompressing it, they can be decompressed in
+   parallel too.  Any gzip decompressor can read such files.
+
+   xz files use the multi-threaded coders of liblzma where these are
+   available (encoding from 5.2.0, decoding from 5.4.0), and other
+   files are read sequentially.
+
+   R_mtz_read and R_mtz_write signal errors, so the caller should
+   ensure that R_mtz_free is called if they do. */
+
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#define MTZ_BLOCKSIZE 1048576
+#define MTZ_GZHDR 20
+
+enum { MTZ_EMPTY, MTZ_READY, MTZ_BUSY, MTZ_DONE, MTZ_FAILED };
+enum { MTZ_GZBLOCKS, MTZ_XZ, MTZ_BZ2, MTZ_GZIO };
+
+typedef struct {
+    int state;
+    unsigned char *in, *out;
+    size_t inlen, outlen, insize, outsize;
+} mtzblock;
+
+struct mtzfile {
+    FILE *fp;
+    int type, level, nblocks;
+    Rboolean write, eof;
+    mtzblock *blocks;
+    size_t filled;	/* number of blocks handed to the coder */
+    size_t taken;	/* number of blocks picked up by a thread */
+    size_t done;	/* number of blocks written out or consumed */
+    size_t pos;		/* read position in the current block */
+    lzma_stream strm;
+    BZFILE *bfp;
+    gzFile gz;
+    unsigned char buf[BUFSIZE];
+#ifdef HAVE_PTHREAD
+    int nthreads;
+    Rboolean stop;
+    pthread_t *threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t work, finished;
+#endif
+};
+
+static void put_le32(unsigned char *p, size_t x)
+{
+    for (int i = 0; i < 4; i++, x >>= 8) p[i] = (unsigned char)(x & 0xff);
+}
+
+static size_t get_le32(const unsigned char *p)
+{
+    return (size_t) p[0] | (size_t) p[1] << 8 | (size_t) p[2] << 16 |
+	(size_t) p[3] << 24;
+}
+
+static Rboolean mtz_reserve(unsigned char **buf, size_t *size, size_t need)
+{
+    if (need > *size) {
+	unsigned char *p = realloc(*buf, need);
+	if (!p) return FALSE;
+	*buf = p;
+	*size = need;
+    }
+    return TRUE;
+}
+
+static Rboolean mtz_is_block(const unsigned char *h)
+{
+    return h[0] == 0x1f && h[1] == 0x8b && h[2] == Z_DEFLATED &&
+	h[3] == EXTRA_FIELD && h[10] == 8 && h[11] == 0 &&
+	h[12] == 'R' && h[13] == 'B' && h[14] == 4 && h[15] == 0;
+}
+
+/* These two use no R API functions as they run in the threads */
+static Rboolean mtz_deflate(mtzblock *b, int level)
+{
+    z_stream s;
+    size_t need, clen;
+    int res;
+
+    memset(&s, 0, sizeof(s));
+    if (deflateInit2(&s, level, Z_DEFLATED, -MAX_WBITS, 8,
+		     Z_DEFAULT_STRATEGY) != Z_OK)
+	return FALSE;
+    need = deflateBound(&s, (uLong) b->inlen) + MTZ_GZHDR + 8;
+    if (!mtz_reserve(&b->out, &b->outsize, need)) {
+	deflateEnd(&s);
+	return FALSE;
+    }
+    s.next_in = b->in;
+    s.avail_in = (uInt) b->inlen;
+    s.next_out = b->out + MTZ_GZHDR;
+    s.avail_out = (uInt) (need - MTZ_GZHDR - 8);
+    res = deflate(&s, Z_FINISH);
+    clen = s.total_out;
+    deflateEnd(&s);
+    if (res != Z_STREAM_END) return FALSE;
+
+    unsigned char *h = b->out;
+    memset(h, 0, MTZ_GZHDR);
+    h[0] = 0x1f; h[1] = 0x8b; h[2] = Z_DEFLATED; h[3] = EXTRA_FIELD;
+    h[9] = OS_CODE;
+    h[10] = 8; /* XLEN */
+    h[12] = 'R'; h[13] = 'B'; h[14] = 4;
+    b->outlen = MTZ_GZHDR + clen + 8;
+    put_le32(h + 16, b->outlen);
+    put_le32(h + MTZ_GZHDR + clen, crc32(0L, b->in, (uInt) b->inlen));
+    put_le32(h + MTZ_GZHDR + clen + 4, b->inlen);
+    return TRUE;
+}
+
+static Rboolean mtz_inflate(mtzblock *b)
+{
+    z_stream s;
+    size_t len;
+    Rboolean ok;
+
+    if (b->inlen < MTZ_GZHDR + 8) return FALSE;
+    len = get_le32(b->in + b->inlen - 4);
+    if (!mtz_reserve(&b->out, &b->outsize, len ? len : 1)) return FALSE;
+    memset(&s, 0, sizeof(s));
+    if (inflateInit2(&s, -MAX_WBITS) != Z_OK) return FALSE;
+    s.next_in = b->in + MTZ_GZHDR;
+    s.avail_in = (uInt) (b->inlen - MTZ_GZHDR - 8);
+    s.next_out = b->out;
+    s.avail_out = (uInt) len;
+    ok = inflate(&s, Z_FINISH) == Z_STREAM_END && s.total_out == len;
+    inflateEnd(&s);
+    b->outlen = len;
+    return ok &&
+	crc32(0L, b->out, (uInt) len) == get_le32(b->in + b->inlen - 8);
+}
+
+static int mtz_code(struct mtzfile *z, mtzblock *b)
+{
+    Rboolean ok = z->write ? mtz_deflate(b, z->level) : mtz_inflate(b);
+    return ok ? MTZ_DONE : MTZ_FAILED;
+}
+
+#ifdef HAVE_PTHREAD
+static void *mtz_worker(void *arg)
+{
+    struct mtzfile *z = arg;
+
+    pthread_mutex_lock(&z->mutex);
+    while (1) {
+	while (!z->stop && z->taken == z->filled)
+	    pthread_cond_wait(&z->work, &z->mutex);
+	if (z->stop) break;
+	mtzblock *b = z->blocks + z->taken++ % z->nblocks;
+	b->state = MTZ_BUSY;
+	pthread_mutex_unlock(&z->mutex);
+	int state = mtz_code(z, b);
+	pthread_mutex_lock(&z->mutex);
+	b->state = state;
+	pthread_cond_broadcast(&z->finished);
+    }
+    pthread_mutex_unlock(&z->mutex);
+    return NULL;
+}
+#endif
+
+/* hand block number z->filled to the threads, or code it now */
+static void mtz_submit(struct mtzfile *z)
+{
+    mtzblock *b = z->blocks + z->filled % z->nblocks;
+#ifdef HAVE_PTHREAD
+    if (z->nthreads) {
+	pthread_mutex_lock(&z->mutex);
+	b->state = MTZ_READY;
+	z->filled++;
+	pthread_cond_signal(&z->work);
+	pthread_mutex_unlock(&z->mutex);
+	return;
+    }
+#endif
+    b->state = mtz_code(z, b);
+    z->filled++;
+    z->taken++;
+}
+
+/* wait until block number z->done has been coded */
+static mtzblock *mtz_wait(struct mtzfile *z)
+{
+    mtzblock *b = z->blocks + z->done % z->nblocks;
+#ifdef HAVE_PTHREAD
+    if (z->nthreads) {
+	pthread_mutex_lock(&z->mutex);
+	while (b->state == MTZ_READY || b->state == MTZ_BUSY)
+	    pthread_cond_wait(&z->finished, &z->mutex);
+	pthread_mutex_unlock(&z->mutex);
+    }
+#endif
+    if (b->state == MTZ_FAILED)
+	error(z->write ? _("compression failed") :
+	      _("corrupt data in compressed file"));
+    return b;
+}
+
+/* write out the blocks before number 'upto' */
+static void mtz_flush(struct mtzfile *z, size_t upto)
+{
+    while (z->done < upto) {
+	mtzblock *b = mtz_wait(z);
+	if (fwrite(b->out, 1, b->outlen, z->fp) != b->outlen)
+	    error(_("error writing to file"));
+	b->state = MTZ_EMPTY;
+	b->inlen = 0;
+	z->done++;
+    }
+}
+
+/* read members until all the blocks are in use */
+static void mtz_fill(struct mtzfile *z)
+{
+    while (!z->eof && z->filled < z->done + z->nblocks) {
+	mtzblock *b = z->blocks + z->filled % z->nblocks;
+	unsigned char h[MTZ_GZHDR];
+	size_t n = fread(h, 1, MTZ_GZHDR, z->fp), len;
+	if (n == 0 && feof(z->fp)) {
+	    z->eof = TRUE;
+	    break;
+	}
+	if (n != MTZ_GZHDR || !mtz_is_block(h) ||
+	    (len = get_le32(h + 16)) < MTZ_GZHDR + 8)
+	    error(_("corrupt data in compressed file"));
+	if (!mtz_reserve(&b->in, &b->insize, len))
+	    error(_("cannot allocate buffer"));
+	memcpy(b->in, h, MTZ_GZHDR);
+	if (fread(b->in + MTZ_GZHDR, 1, len - MTZ_GZHDR, z->fp) !=
+	    len - MTZ_GZHDR)
+	    error(_("corrupt data in compressed file"));
+	b->inlen = len;
+	mtz_submit(z);
+    }
+}
+
+static void mtz_lzma_error(lzma_ret ret)
+{
+    switch(ret) {
+    case LZMA_MEM_ERROR:
+    case LZMA_MEMLIMIT_ERROR:
+	error("lzma coder needed more memory");
+    case LZMA_FORMAT_ERROR:
+	error("lzma decoder format error");
+    case LZMA_DATA_ERROR:
+	error("lzma decoder corrupt data");
+    default:
+	error("lzma coding result %d", ret);
+    }
+}
+
+/* 'type' is 1 for gzip or 3 for xz output.  For input 3 accepts only
+   xz, as xzfile() does, and any other value the formats gzfile() reads */
+attribute_hidden
+Rmtzfile R_mtz_open(const char *path, Rboolean write, int type, int level,
+		    int threads)
+{
+    const char *name = R_ExpandFileName(path);
+    FILE *fp;
+    Rmtzfile z;
+    lzma_ret ret = LZMA_OK;
+
+    errno = 0; /* precaution */
+    fp = R_fopen(name, write ? "wb" : "rb");
+    if (!fp)
+	error(_("cannot open file '%s': %s"), name, strerror(errno));
+    z = calloc(1, sizeof(struct mtzfile));
+    if (!z) {
+	fclose(fp);
+	error(_("cannot allocate buffer"));
+    }
+    z->fp = fp;
+    z->write = write;
+    z->level = level;
+    if (write)
+	z->type = type == 3 ? MTZ_XZ : MTZ_GZBLOCKS;
+    else {
+	unsigned char h[MTZ_GZHDR];
+	size_t n = fread(h, 1, MTZ_GZHDR, fp);
+	rewind(fp);
+	if (n == MTZ_GZHDR && mtz_is_block(h))
+	    z->type = MTZ_GZBLOCKS;
+	else if (n >= 6 && !memcmp(h, "\xFD" "7zXZ", 5))
+	    z->type = MTZ_XZ;
+	else if (n >= 3 && !memcmp(h, "BZh", 3))
+	    z->type = MTZ_BZ2;
+	else
+	    z->type = MTZ_GZIO;
+	if (type == 3 && z->type != MTZ_XZ) {
+	    R_mtz_free(z);
+	    error(_("file '%s' appears not to be compressed by xz"), name);
+	}
+    }
+
+    switch(z->type) {
+    case MTZ_GZBLOCKS:
+	z->nblocks = threads > 1 ? 2 * threads : 1;
+	z->blocks = calloc(z->nblocks, sizeof(mtzblock));
+	if (!z->blocks) break;
+	if (write)
+	    for (int i = 0; i < z->nblocks; i++)
+		if (!mtz_reserve(&z->blocks[i].in, &z->blocks[i].insize,
+				 MTZ_BLOCKSIZE)) {
+		    R_mtz_free(z);
+		    error(_("cannot allocate buffer"));
+		}
+#ifdef HAVE_PTHREAD
+	if (threads > 1 && (z->threads = calloc(threads, sizeof(pthread_t)))) {
+	    pthread_mutex_init(&z->mutex, NULL);
+	    pthread_cond_init(&z->work, NULL);
+	    pthread_cond_init(&z->finished, NULL);
+	    while (z->nthreads < threads &&
+		   !pthread_create(z->threads + z->nthreads, NULL,
+				   mtz_worker, z))
+		z->nthreads++;
+	}
+#endif
+	break;
+    case MTZ_XZ:
+	if (write) {
+	    uint32_t preset = abs(level);
+	    if (level < 0) preset |= LZMA_PRESET_EXTREME;
+#if LZMA_VERSION >= 50020002
+	    if (threads > 1) {
+		lzma_mt mt;
+		memset(&mt, 0, sizeof(mt));
+		mt.threads = threads;
+		mt.preset = preset;
+		mt.check = LZMA_CHECK_CRC32;
+		ret = lzma_stream_encoder_mt(&z->strm, &mt);
+	    } else
+#endif
+		ret = lzma_easy_encoder(&z->strm, preset, LZMA_CHECK_CRC32);
+	} else {
+#if LZMA_VERSION >= 50040002
+	    if (threads > 1) {
+		lzma_mt mt;
+		memset(&mt, 0, sizeof(mt));
+		mt.flags = LZMA_CONCATENATED;
+		mt.threads = threads;
+		mt.memlimit_threading = lzma_physmem() / 4;
+		mt.memlimit_stop = UINT64_MAX;
+		ret = lzma_stream_decoder_mt(&z->strm, &mt);
+	    } else
+#endif
+		ret = lzma_stream_decoder(&z->strm, 536870912,
+					  LZMA_CONCATENATED);
+	}
+	break;
+    case MTZ_BZ2:
+    {
+	int bzerror;
+	z->bfp = BZ2_bzReadOpen(&bzerror, fp, 0, 0, NULL, 0);
+	if (bzerror != BZ_OK) {
+	    R_mtz_free(z);
+	    error(_("file '%s' appears not to be compressed by bzip2"), name);
+	}
+	break;
+    }
+    case MTZ_GZIO:
+	fclose(fp);
+	z->fp = NULL;
+	if (!(z->gz = R_gzopen(name, "rb"))) {
+	    R_mtz_free(z);
+	    error(_("cannot open compressed file '%s'"), name);
+	}
+	break;
+    }
+    if (ret != LZMA_OK || (z->type == MTZ_GZBLOCKS && !z->blocks)) {
+	R_mtz_free(z);
+	if (ret != LZMA_OK) mtz_lzma_error(ret);
+	error(_("cannot allocate buffer"));
+    }
+    return z;
+}
+
+attribute_hidden
+void R_mtz_write(Rmtzfile z, const void *ptr, size_t n)
+{
+    const unsigned char *p = ptr;
+
+    if (z->type == MTZ_XZ) {
+	lzma_stream *strm = &z->strm;
+	strm->next_in = p;
+	strm->avail_in = n;
+	while (strm->avail_in) {
+	    strm->next_out = z->buf;
+	    strm->avail_out = BUFSIZE;
+	    lzma_ret ret = lzma_code(strm, LZMA_RUN);
+	    if (ret != LZMA_OK) mtz_lzma_error(ret);
+	    size_t nout = BUFSIZE - strm->avail_out;
+	    if (fwrite(z->buf, 1, nout, z->fp) != nout)
+		error(_("error writing to file"));
+	}
+	return;
+    }
+    while (n > 0) {
+	mtzblock *b = z->blocks + z->filled % z->nblocks;
+	if (b->state != MTZ_EMPTY)
+	    mtz_flush(z, z->filled - z->nblocks + 1);
+	size_t k = MTZ_BLOCKSIZE - b->inlen;
+	if (k > n) k = n;
+	memcpy(b->in + b->inlen, p, k);
+	b->inlen += k;
+	p += k;
+	n -= k;
+	if (b->inlen == MTZ_BLOCKSIZE) mtz_submit(z);
+    }
+}
+
+/* returns the number of bytes read, less than 'n' only at the end */
+attribute_hidden
+size_t R_mtz_read(Rmtzfile z, void *ptr, size_t n)
+{
+    unsigned char *p = ptr;
+    size_t got = 0;
+
+    switch(z->type) {
+    case MTZ_GZBLOCKS:
+	while (got < n) {
+	    mtz_fill(z);
+	    if (z->done == z->filled) break;
+	    mtzblock *b = mtz_wait(z);
+	    size_t k = b->outlen - z->pos;
+	    if (k > n - got) k = n - got;
+	    memcpy(p + got, b->out + z->pos, k);
+	    got += k;
+	    z->pos += k;
+	    if (z->pos == b->outlen) {
+		b->state = MTZ_EMPTY;
+		z->done++;
+		z->pos = 0;
+	    }
+	}
+	break;
+    case MTZ_XZ:
+    {
+	lzma_stream *strm = &z->strm;
+	strm->next_out = p;
+	strm->avail_out = n;
+	while (strm->avail_out) {
+	    if (strm->avail_in == 0 && !z->eof) {
+		strm->next_in = z->buf;
+		strm->avail_in = fread(z->buf, 1, BUFSIZE, z->fp);
+		z->eof = feof(z->fp) != 0;
+	    }
+	    lzma_ret ret = lzma_code(strm, z->eof ? LZMA_FINISH : LZMA_RUN);
+	    if (ret == LZMA_STREAM_END) break;
+	    if (ret != LZMA_OK) mtz_lzma_error(ret);
+	}
+	got = n - strm->avail_out;
+	break;
+    }
+    case MTZ_BZ2:
+	while (got < n && !z->eof) {
+	    int bzerror, len = n - got > INT_MAX ? INT_MAX : (int)(n - got);
+	    got += BZ2_bzRead(&bzerror, z->bfp, p + got, len);
+	    if (bzerror == BZ_STREAM_END)
+		z->eof = TRUE;
+	    else if (bzerror != BZ_OK)
+		error(_("corrupt data in compressed file"));
+	}
+	break;
+    case MTZ_GZIO:
+	while (got < n) {
+	    unsigned len = n - got > UINT_MAX ? UINT_MAX : (unsigned)(n - got);
+	    int res = R_gzread(z->gz, p + got, len);
+	    if (res < 0) error(_("corrupt data in compressed file"));
+	    if (res == 0) break;
+	    got += res;
+	}
+	break;
+    }
+    return got;
+}
+
+/* write out the remaining output */
+attribute_hidden
+void R_mtz_finish(Rmtzfile z)
+{
+    if (!z->write) return;
+    if (z->type == MTZ_XZ) {
+	lzma_stream *strm = &z->strm;
+	lzma_ret ret;
+	strm->avail_in = 0;
+	do {
+	    strm->next_out = z->buf;
+	    strm->avail_out = BUFSIZE;
+	    ret = lzma_code(strm, LZMA_FINISH);
+	    if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+		mtz_lzma_error(ret);
+	    size_t nout = BUFSIZE - strm->avail_out;
+	    if (fwrite(z->buf, 1, nout, z->fp) != nout)
+		error(_("error writing to file"));
+	} while (ret != LZMA_STREAM_END);
+    } else {
+	mtzblock *b = z->blocks + z->filled % z->nblocks;
+	if (b->inlen > 0 || z->filled == 0) {
+	    if (b->state != MTZ_EMPTY)
+		mtz_flush(z, z->filled - z->nblocks + 1);
+	    mtz_submit(z);
+	}
+	mtz_flush(z, z->filled);
+    }
+    if (fflush(z->fp))
+	error(_("error writing to file"));
+}
+
+/* stops the threads and frees all resources: never signals an error */
+attribute_hidden
+void R_mtz_free(Rmtzfile z)
+{
+#ifdef HAVE_PTHREAD
+    if (z->threads) {
+	pthread_mutex_lock(&z->mutex);
+	z->stop = TRUE;
+	pthread_cond_broadcast(&z->work);
+	pthread_mutex_unlock(&z->mutex);
+	for (int i = 0; i < z->nthreads; i++)
+	    pthread_join(z->threads[i], NULL);
+	pthread_mutex_destroy(&z->mutex);
+	pthread_cond_destroy(&z->work);
+	pthread_cond_destroy(&z->finished);
+	free(z->threads);
+    }
+#endif
+    if (z->blocks) {
+	for (int i = 0; i < z->nblocks; i++) {
+	    free(z->blocks[i].in);
+	    free(z->blocks[i].out);
+	}
+	free(z->blocks);
+    }
+    if (z->type == MTZ_XZ) lzma_end(&z->strm);
+    if (z->bfp) {
+	int bzerror;
+	BZ2_bzReadClose(&bzerror, z->bfp);
+    }
+    if (z->gz) R_gzclose(z->gz);
+    if (z->fp) fclose(z->fp);
+    free(z);
+}
+
 /* op 0 is gzfile, 1 is bzfile, 2 is xv/lzma */
 SEXP attribute_hidden do_gzfile(SEXP call, SEXP op, SEXP args, SEXP env)
 {
     SEXP sfile, sopen, ans, class, enc;
     const char *file, *open;
-    int ncon, compress = 9;
+    int ncon, compress = 9, threads = 1;
     Rconnection con = NULL;
     int type = PRIMVAL(op);
     int subtype = 0;
@@ -2280,6 +2936,11 @@ SEXP attribute_hidden do_gzfile(SEXP call, SEXP op, SEXP args, SEXP env)
 	if(compress == NA_LOGICAL || abs(compress) > 9)
 	    error(_("invalid '%s' argument"), "compress");
     }
+    if(type != 1) {
+	threads = asInteger(CAD4R(args));
+	if(threads == NA_INTEGER || threads < 1)
+	    error(_("invalid '%s' argument"), "threads");
+    }
     open = CHAR(STRING_ELT(sopen, 0)); /* ASCII */
     if (type == 0 && (!open[0] || open[0] == 'r')) {
 	/* check magic no */
@@ -2304,13 +2965,14 @@ SEXP attribute_hidden do_gzfile(SEXP call, SEXP op, SEXP args, SEXP env)
     }
     switch(type) {
     case 0:
-	con = newgzfile(file, strlen(open) ? open : "rb", compress);
+	con = newgzfile(file, strlen(open) ? open : "rb", compress, threads);
 	break;
     case 1:
 	con = newbzfile(file, strlen(open) ? open : "rb", compress);
 	break;
     case 2:
-	con = newxzfile(file, strlen(open) ? open : "rb", subtype, compress);
+	con = newxzfile(file, strlen(open) ? open : "rb", subtype, compress,
+			threads);
 	break;
     }
     ncon = NextConnection();
@@ -5553,13 +6215,13 @@ SEXP attribute_hidden do_url(SEXP call, SEXP op, SEXP args, SEXP env)
 			con = newfile(url, ienc, strlen(open) ? open : "r", raw);
 			break;
 		    case 0:
-			con = newgzfile(url, strlen(open) ? open : "rt", compress);
+			con = newgzfile(url, strlen(open) ? open : "rt", compress, 1);
 			break;
 		    case 1:
 			con = newbzfile(url, strlen(open) ? open : "rt", compress);
 			break;
 		    case 2:
-			con = newxzfile(url, strlen(open) ? open : "rt", subtype, compress);
+			con = newxzfile(url, strlen(open) ? open : "rt", subtype, compress, 1);
 			break;
 		    }
 		} else
@@ -6364,6 +7026,78 @@ SEXP R_decompress3(SEXP in, Rboolean *err)
     return ans;
 }
 
+/* Versions of R_decompress1/2/3 working on buffers, used for lazy-load
+   DB entries: 'in' holds 'inlen' bytes written by R_compress<type> and
+   'out' must have room for R_decompressed_length(in) bytes.  These use
+   no R API functions, so may be called from threads other than the main
+   one.  R_decompress_buffer returns FALSE if the data are corrupt. */
+attribute_hidden
+unsigned int R_decompressed_length(const unsigned char *in)
+{
+    unsigned int len;
+    memcpy(&len, in, sizeof(len));
+    return uiSwap(len);
+}
+
+attribute_hidden
+Rboolean R_decompress_buffer(int type, const unsigned char *in, size_t inlen,
+			     unsigned char *out)
+{
+    unsigned int outlen = R_decompressed_length(in);
+    size_t hdr = type == 1 ? 4 : 5;
+    char method = type == 1 ? '1' : (char) in[4];
+
+    if (inlen < hdr || (type == 2 && method == 'Z'))
+	return FALSE;
+    in += hdr;
+    inlen -= hdr;
+    switch(method) {
+    case 'Z':
+    {
+	/* as init_filters, but local for thread safety */
+	lzma_options_lzma opt_lzma;
+	lzma_filter lfilters[2];
+	if (lzma_lzma_preset(&opt_lzma, 6))
+	    return FALSE;
+	lfilters[0].id = LZMA_FILTER_LZMA2;
+	lfilters[0].options = &opt_lzma;
+	lfilters[1].id = LZMA_VLI_UNKNOWN;
+	lzma_stream strm = LZMA_STREAM_INIT;
+	if (lzma_raw_decoder(&strm, lfilters) != LZMA_OK)
+	    return FALSE;
+	strm.next_in = in;
+	strm.avail_in = inlen;
+	strm.next_out = out;
+	strm.avail_out = outlen;
+	lzma_ret ret = lzma_code(&strm, LZMA_RUN);
+	Rboolean ok = (ret == LZMA_OK || ret == LZMA_STREAM_END) &&
+	    strm.avail_out == 0;
+	lzma_end(&strm);
+	return ok;
+    }
+    case '2':
+    {
+	unsigned int len = outlen;
+	return BZ2_bzBuffToBuffDecompress((char *) out, &len, (char *) in,
+					  (unsigned int) inlen, 0, 0) == BZ_OK
+	    && len == outlen;
+    }
+    case '1':
+    {
+	uLong len = outlen;
+	return uncompress(out, &len, in, (uLong) inlen) == Z_OK &&
+	    len == outlen;
+    }
+    case '0':
+	if (inlen < outlen)
+	    return FALSE;
+	memcpy(out, in, outlen);
+	return TRUE;
+    default:
+	return FALSE;
+    }
+}
+
 SEXP attribute_hidden
 do_memCompress(SEXP call, SEXP op, SEXP args, SEXP env)
 {
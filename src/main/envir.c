@@ -95,6 +95,7 @@
 #include <Defn.h>
 #include <Internal.h>
 #include <R_ext/Callbacks.h>
+#include <stdint.h>
 
 #define FAST_BASE_CACHE_LOOKUP  /* Define to enable fast lookups of symbols */
 				/*    in global cache from base environment */
@@ -244,12 +245,12 @@ int attribute_hidden R_Newhashpjw(const char *s)
 
   Hashtable set function.  Sets 'symbol' in 'table' to be 'value'.
   'hashcode' must be provided by user.	Allocates some memory for list
-  entries.
+  entries.  Returns TRUE if a new binding was added.
 
 */
 
-static void R_HashSet(int hashcode, SEXP symbol, SEXP table, SEXP value,
-		      Rboolean frame_locked)
+static Rboolean R_HashSet(int hashcode, SEXP symbol, SEXP table, SEXP value,
+			  Rboolean frame_locked)
 {
     SEXP chain;
 
@@ -261,7 +262,7 @@ static void R_HashSet(int hashcode, SEXP symbol, SEXP table, SEXP value,
 	if (TAG(chain) == symbol) {
 	    SET_BINDING_VALUE(chain, value);
 	    SET_MISSING(chain, 0);	/* Over-ride for new value */
-	    return;
+	    return FALSE;
 	}
     if (frame_locked)
 	error(_("cannot add bindings to a locked environment"));
@@ -270,7 +271,7 @@ static void R_HashSet(int hashcode, SEXP symbol, SEXP table, SEXP value,
     /* Add the value into the chain */
     SET_VECTOR_ELT(table, hashcode, CONS(value, VECTOR_ELT(table, hashcode)));
     SET_TAG(VECTOR_ELT(table, hashcode), symbol);
-    return;
+    return TRUE;
 }
 
 
@@ -403,6 +404,7 @@ static void R_HashDelete(int hashcode, SEXP symbol, SEXP env, int *found)
     if (*found) {
 	if (env == R_GlobalEnv)
 	    R_DirtyImage = 1;
+	R_FlushFunCache(env, symbol);
 	if (list == R_NilValue)
 	    SET_HASHPRI(hashtab, HASHPRI(hashtab) - 1);
 	SET_VECTOR_ELT(hashtab, idx, list);
@@ -1586,6 +1588,206 @@ SEXP findFun(SEXP symbol, SEXP rho)
     return findFun3(symbol, rho, R_CurrentExpression);
 }
 
+/*----------------------------------------------------------------------
+
+  Function lookup caches
+
+  The byte code interpreter remembers the binding where findFun found
+  a function, in a table indexed by the symbol and the environment in
+  which the search left the function frames.  A later call of the
+  symbol from a frame whose enclosures lead to the same environment
+  through function frames not binding the symbol can then read the
+  function from the binding directly.  The table has a fixed size, and
+  an entry replaces any other entry it collides with.
+
+  This remains valid as long as the environments searched after the
+  function frames keep their enclosures and neither gain nor lose a
+  binding of the symbol; the values of the bindings may change, as the
+  value is read on each use.  These environments and the symbol are
+  marked, and adding or removing a binding of a marked symbol in a
+  marked environment, or changing the enclosure of a marked
+  environment, increments R_FunCacheVersion, which invalidates all the
+  caches.  Only searches leaving the function frames at the global
+  environment, a package environment or a namespace, and not passing
+  through unhashed environments or user databases, are cached.
+
+  Adding or removing a binding thus costs a test of two flags; new
+  variables, such as those a loop assigns in the global environment,
+  leave the caches alone.  But defining or removing a function, or any
+  other value, under a name that has been called through a cache, or
+  looked up as an S3 method, invalidates all of them, and code doing
+  that repeatedly loses the benefit of the caches.  The S3 dispatch
+  cache in objects.c uses the same marks and version.  The S4 dispatch
+  cache of the methods package marks its method tables separately, and
+  changes to them only increment R_MethodsCacheVersion.
+*/
+
+#define FUNCACHE_FRAME_MASK (1<<13)
+#define IS_FUNCACHE_FRAME(e) (ENVFLAGS(e) & FUNCACHE_FRAME_MASK)
+#define METHODSCACHE_FRAME_MASK (1<<11)
+#define IS_METHODSCACHE_FRAME(e) (ENVFLAGS(e) & METHODSCACHE_FRAME_MASK)
+#define MARK_AS_CACHE_FRAME(e, mask) SET_ENVFLAGS(e, ENVFLAGS(e) | (mask))
+
+#define FUNCACHE_SYMBOL_MASK (1<<10)
+#define IS_FUNCACHE_SYMBOL(s) (LEVELS(s) & FUNCACHE_SYMBOL_MASK)
+#define MARK_AS_FUNCACHE_SYMBOL(s) \
+  SETLEVELS(s, LEVELS(s) | FUNCACHE_SYMBOL_MASK)
+
+/* Called before a binding of 'symbol' is added to or removed from the
+   frame of rho, or with R_NilValue before the enclosure of rho
+   changes */
+void attribute_hidden R_FlushFunCache(SEXP rho, SEXP symbol)
+{
+    if (symbol == R_NilValue || IS_FUNCACHE_SYMBOL(symbol)) {
+	if (IS_FUNCACHE_FRAME(rho))
+	    R_FunCacheVersion++;
+	if (IS_METHODSCACHE_FRAME(rho))
+	    R_MethodsCacheVersion++;
+    }
+}
+
+#define FUNCACHE_SIZE 4096
+#define FUNCACHE_SYMBOL 0
+#define FUNCACHE_START  1
+#define FUNCACHE_LOC    2 /* a cons cell or for the base environments
+			     the symbol */
+#define FUNCACHE_ENTRY  3
+
+static SEXP FunCache = NULL;
+static R_xlen_t FunCacheVersion = 0;
+
+static R_INLINE int funCacheIndex(SEXP symbol, SEXP start)
+{
+    uintptr_t h = ((uintptr_t) symbol >> 4) * 31 + ((uintptr_t) start >> 4);
+    return FUNCACHE_ENTRY * (int) ((h ^ (h >> 17)) % FUNCACHE_SIZE);
+}
+
+static R_INLINE SEXP funCacheLocValue(SEXP loc)
+{
+    SEXP value;
+    if (TYPEOF(loc) == SYMSXP)
+	value = SYMVALUE(loc);
+    else if (BNDCELL_TAG(loc))
+	return R_NilValue;
+    else
+	value = CAR0(loc);
+    if (TYPEOF(value) == PROMSXP)
+	value = PRVALUE(value);
+    return value;
+}
+
+/* Set *ploc to the binding of 'fun', found by findFun for 'symbol',
+   in the search from 'start', the environment following the function
+   frames, and return TRUE; or return FALSE if the search cannot be
+   cached. */
+static Rboolean funCacheSearch(SEXP symbol, SEXP start, SEXP fun,
+			       SEXP *ploc)
+{
+    if (! (start == R_GlobalEnv || IS_GLOBAL_FRAME(start) ||
+	   start == R_BaseNamespace || R_IsNamespaceEnv(start)))
+	return FALSE;
+    for (SEXP rho = start; rho != R_EmptyEnv; rho = ENCLOS(rho)) {
+	if (rho != R_BaseEnv && rho != R_BaseNamespace &&
+	    (HASHTAB(rho) == R_NilValue || IS_USER_DATABASE(rho)))
+	    return FALSE;
+	MARK_AS_CACHE_FRAME(rho, FUNCACHE_FRAME_MASK);
+	SEXP loc = findVarLocInFrame(rho, symbol, NULL);
+	if (loc != R_NilValue) {
+	    /* the search must not have passed a binding of some other
+	       value, which could become a function without notice */
+	    if (IS_ACTIVE_BINDING(loc) || funCacheLocValue(loc) != fun)
+		return FALSE;
+	    MARK_AS_FUNCACHE_SYMBOL(symbol);
+	    *ploc = loc;
+	    return TRUE;
+	}
+    }
+    return FALSE;
+}
+
+/* findFun(symbol, rho) for the GETFUN and GETGLOBFUN instructions */
+SEXP attribute_hidden R_findFunCached(SEXP symbol, SEXP rho)
+{
+    SEXP start = rho;
+    while (start != R_EmptyEnv && IS_FUNCACHE_FUNFRAME(start)) {
+	for (SEXP frame = FRAME(start); frame != R_NilValue;
+	     frame = CDR(frame))
+	    if (TAG(frame) == symbol)
+		return findFun(symbol, rho);
+	start = ENCLOS(start);
+    }
+
+    int idx = funCacheIndex(symbol, start);
+    if (FunCacheVersion == R_FunCacheVersion &&
+	VECTOR_ELT(FunCache, idx + FUNCACHE_SYMBOL) == symbol &&
+	VECTOR_ELT(FunCache, idx + FUNCACHE_START) == start) {
+	SEXP value =
+	    funCacheLocValue(VECTOR_ELT(FunCache, idx + FUNCACHE_LOC));
+	switch (TYPEOF(value)) {
+	case CLOSXP:
+	case BUILTINSXP:
+	case SPECIALSXP:
+	    return value;
+	default:
+	    break;
+	}
+    }
+
+    SEXP loc, value = findFun(symbol, rho);
+    if (funCacheSearch(symbol, start, value, &loc)) {
+	if (FunCache == NULL) {
+	    PROTECT(value);
+	    SEXP cache = allocVector(VECSXP, FUNCACHE_ENTRY * FUNCACHE_SIZE);
+	    R_PreserveObject(cache);
+	    FunCache = cache;
+	    UNPROTECT(1); /* value */
+	}
+	else if (FunCacheVersion != R_FunCacheVersion)
+	    for (R_xlen_t i = 0; i < XLENGTH(FunCache); i++)
+		SET_VECTOR_ELT(FunCache, i, R_NilValue);
+	FunCacheVersion = R_FunCacheVersion;
+	SET_VECTOR_ELT(FunCache, idx + FUNCACHE_SYMBOL, symbol);
+	SET_VECTOR_ELT(FunCache, idx + FUNCACHE_START, start);
+	SET_VECTOR_ELT(FunCache, idx + FUNCACHE_LOC, loc);
+    }
+    return value;
+}
+
+static Rboolean cacheFrameLoc(SEXP rho, SEXP symbol, SEXP *ploc, int mask)
+{
+    if (rho != R_BaseEnv && rho != R_BaseNamespace &&
+	(HASHTAB(rho) == R_NilValue || IS_USER_DATABASE(rho)))
+	return FALSE;
+    MARK_AS_CACHE_FRAME(rho, mask);
+    MARK_AS_FUNCACHE_SYMBOL(symbol);
+    *ploc = findVarLocInFrame(rho, symbol, NULL);
+    return TRUE;
+}
+
+/* Set *ploc to the binding of 'symbol' in the frame of 'rho', or to
+   R_NilValue if there is none, and mark 'rho' and 'symbol' so that
+   adding or removing a binding of 'symbol' in 'rho' invalidates the
+   caches; return FALSE if the frame of 'rho' cannot be cached.  Used
+   by the S3 dispatch cache in objects.c. */
+Rboolean attribute_hidden R_FunCacheFrameLoc(SEXP rho, SEXP symbol,
+					     SEXP *ploc)
+{
+    return cacheFrameLoc(rho, symbol, ploc, FUNCACHE_FRAME_MASK);
+}
+
+/* The same for the S4 dispatch cache of the methods package, which is
+   invalidated by R_MethodsCacheVersion only */
+Rboolean R_MethodsCacheFrameLoc(SEXP rho, SEXP symbol, SEXP *ploc)
+{
+    return cacheFrameLoc(rho, symbol, ploc, METHODSCACHE_FRAME_MASK);
+}
+
+/* R_MethodsCacheVersion is not visible to packages */
+R_xlen_t R_GetMethodsCacheVersion(void)
+{
+    return R_MethodsCacheVersion;
+}
+
 /*----------------------------------------------------------------------
 
   defineVar
@@ -1654,8 +1856,9 @@ void defineVar(SEXP symbol, SEXP value, SEXP rho)
 		SET_HASHASH(c, 1);
 	    }
 	    hashcode = HASHVALUE(c) % HASHSIZE(HASHTAB(rho));
-	    R_HashSet(hashcode, symbol, HASHTAB(rho), value,
-		      FRAME_IS_LOCKED(rho));
+	    if (R_HashSet(hashcode, symbol, HASHTAB(rho), value,
+			  FRAME_IS_LOCKED(rho)))
+		R_FlushFunCache(rho, symbol);
 	    if (R_HashSizeCheck(HASHTAB(rho)))
 		SET_HASHTAB(rho, R_HashResize(HASHTAB(rho)));
 	}
@@ -1831,6 +2034,8 @@ void gsetVar(SEXP symbol, SEXP value, SEXP rho)
 #ifdef USE_GLOBAL_CACHE
     R_FlushGlobalCache(symbol);
 #endif
+    if (SYMVALUE(symbol) == R_UnboundValue && IS_FUNCACHE_SYMBOL(symbol))
+	R_FunCacheVersion++; /* a new binding in base */
     SET_SYMBOL_BINDING_VALUE(symbol, value);
 }
 
@@ -2536,6 +2741,7 @@ SEXP attribute_hidden do_attach(SEXP call, SEXP op, SEXP args, SEXP env)
     for (t = R_GlobalEnv; ENCLOS(t) != R_BaseEnv && pos > 2; t = ENCLOS(t))
 	pos--;
 
+    R_FlushFunCache(t, R_NilValue);
     if (ENCLOS(t) == R_BaseEnv) {
 	SET_ENCLOS(t, s);
 	SET_ENCLOS(s, R_BaseEnv);
@@ -2597,6 +2803,7 @@ SEXP attribute_hidden do_detach(SEXP call, SEXP op, SEXP args, SEXP env)
     else {
 	PROTECT(s = ENCLOS(t));
 	x = ENCLOS(s);
+	R_FlushFunCache(t, R_NilValue);
 	SET_ENCLOS(t, x);
 	isSpecial = IS_USER_DATABASE(s);
 	if(isSpecial) {
@@ -3395,6 +3602,8 @@ void R_MakeActiveBinding(SEXP sym, SEXP fun, SEXP env)
 	    error(_("symbol already has a regular binding"));
 	else if (BINDING_IS_LOCKED(sym))
 	    error(_("cannot change active binding if binding is locked"));
+	if (SYMVALUE(sym) == R_UnboundValue && IS_FUNCACHE_SYMBOL(sym))
+	    R_FunCacheVersion++; /* a new binding in base */
 	SET_SYMVALUE(sym, fun);
 	SET_ACTIVE_BINDING_BIT(sym);
 	/* we don't need to worry about the global cache here as
@@ -3896,103 +4105,157 @@ SEXP mkChar(const char *name)
     return mkCharLenCE(name, (int) len, CE_NATIVE);
 }
 
-/* Global CHARSXP cache and code for char-based hash tables */
+/* Global CHARSXP cache */
 
-/* We can reuse the hash structure, but need separate code for get/set
-   of values since our keys are char* and not SEXP symbol types.
+/* The cache is an open addressing hash table with linear probing,
+   kept outside the R heap.  Each slot holds a CHARSXP, or NULL if it
+   is empty, together with the full hash value of its string, so a
+   probe reads one slot and only looks at a CHARSXP when its hash
+   matches.
+   The garbage collector removes the entries for unreachable CHARSXPs
+   by calling R_StringHashPurge.
 
-   Experience has shown that it is better to use a different hash function,
-   and a power of 2 for the hash size.
-*/
-
-/* char_hash_size MUST be a power of 2 and char_hash_mask ==
+   char_hash_size MUST be a power of 2 and char_hash_mask ==
    char_hash_size - 1 for x & char_hash_mask to be equivalent to x %
    char_hash_size.
 */
-static unsigned int char_hash_size = 65536;
-static unsigned int char_hash_mask = 65535;
+static size_t char_hash_size = 65536;
+static size_t char_hash_mask = 65535;
+static size_t char_hash_count = 0;
+typedef struct {
+    SEXP val;
+    unsigned int hash;
+} char_hash_entry;
+static char_hash_entry *char_hash_table = NULL;
+
+/* The table is enlarged when more than 3/4 of the slots are in use. */
+#define CHAR_HASH_FULL(count, size) ((count) > (size) / 4 * 3)
+
+/* Hash a string a word at a time; the multiplications and the final
+   avalanche step are those of the splitmix64 generator. */
+static R_INLINE unsigned int char_hash(const char *s, int len)
+{
+    const uint64_t m = 0xbf58476d1ce4e5b9ULL;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (uint64_t) len, w;
+    for (; len >= 8; s += 8, len -= 8) {
+	memcpy(&w, s, 8);
+	h = (h ^ w) * m;
+	h ^= h >> 29;
+    }
+    if (len > 0) {
+	w = 0;
+	memcpy(&w, s, len);
+	h = (h ^ w) * m;
+	h ^= h >> 29;
+    }
+    h ^= h >> 32;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (unsigned int) h;
+}
 
-static unsigned int char_hash(const char *s, int len)
+void attribute_hidden InitStringHash()
 {
-    /* djb2 as from http://www.cse.yorku.ca/~oz/hash.html */
-    char *p;
-    int i;
-    unsigned int h = 5381;
-    for (p = (char *) s, i = 0; i < len; p++, i++)
-	h = ((h << 5) + h) + (*p);
-    return h;
+    char_hash_table = calloc(char_hash_size, sizeof(char_hash_entry));
+    if (char_hash_table == NULL)
+	R_Suicide("couldn't allocate memory for the CHARSXP cache");
 }
 
-void attribute_hidden InitStringHash()
+/* Put a CHARSXP known not to be in the table into the first empty
+   slot of its probe sequence. */
+static R_INLINE void char_hash_insert(char_hash_entry *table, size_t mask,
+				      SEXP val, unsigned int h)
 {
-    R_StringHash = R_NewHashTable(char_hash_size);
+    size_t i = h & mask;
+    while (table[i].val != NULL)
+	i = (i + 1) & mask;
+    table[i].val = val;
+    table[i].hash = h;
 }
 
 /* #define DEBUG_GLOBAL_STRING_HASH 1 */
 
-/* Resize the global R_StringHash CHARSXP cache */
-static void R_StringHash_resize(unsigned int newsize)
+/* Resize the global CHARSXP cache.  Returns FALSE, leaving the table
+   as it is, if the memory for the new table cannot be allocated. */
+static Rboolean R_StringHash_resize(size_t newsize)
 {
-    SEXP old_table = R_StringHash;
-    SEXP new_table, chain, new_chain, val, next;
-    unsigned int counter, new_hashcode, newmask;
+    char_hash_entry *table;
+    size_t i, newmask = newsize - 1;
+
+    table = calloc(newsize, sizeof(char_hash_entry));
+    if (table == NULL)
+	return FALSE;
+    for (i = 0; i < char_hash_size; i++)
+	if (char_hash_table[i].val != NULL)
+	    char_hash_insert(table, newmask, char_hash_table[i].val,
+			     char_hash_table[i].hash);
 #ifdef DEBUG_GLOBAL_STRING_HASH
-    unsigned int oldsize = HASHSIZE(R_StringHash);
-    unsigned int oldpri = HASHPRI(R_StringHash);
-    unsigned int newsize, newpri;
+    Rprintf("Resized: size %lu => %lu\tcount %lu\n",
+	    (unsigned long) char_hash_size, (unsigned long) newsize,
+	    (unsigned long) char_hash_count);
 #endif
-
-    /* Allocate the new hash table.  This could fail to allocate
-       enough memory, and ideally we would recover from that and
-       carry over with a table that was getting full.
-     */
-    /* When using the ATTRIB fields to maintain the chains the chain
-       moving is destructive and does not involve allocation.  This is
-       therefore the only point where GC can occur. */
-    new_table = R_NewHashTable(newsize);
-    newmask = newsize - 1;
-
-    /* transfer chains from old table to new table */
-    for (counter = 0; counter < LENGTH(old_table); counter++) {
-	chain = VECTOR_ELT(old_table, counter);
-	while (!ISNULL(chain)) {
-	    val = CXHEAD(chain);
-	    next = CXTAIL(chain);
-	    new_hashcode = char_hash(CHAR(val), LENGTH(val)) & newmask;
-	    new_chain = VECTOR_ELT(new_table, new_hashcode);
-	    /* If using a primary slot then increase HASHPRI */
-	    if (ISNULL(new_chain))
-		SET_HASHPRI(new_table, HASHPRI(new_table) + 1);
-	    /* move the current chain link to the new chain */
-	    /* this is a destrictive modification */
-	    new_chain = SET_CXTAIL(val, new_chain);
-	    SET_VECTOR_ELT(new_table, new_hashcode, new_chain);
-	    chain = next;
-	}
-    }
-    R_StringHash = new_table;
+    free(char_hash_table);
+    char_hash_table = table;
     char_hash_size = newsize;
     char_hash_mask = newmask;
-#ifdef DEBUG_GLOBAL_STRING_HASH
-    newsize = HASHSIZE(new_table);
-    newpri = HASHPRI(new_table);
-    Rprintf("Resized: size %d => %d\tpri %d => %d\n",
-	    oldsize, newsize, oldpri, newpri);
-#endif
+    return TRUE;
 }
 
+/* Called by the garbage collector to drop the entries for which
+   'dead' is true.  Emptying a slot can cut the probe sequences of
+   entries stored after it in the same run of full slots, so those
+   are reinserted as the scan meets them; each lands in its own slot
+   or an earlier one.  The scan starts after an empty slot so that
+   every run is seen from its beginning. */
+void attribute_hidden R_StringHashPurge(Rboolean (*dead)(SEXP))
+{
+    size_t i, j, start;
+    Rboolean hole = FALSE;
 
-/* mkCharLenCE - make a character (CHARSXP) variable and set its
-   encoding bit.  If a CHARSXP with the same string already exists in
-   the global CHARSXP cache, R_StringHash, it is returned.  Otherwise,
-   a new CHARSXP is created, added to the cache and then returned. */
+    if (char_hash_table == NULL) /* in case of GC during initialization */
+	return;
+    for (start = 0; char_hash_table[start].val != NULL; start++);
+    for (j = 1; j <= char_hash_size; j++) {
+	i = (start + j) & char_hash_mask;
+	SEXP val = char_hash_table[i].val;
+	if (val == NULL)
+	    hole = FALSE;
+	else if (dead(val)) {
+	    char_hash_table[i].val = NULL;
+	    char_hash_count--;
+	    hole = TRUE;
+	}
+	else if (hole) {
+	    char_hash_table[i].val = NULL;
+	    char_hash_insert(char_hash_table, char_hash_mask, val,
+			     char_hash_table[i].hash);
+	}
+    }
+}
 
-SEXP mkCharLenCE(const char *name, int len, cetype_t enc)
+/* Look for a string in the cache, given its hash value and encoding
+   bits, and return it or R_NilValue. */
+static R_INLINE SEXP char_hash_lookup(const char *name, int len,
+				      unsigned int h, int need_enc)
 {
-    SEXP cval, chain;
-    unsigned int hashcode;
-    int need_enc;
-    Rboolean embedNul = FALSE, is_ascii = TRUE;
+    size_t i = h & char_hash_mask;
+    for (SEXP val; (val = char_hash_table[i].val) != NULL;
+	 i = (i + 1) & char_hash_mask)
+	if (char_hash_table[i].hash == h &&
+	    need_enc == (ENC_KNOWN(val) | IS_BYTES(val)) &&
+	    LENGTH(val) == len &&  /* quick pretest */
+	    (!len || (memcmp(CHAR(val), name, len) == 0))) // called with len = 0
+	    return val;
+    return R_NilValue;
+}
+
+/* Check the string and encoding arguments of mkCharLenCE, signalling
+   an error for an embedded nul, and return the encoding to use,
+   CE_NATIVE for an ASCII string, and whether the string is ASCII. */
+static cetype_t checkCharLenCE(const char *name, int len, cetype_t enc,
+			       Rboolean *is_ascii)
+{
+    Rboolean embedNul = FALSE;
 
     switch(enc){
     case CE_NATIVE:
@@ -4005,8 +4268,9 @@ SEXP mkCharLenCE(const char *name, int len, cetype_t enc)
     default:
 	error(_("unknown encoding: %d"), enc);
     }
+    *is_ascii = TRUE;
     for (int slen = 0; slen < len; slen++) {
-	if ((unsigned int) name[slen] > 127) is_ascii = FALSE;
+	if ((unsigned int) name[slen] > 127) *is_ascii = FALSE;
 	if (!name[slen]) embedNul = TRUE;
     }
     if (embedNul) {
@@ -4022,34 +4286,31 @@ SEXP mkCharLenCE(const char *name, int len, cetype_t enc)
 	case CE_BYTES: SET_BYTES(c); break;
 	default: break;
 	}
-	if (is_ascii) SET_ASCII(c);
+	if (*is_ascii) SET_ASCII(c);
 	error(_("embedded nul in string: '%s'"),
 	      EncodeString(c, 0, 0, Rprt_adj_none));
     }
 
-    if (enc && is_ascii) enc = CE_NATIVE;
+    if (enc && *is_ascii) enc = CE_NATIVE;
+    return enc;
+}
+
+static R_INLINE int encodingMask(cetype_t enc)
+{
     switch(enc) {
-    case CE_UTF8: need_enc = UTF8_MASK; break;
-    case CE_LATIN1: need_enc = LATIN1_MASK; break;
-    case CE_BYTES: need_enc = BYTES_MASK; break;
-    default: need_enc = 0;
+    case CE_UTF8: return UTF8_MASK;
+    case CE_LATIN1: return LATIN1_MASK;
+    case CE_BYTES: return BYTES_MASK;
+    default: return 0;
     }
+}
 
-    hashcode = char_hash(name, len) & char_hash_mask;
-
-    /* Search for a cached value */
-    cval = R_NilValue;
-    chain = VECTOR_ELT(R_StringHash, hashcode);
-    for (; !ISNULL(chain) ; chain = CXTAIL(chain)) {
-	SEXP val = CXHEAD(chain);
-	if (TYPEOF(val) != CHARSXP) break; /* sanity check */
-	if (need_enc == (ENC_KNOWN(val) | IS_BYTES(val)) &&
-	    LENGTH(val) == len &&  /* quick pretest */
-	    (!len || (memcmp(CHAR(val), name, len) == 0))) { // called with len = 0
-	    cval = val;
-	    break;
-	}
-    }
+/* Return the cached CHARSXP for a checked string, creating it and
+   adding it to the cache if there is none. */
+static R_INLINE SEXP mkCharHashed(const char *name, int len, cetype_t enc,
+				  Rboolean is_ascii, unsigned int h)
+{
+    SEXP cval = char_hash_lookup(name, len, h, encodingMask(enc));
     if (cval == R_NilValue) {
 	/* no cached value; need to allocate one and add to the cache */
 	PROTECT(cval = allocCharsxp(len));
@@ -4071,84 +4332,127 @@ SEXP mkCharLenCE(const char *name, int len, cetype_t enc)
 	}
 	if (is_ascii) SET_ASCII(cval);
 	SET_CACHED(cval);  /* Mark it */
-	/* add the new value to the cache */
-	chain = VECTOR_ELT(R_StringHash, hashcode);
-	if (ISNULL(chain))
-	    SET_HASHPRI(R_StringHash, HASHPRI(R_StringHash) + 1);
-	/* this is a destrictive modification */
-	chain = SET_CXTAIL(cval, chain);
-	SET_VECTOR_ELT(R_StringHash, hashcode, chain);
-
-	/* resize the hash table if necessary with the new entry still
-	   protected.
-	   Maximum possible power of two is 2^30 for a VECSXP.
-	   FIXME: this has changed with long vectors.
-	*/
-	if (R_HashSizeCheck(R_StringHash)
-	    && char_hash_size < 1073741824 /* 2^30 */)
-	    R_StringHash_resize(char_hash_size * 2);
 
+	/* resize the hash table if necessary before adding the new
+	   entry; there is no allocation on the R heap from here on,
+	   so the table cannot change through a garbage collection.
+	   If the table cannot be enlarged it is used until it is
+	   nearly full. */
+	if (CHAR_HASH_FULL(char_hash_count + 1, char_hash_size) &&
+	    ! R_StringHash_resize(char_hash_size * 2) &&
+	    char_hash_count + 1 > char_hash_size - char_hash_size / 16)
+	    error(_("cannot enlarge the CHARSXP cache"));
+	/* a collection during allocCharsxp may have moved the entries,
+	   so the probe is repeated */
+	char_hash_insert(char_hash_table, char_hash_mask, cval, h);
+	char_hash_count++;
 	UNPROTECT(1);
     }
     return cval;
 }
 
 
+/* mkCharLenCE - make a character (CHARSXP) variable and set its
+   encoding bit.  If a CHARSXP with the same string already exists in
+   the global CHARSXP cache it is returned.  Otherwise, a new CHARSXP
+   is created, added to the cache and then returned. */
+
+SEXP mkCharLenCE(const char *name, int len, cetype_t enc)
+{
+    Rboolean is_ascii;
+    enc = checkCharLenCE(name, len, enc, &is_ascii);
+    return mkCharHashed(name, len, enc, is_ascii, char_hash(name, len));
+}
+
+/* mkCharBatch - set elements start, ..., start + n - 1 of the
+   character vector x to the CHARSXPs for the strings names[i] of
+   lengths lens[i], or NA_STRING where names[i] is NULL.  If lens is
+   NULL the strings are nul-terminated.  The hash values of a group
+   of strings are computed, and their first slots fetched, before any
+   of them is looked up, so that the cache misses of the lookups
+   overlap. */
+
+#define CHAR_BATCH_SIZE 64
+
+void mkCharBatch(SEXP x, R_xlen_t start, R_xlen_t n,
+		 const char * const *names, const int *lens, cetype_t enc)
+{
+    unsigned int h[CHAR_BATCH_SIZE];
+    int len[CHAR_BATCH_SIZE];
+    cetype_t e[CHAR_BATCH_SIZE];
+    Rboolean ascii[CHAR_BATCH_SIZE];
+
+    if (TYPEOF(x) != STRSXP)
+	error("%s() can only be applied to a '%s', not a '%s'",
+	      "mkCharBatch", "character vector", type2char(TYPEOF(x)));
+    if (start < 0 || n < 0 || start > XLENGTH(x) - n)
+	error(_("%s(): elements %lld to %lld out of bounds for length %lld"),
+	      "mkCharBatch", (long long) start, (long long) (start + n - 1),
+	      (long long) XLENGTH(x));
+    for (R_xlen_t b = 0; b < n; b += CHAR_BATCH_SIZE) {
+	int k, nb = n - b < CHAR_BATCH_SIZE ? (int) (n - b) : CHAR_BATCH_SIZE;
+	const char * const *nm = names + b;
+	for (k = 0; k < nb; k++) {
+	    if (nm[k] == NULL) continue;
+	    size_t l = lens ? (size_t) lens[b + k] : strlen(nm[k]);
+	    if (l > INT_MAX)
+		error("R character strings are limited to 2^31-1 bytes");
+	    len[k] = (int) l;
+	    e[k] = checkCharLenCE(nm[k], len[k], enc, &ascii[k]);
+	    h[k] = char_hash(nm[k], len[k]);
+#if defined(__GNUC__)
+	    __builtin_prefetch(char_hash_table + (h[k] & char_hash_mask));
+#endif
+	}
+	for (k = 0; k < nb; k++)
+	    SET_STRING_ELT(x, start + b + k, nm[k] == NULL ? NA_STRING :
+			   mkCharHashed(nm[k], len[k], e[k], ascii[k], h[k]));
+    }
+}
+
+
 #ifdef DEBUG_SHOW_CHARSXP_CACHE
 /* Call this from gdb with
 
        call do_show_cache(10)
 
-   for the first 10 cache chains in use. */
+   for the first 10 cache entries in use. */
+static void show_cache_entry(FILE *f, size_t i)
+{
+    SEXP val = char_hash_table[i].val;
+    fprintf(f, "Slot %lu (%08x): ", (unsigned long) i, char_hash_table[i].hash);
+    if (IS_UTF8(val))
+	fprintf(f, "U");
+    else if (IS_LATIN1(val))
+	fprintf(f, "L");
+    else if (IS_BYTES(val))
+	fprintf(f, "B");
+    fprintf(f, "|%s|\n", CHAR(val));
+}
+
 void do_show_cache(int n)
 {
-    int i, j;
-    Rprintf("Cache size: %d\n", LENGTH(R_StringHash));
-    Rprintf("Cache pri:  %d\n", HASHPRI(R_StringHash));
-    for (i = 0, j = 0; j < n && i < LENGTH(R_StringHash); i++) {
-	SEXP chain = VECTOR_ELT(R_StringHash, i);
-	if (! ISNULL(chain)) {
-	    Rprintf("Line %d: ", i);
-	    do {
-		if (IS_UTF8(CXHEAD(chain)))
-		    Rprintf("U");
-		else if (IS_LATIN1(CXHEAD(chain)))
-		    Rprintf("L");
-		else if (IS_BYTES(CXHEAD(chain)))
-		    Rprintf("B");
-		Rprintf("|%s| ", CHAR(CXHEAD(chain)));
-		chain = CXTAIL(chain);
-	    } while(! ISNULL(chain));
-	    Rprintf("\n");
+    size_t i;
+    int j;
+    Rprintf("Cache size:  %lu\n", (unsigned long) char_hash_size);
+    Rprintf("Cache count: %lu\n", (unsigned long) char_hash_count);
+    for (i = 0, j = 0; j < n && i < char_hash_size; i++)
+	if (char_hash_table[i].val != NULL) {
+	    show_cache_entry(stdout, i);
 	    j++;
 	}
-    }
 }
 
 void do_write_cache()
 {
-    int i;
+    size_t i;
     FILE *f = fopen("/tmp/CACHE", "w");
     if (f != NULL) {
-	fprintf(f, "Cache size: %d\n", LENGTH(R_StringHash));
-	fprintf(f, "Cache pri:  %d\n", HASHPRI(R_StringHash));
-	for (i = 0; i < LENGTH(R_StringHash); i++) {
-	    SEXP chain = VECTOR_ELT(R_StringHash, i);
-	    if (! ISNULL(chain)) {
-		fprintf(f, "Line %d: ", i);
-		do {
-		    if (IS_UTF8(CXHEAD(chain)))
-			fprintf(f, "U");
-		    else if (IS_LATIN1(CXHEAD(chain)))
-			fprintf(f, "L");
-		    else if (IS_BYTES(CXHEAD(chain)))
-			fprintf(f, "B");
-		    fprintf(f, "|%s| ", CHAR(CXHEAD(chain)));
-		    chain = CXTAIL(chain);
-		} while(! ISNULL(chain));
-		fprintf(f, "\n");
-	    }
-	}
+	fprintf(f, "Cache size:  %lu\n", (unsigned long) char_hash_size);
+	fprintf(f, "Cache count: %lu\n", (unsigned long) char_hash_count);
+	for (i = 0; i < char_hash_size; i++)
+	    if (char_hash_table[i].val != NULL)
+		show_cache_entry(f, i);
 	fclose(f);
     }
 }
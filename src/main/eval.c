@@ -28,6 +28,7 @@
 #include <Internal.h>
 #include <Rinterface.h>
 #include <Fileio.h>
+#include <Rversion.h>
 #include <R_ext/Print.h>
 
 
@@ -94,6 +95,9 @@ static int R_Profiling = 0;
 #  include <sys/time.h>
 # endif
 # include <signal.h>
+# ifdef HAVE_UNISTD_H
+#  include <unistd.h>		/* for getpid */
+# endif
 #endif /* not Win32 */
 
 static FILE *R_ProfileOutfile = NULL;
@@ -215,6 +219,374 @@ static RCNTXT * findProfContext(RCNTXT *cptr)
     return cptr;
 }
 
+/* Write the name under which a call to 'fun' is recorded into
+   'itembuf', which has room for PROFITEMMAX characters. */
+static void profItemName(SEXP fun, char *itembuf)
+{
+    if (TYPEOF(fun) == SYMSXP) {
+	snprintf(itembuf, PROFITEMMAX-1, "%s", CHAR(PRINTNAME(fun)));
+
+    } else if ((CAR(fun) == R_DoubleColonSymbol ||
+		CAR(fun) == R_TripleColonSymbol ||
+		CAR(fun) == R_DollarSymbol) &&
+	       TYPEOF(CADR(fun)) == SYMSXP &&
+	       TYPEOF(CADDR(fun)) == SYMSXP) {
+	/* Function accessed via ::, :::, or $. Both args must be
+	   symbols. It is possible to use strings with these
+	   functions, as in "base"::"list", but that's a very rare
+	   case so we won't bother handling it. */
+	snprintf(itembuf, PROFITEMMAX-1, "%s%s%s",
+		 CHAR(PRINTNAME(CADR(fun))),
+		 CHAR(PRINTNAME(CAR(fun))),
+		 CHAR(PRINTNAME(CADDR(fun))));
+
+    } else if (CAR(fun) == R_Bracket2Symbol &&
+	       TYPEOF(CADR(fun)) == SYMSXP &&
+	       ((TYPEOF(CADDR(fun)) == SYMSXP ||
+		 TYPEOF(CADDR(fun)) == STRSXP ||
+		 TYPEOF(CADDR(fun)) == INTSXP ||
+		 TYPEOF(CADDR(fun)) == REALSXP) &&
+		length(CADDR(fun)) > 0)) {
+	/* Function accessed via [[. The first arg must be a symbol
+	   and the second can be a symbol, string, integer, or
+	   real. */
+	SEXP arg1 = CADR(fun);
+	SEXP arg2 = CADDR(fun);
+	char arg2buf[PROFITEMMAX-5];
+
+	if (TYPEOF(arg2) == SYMSXP) {
+	    snprintf(arg2buf, PROFITEMMAX-6, "%s", CHAR(PRINTNAME(arg2)));
+
+	} else if (TYPEOF(arg2) == STRSXP) {
+	    snprintf(arg2buf, PROFITEMMAX-6, "\"%s\"", CHAR(STRING_ELT(arg2, 0)));
+
+	} else if (TYPEOF(arg2) == INTSXP) {
+	    snprintf(arg2buf, PROFITEMMAX-6, "%d", INTEGER(arg2)[0]);
+
+	} else if (TYPEOF(arg2) == REALSXP) {
+	    snprintf(arg2buf, PROFITEMMAX-6, "%.0f", REAL(arg2)[0]);
+
+	} else {
+	    /* Shouldn't get here, but just in case. */
+	    arg2buf[0] = '\0';
+	}
+
+	snprintf(itembuf, PROFITEMMAX-1, "%s[[%s]]",
+		 CHAR(PRINTNAME(arg1)),
+		 arg2buf);
+
+    } else {
+	sprintf(itembuf, "<Anonymous>");
+    }
+}
+
+/* Collapsed-stack profiling.
+
+   With format = "collapsed" a sample is not written out but recorded
+   as a stack of frame identifiers in tables allocated when profiling
+   starts, and identical stacks only increment a count.  An R frame is
+   identified by the symbol of the function called or, for the other
+   call forms, by the offset of its name in a pool of interned names
+   (tagged by setting the low bit, which is never set for a SEXP).
+   Native frames, recorded when native = TRUE, are the return
+   addresses found by backtrace().  R_EndProfiling writes one line per
+   distinct stack, frames outermost first separated by ';' and
+   followed by the number of samples, which is the input format of
+   flame graph tools. */
+
+#define PROFNAMESIZE  (1 << 18)	/* bytes of interned names */
+#define PROFNAMETAB   (1 << 13)	/* slots in the name table */
+#define PROFFRAMESIZE (1 << 20)	/* frames of all distinct stacks */
+#define PROFSTACKTAB  (1 << 16)	/* slots in the stack table */
+#define PROFDEPTHMAX  1000	/* R frames per sample */
+#define PROFNATIVEMAX 100	/* native frames per sample */
+
+#if defined(HAVE_EXECINFO_H) && defined(HAVE_DLADDR) && !defined(Win32)
+# define PROF_NATIVE_STACKS
+# include <execinfo.h>
+# include <dlfcn.h>
+#endif
+
+typedef struct {
+    size_t start;	/* index of the first frame in prof_frames */
+    int nnative, nr;	/* native then R frames, innermost first */
+    double count;	/* samples; 0 for an empty slot */
+} profstack_t;
+
+static int R_Prof_Collapsed = 0;
+static int R_Prof_Native = 0;
+static char *prof_names = NULL;
+static size_t prof_names_used;
+static int *prof_nametab;
+static uintptr_t *prof_frames;
+static size_t prof_frames_used;
+static profstack_t *prof_stacks;
+static double prof_dropped;		/* samples lost to full tables */
+static uintptr_t prof_gc_frame;
+
+/* The identifier of the interned 'name', or 0 if the tables are full */
+static uintptr_t profInternName(const char *name)
+{
+    size_t len = strlen(name);
+    unsigned int h = 5381;
+    for (size_t i = 0; i < len; i++)
+	h = h * 33 + (unsigned char) name[i];
+    for (int n = 0, i = h % PROFNAMETAB; n < PROFNAMETAB;
+	 n++, i = (i + 1) % PROFNAMETAB) {
+	int off = prof_nametab[i];
+	if (off < 0) {
+	    if (prof_names_used + len + 1 > PROFNAMESIZE)
+		return 0;
+	    off = (int) prof_names_used;
+	    memcpy(prof_names + off, name, len + 1);
+	    prof_names_used += len + 1;
+	    prof_nametab[i] = off;
+	}
+	if (! strcmp(prof_names + off, name))
+	    return ((uintptr_t) off << 1) | 1;
+    }
+    return 0;
+}
+
+static void profCollapsedSample(void)
+{
+    uintptr_t frames[PROFNATIVEMAX + PROFDEPTHMAX + 1];
+    int nnative = 0, nr = 0;
+
+#ifdef PROF_NATIVE_STACKS
+    if (R_Prof_Native) {
+	void *pcs[PROFNATIVEMAX];
+	nnative = backtrace(pcs, PROFNATIVEMAX);
+	for (int i = 0; i < nnative; i++)
+	    frames[i] = (uintptr_t) pcs[i];
+    }
+#endif
+
+    uintptr_t *rframes = frames + nnative;
+    if (R_GC_Profiling && R_gc_running())
+	rframes[nr++] = prof_gc_frame;
+    for (RCNTXT *cptr = R_GlobalContext;
+	 cptr != NULL && nr < PROFDEPTHMAX;
+	 cptr = findProfContext(cptr)) {
+	if ((cptr->callflag & (CTXT_FUNCTION | CTXT_BUILTIN))
+	    && TYPEOF(cptr->call) == LANGSXP) {
+	    SEXP fun = CAR(cptr->call);
+	    uintptr_t id;
+	    if (TYPEOF(fun) == SYMSXP)
+		id = (uintptr_t) fun;
+	    else {
+		char itembuf[PROFITEMMAX];
+		profItemName(fun, itembuf);
+		if ((id = profInternName(itembuf)) == 0) {
+		    prof_dropped++;
+		    return;
+		}
+	    }
+	    rframes[nr++] = id;
+	}
+    }
+
+    int n = nnative + nr;
+    uintptr_t h = nnative;
+    for (int i = 0; i < n; i++)
+	h = h * 1000003 + (frames[i] >> 1);
+    for (int k = 0, i = (int) ((h ^ (h >> 21)) % PROFSTACKTAB);
+	 k < PROFSTACKTAB; k++, i = (i + 1) % PROFSTACKTAB) {
+	profstack_t *st = prof_stacks + i;
+	if (st->count == 0) {
+	    if (prof_frames_used + n > PROFFRAMESIZE)
+		break;
+	    memcpy(prof_frames + prof_frames_used, frames,
+		   n * sizeof(uintptr_t));
+	    st->start = prof_frames_used;
+	    st->nnative = nnative;
+	    st->nr = nr;
+	    st->count = 1;
+	    prof_frames_used += n;
+	    return;
+	}
+	if (st->nnative == nnative && st->nr == nr &&
+	    ! memcmp(prof_frames + st->start, frames, n * sizeof(uintptr_t))) {
+	    st->count++;
+	    return;
+	}
+    }
+    prof_dropped++;
+}
+
+/* Growable buffers for the lines of the collapsed output */
+typedef struct {
+    char *s;
+    size_t len, size;
+    double count;
+} profline_t;
+
+static void profPut(profline_t *line, const char *str, Rboolean name)
+{
+    size_t n = strlen(str);
+    if (line->len + n + 1 > line->size) {
+	size_t size = 2 * (line->len + n + 1);
+	char *s = realloc(line->s, size);
+	if (s == NULL)
+	    return;
+	line->s = s;
+	line->size = size;
+    }
+    for (size_t i = 0; i < n; i++)
+	/* ';' separates the frames */
+	line->s[line->len++] = (name && str[i] == ';') ? ':' : str[i];
+    line->s[line->len] = '\0';
+}
+
+#ifdef PROF_NATIVE_STACKS
+static void doprof(int sig);
+
+/* The base address of the object containing the code at 'pc' */
+static void *profObjectBase(uintptr_t pc)
+{
+    Dl_info info;
+    /* a return address may be just past the end of the caller */
+    return dladdr((void *) (pc - 1), &info) ? info.dli_fbase : NULL;
+}
+
+static void profPutNative(profline_t *line, uintptr_t pc)
+{
+    Dl_info info;
+    char buf[50];
+    if (! dladdr((void *) (pc - 1), &info)) {
+	snprintf(buf, 50, "0x%lx", (unsigned long) pc);
+	profPut(line, buf, FALSE);
+    } else if (info.dli_sname)
+	profPut(line, info.dli_sname, TRUE);
+    else {
+	const char *file = info.dli_fname ? info.dli_fname : "",
+	    *base = strrchr(file, '/');
+	profPut(line, base ? base + 1 : file, TRUE);
+	snprintf(buf, 50, "+0x%lx",
+		 (unsigned long) (pc - (uintptr_t) info.dli_fbase));
+	profPut(line, buf, FALSE);
+    }
+}
+
+/* The native frames of a sample that are shown.  The innermost are
+   those of the profiler itself and the signal trampoline.  Above
+   them are shown the frames in other objects (package DLLs, BLAS,
+   the C library) called from R, or if the sample was taken in R's
+   own C code the innermost frame there: the frames further out are
+   the evaluator's, and are represented by the R frames. */
+static void profNativeRange(uintptr_t *frames, int n, int *from, int *to)
+{
+    void *self = profObjectBase((uintptr_t) doprof + 1);
+    int i = 0;
+    while (i < n && profObjectBase(frames[i]) == self)
+	i++;
+    if (i < n) i++;
+    *from = *to = i;
+    while (*to < n && profObjectBase(frames[*to]) != self)
+	(*to)++;
+    if (*to == *from && *to < n)
+	(*to)++;
+}
+#endif
+
+static int profLineCmp(const void *a, const void *b)
+{
+    return strcmp(((const profline_t *) a)->s, ((const profline_t *) b)->s);
+}
+
+/* Write the stacks.  Stacks that differ only in native frames which
+   have the same names are merged, so the lines are formatted and
+   sorted first. */
+static void profWriteCollapsed(void)
+{
+    int nlines = 0;
+    for (int i = 0; i < PROFSTACKTAB; i++)
+	if (prof_stacks[i].count > 0)
+	    nlines++;
+    profline_t *lines = calloc(nlines > 0 ? nlines : 1, sizeof(profline_t));
+    if (lines == NULL)
+	return;
+    int k = 0;
+    for (int i = 0; i < PROFSTACKTAB; i++) {
+	profstack_t *st = prof_stacks + i;
+	if (st->count == 0)
+	    continue;
+	uintptr_t *frames = prof_frames + st->start;
+	uintptr_t *rframes = frames + st->nnative;
+	int from = 0, to = 0;
+#ifdef PROF_NATIVE_STACKS
+	profNativeRange(frames, st->nnative, &from, &to);
+#endif
+	if (st->nr == 0 && from == to)
+	    continue;
+	profline_t *line = lines + k;
+	for (int j = st->nr - 1; j >= 0; j--) {
+	    if (line->len)
+		profPut(line, ";", FALSE);
+	    if (rframes[j] & 1)
+		profPut(line, prof_names + (rframes[j] >> 1), TRUE);
+	    else
+		profPut(line, CHAR(PRINTNAME((SEXP) rframes[j])), TRUE);
+	}
+#ifdef PROF_NATIVE_STACKS
+	for (int j = to - 1; j >= from; j--) {
+	    if (line->len)
+		profPut(line, ";", FALSE);
+	    profPutNative(line, frames[j]);
+	}
+#endif
+	if (line->s == NULL)
+	    continue;
+	line->count = st->count;
+	k++;
+    }
+    qsort(lines, k, sizeof(profline_t), profLineCmp);
+    for (int i = 0; i < k; ) {
+	double count = 0;
+	int j = i;
+	for (; j < k && ! strcmp(lines[j].s, lines[i].s); j++)
+	    count += lines[j].count;
+	fprintf(R_ProfileOutfile, "%s %.0f\n", lines[i].s, count);
+	i = j;
+    }
+    for (int i = 0; i < nlines; i++)
+	free(lines[i].s);
+    free(lines);
+}
+
+static void profFreeCollapsed(void)
+{
+    free(prof_names);
+    free(prof_nametab);
+    free(prof_frames);
+    free(prof_stacks);
+    prof_names = NULL;
+}
+
+static void profInitCollapsed(void)
+{
+    prof_names = malloc(PROFNAMESIZE);
+    prof_nametab = malloc(PROFNAMETAB * sizeof(int));
+    prof_frames = malloc(PROFFRAMESIZE * sizeof(uintptr_t));
+    prof_stacks = calloc(PROFSTACKTAB, sizeof(profstack_t));
+    if (! prof_names || ! prof_nametab || ! prof_frames || ! prof_stacks) {
+	profFreeCollapsed();
+	error(_("Rprof: cannot allocate profiling tables"));
+    }
+    for (int i = 0; i < PROFNAMETAB; i++)
+	prof_nametab[i] = -1;
+    prof_names_used = prof_frames_used = 0;
+    prof_dropped = 0;
+    prof_gc_frame = profInternName("<GC>");
+#ifdef PROF_NATIVE_STACKS
+    if (R_Prof_Native) {
+	/* the first call may load the unwinder, which allocates */
+	void *pcs[1];
+	backtrace(pcs, 1);
+    }
+#endif
+}
+
 static void doprof(int sig)  /* sig is ignored in Windows */
 {
     char buf[PROFBUFSIZ];
@@ -233,6 +605,16 @@ static void doprof(int sig)  /* sig is ignored in Windows */
     }
 #endif /* Win32 */
 
+    if (R_Prof_Collapsed) {
+	profCollapsedSample();
+#ifdef Win32
+	ResumeThread(MainThread);
+#else
+	signal(SIGPROF, doprof);
+#endif
+	return;
+    }
+
     if (R_Mem_Profiling){
 	    get_current_mem(&smallv, &bigv, &nodes);
 	    if((len = strlen(buf)) < PROFLINEMAX)
@@ -259,63 +641,7 @@ static void doprof(int sig)  /* sig is ignored in Windows */
 		strcat(buf, "\"");
 
 		char itembuf[PROFITEMMAX];
-
-		if (TYPEOF(fun) == SYMSXP) {
-		    snprintf(itembuf, PROFITEMMAX-1, "%s", CHAR(PRINTNAME(fun)));
-
-		} else if ((CAR(fun) == R_DoubleColonSymbol ||
-			    CAR(fun) == R_TripleColonSymbol ||
-			    CAR(fun) == R_DollarSymbol) &&
-			   TYPEOF(CADR(fun)) == SYMSXP &&
-			   TYPEOF(CADDR(fun)) == SYMSXP) {
-		    /* Function accessed via ::, :::, or $. Both args must be
-		       symbols. It is possible to use strings with these
-		       functions, as in "base"::"list", but that's a very rare
-		       case so we won't bother handling it. */
-		    snprintf(itembuf, PROFITEMMAX-1, "%s%s%s",
-			     CHAR(PRINTNAME(CADR(fun))),
-			     CHAR(PRINTNAME(CAR(fun))),
-			     CHAR(PRINTNAME(CADDR(fun))));
-
-		} else if (CAR(fun) == R_Bracket2Symbol &&
-			   TYPEOF(CADR(fun)) == SYMSXP &&
-			   ((TYPEOF(CADDR(fun)) == SYMSXP ||
-			     TYPEOF(CADDR(fun)) == STRSXP ||
-			     TYPEOF(CADDR(fun)) == INTSXP ||
-			     TYPEOF(CADDR(fun)) == REALSXP) &&
-			    length(CADDR(fun)) > 0)) {
-		    /* Function accessed via [[. The first arg must be a symbol
-		       and the second can be a symbol, string, integer, or
-		       real. */
-		    SEXP arg1 = CADR(fun);
-		    SEXP arg2 = CADDR(fun);
-		    char arg2buf[PROFITEMMAX-5];
-
-		    if (TYPEOF(arg2) == SYMSXP) {
-			snprintf(arg2buf, PROFITEMMAX-6, "%s", CHAR(PRINTNAME(arg2)));
-
-		    } else if (TYPEOF(arg2) == STRSXP) {
-			snprintf(arg2buf, PROFITEMMAX-6, "\"%s\"", CHAR(STRING_ELT(arg2, 0)));
-
-		    } else if (TYPEOF(arg2) == INTSXP) {
-			snprintf(arg2buf, PROFITEMMAX-6, "%d", INTEGER(arg2)[0]);
-
-		    } else if (TYPEOF(arg2) == REALSXP) {
-			snprintf(arg2buf, PROFITEMMAX-6, "%.0f", REAL(arg2)[0]);
-
-		    } else {
-			/* Shouldn't get here, but just in case. */
-			arg2buf[0] = '\0';
-		    }
-
-		    snprintf(itembuf, PROFITEMMAX-1, "%s[[%s]]",
-			     CHAR(PRINTNAME(arg1)),
-			     arg2buf);
-
-		} else {
-		    sprintf(itembuf, "<Anonymous>");
-		}
-
+		profItemName(fun, itembuf);
 		strcat(buf, itembuf);
 		strcat(buf, "\" ");
 		if (R_Line_Profiling) {
@@ -382,6 +708,13 @@ static void R_EndProfiling(void)
     signal(SIGPROF, doprof_null);
 
 #endif /* not Win32 */
+    double dropped = 0;
+    if (R_Prof_Collapsed) {
+	if (R_ProfileOutfile) profWriteCollapsed();
+	dropped = prof_dropped;
+	profFreeCollapsed();
+	R_Prof_Collapsed = 0;
+    }
     if(R_ProfileOutfile) fclose(R_ProfileOutfile);
     R_ProfileOutfile = NULL;
     R_Profiling = 0;
@@ -392,12 +725,16 @@ static void R_EndProfiling(void)
     if (R_Profiling_Error)
 	warning(_("source files skipped by Rprof; please increase '%s'"),
 		R_Profiling_Error == 1 ? "numfiles" : "bufsize");
+    if (dropped > 0)
+	warning(_("%.0f samples dropped by Rprof as its stack tables were full"),
+		dropped);
 }
 
 static void R_InitProfiling(SEXP filename, int append, double dinterval,
 			    int mem_profiling, int gc_profiling,
 			    int line_profiling, int filter_callframes,
-			    int numfiles, int bufsize)
+			    int numfiles, int bufsize, int collapsed,
+			    int native)
 {
 #ifndef Win32
     struct itimerval itv;
@@ -409,17 +746,35 @@ static void R_InitProfiling(SEXP filename, int append, double dinterval,
 
     interval = (int)(1e6 * dinterval + 0.5);
     if(R_ProfileOutfile != NULL) R_EndProfiling();
+    if (collapsed) {
+	if (mem_profiling || line_profiling)
+	    error(_("Rprof: memory and line profiling are not available with format = \"collapsed\""));
+#ifndef PROF_NATIVE_STACKS
+	if (native) {
+	    warning(_("Rprof: native stacks are not available on this system"));
+	    native = 0;
+	}
+#endif
+	R_Prof_Native = native;
+	profInitCollapsed();
+    } else if (native)
+	error(_("Rprof: native stacks need format = \"collapsed\""));
     R_ProfileOutfile = RC_fopen(filename, append ? "a" : "w", TRUE);
-    if (R_ProfileOutfile == NULL)
+    if (R_ProfileOutfile == NULL) {
+	if (collapsed) profFreeCollapsed();
 	error(_("Rprof: cannot open profile file '%s'"),
 	      translateChar(filename));
-    if(mem_profiling)
-	fprintf(R_ProfileOutfile, "memory profiling: ");
-    if(gc_profiling)
-	fprintf(R_ProfileOutfile, "GC profiling: ");
-    if(line_profiling)
-	fprintf(R_ProfileOutfile, "line profiling: ");
-    fprintf(R_ProfileOutfile, "sample.interval=%d\n", interval);
+    }
+    R_Prof_Collapsed = collapsed;
+    if (!collapsed) { /* the collapsed format has no header */
+	if(mem_profiling)
+	    fprintf(R_ProfileOutfile, "memory profiling: ");
+	if(gc_profiling)
+	    fprintf(R_ProfileOutfile, "GC profiling: ");
+	if(line_profiling)
+	    fprintf(R_ProfileOutfile, "line profiling: ");
+	fprintf(R_ProfileOutfile, "sample.interval=%d\n", interval);
+    }
 
     R_Mem_Profiling=mem_profiling;
     if (mem_profiling)
@@ -476,7 +831,7 @@ SEXP do_Rprof(SEXP args)
     int append_mode, mem_profiling, gc_profiling, line_profiling,
 	filter_callframes;
     double dinterval;
-    int numfiles, bufsize;
+    int numfiles, bufsize, collapsed, native;
 
 #ifdef BC_PROFILING
     if (bc_profiling) {
@@ -496,15 +851,21 @@ SEXP do_Rprof(SEXP args)
     numfiles = asInteger(CAR(args));	      args = CDR(args);
     if (numfiles < 0)
 	error(_("invalid '%s' argument"), "numfiles");
-    bufsize = asInteger(CAR(args));
+    bufsize = asInteger(CAR(args));	      args = CDR(args);
     if (bufsize < 0)
 	error(_("invalid '%s' argument"), "bufsize");
+    collapsed = asLogical(CAR(args));	      args = CDR(args);
+    if (collapsed == NA_LOGICAL)
+	error(_("invalid '%s' argument"), "format");
+    native = asLogical(CAR(args));
+    if (native == NA_LOGICAL)
+	error(_("invalid '%s' argument"), "native");
 
     filename = STRING_ELT(filename, 0);
     if (LENGTH(filename))
 	R_InitProfiling(filename, append_mode, dinterval, mem_profiling,
 			gc_profiling, line_profiling, filter_callframes,
-			numfiles, bufsize);
+			numfiles, bufsize, collapsed, native);
     else
 	R_EndProfiling();
     return R_NilValue;
@@ -1021,6 +1382,9 @@ static SEXP R_RepeatSymbol = NULL;
 static SEXP JIT_cache = NULL;
 static R_exprhash_t JIT_cache_hashes[JIT_CACHE_SIZE];
 
+/* directory of the persistent JIT cache, or NULL if not in use */
+static char *JIT_disk_cache_dir = NULL;
+
 /**** allow MIN_JIT_SCORE, or both, to be changed by environment variables? */
 static int MIN_JIT_SCORE = 50;
 #define LOOP_JIT_SCORE MIN_JIT_SCORE
@@ -1087,6 +1451,10 @@ void attribute_hidden R_init_jit_enabled(void)
     R_RepeatSymbol = install("repeat");
 
     R_PreserveObject(JIT_cache = allocVector(VECSXP, JIT_CACHE_SIZE));
+
+    char *cachedir = getenv("R_JIT_CACHE_DIR");
+    if (cachedir != NULL && cachedir[0])
+	JIT_disk_cache_dir = Rstrdup(R_ExpandFileName(cachedir));
 }
 
 static int JIT_score(SEXP e)
@@ -1396,6 +1764,253 @@ static R_INLINE Rboolean jit_srcref_match(SEXP cmpsrcref, SEXP srcref)
     return R_compute_identical(cmpsrcref, srcref, 0);
 }
 
+/* Persistent JIT cache.  If the environment variable R_JIT_CACHE_DIR
+   names a directory at startup, code the JIT compiles for closures
+   whose top level environment is the global environment, and for top
+   level loops, is also saved to a file in that directory and reused
+   by later R processes instead of being compiled again.  Package code
+   is compiled at install time and not handled here.
+
+   Files are named by a hash of the code computed from its contents
+   (hashexpr hashes symbols and non-scalars by address, so is not
+   stable across processes), the names of the local variables visible
+   at compile time (as in make_cached_cmpenv), the R and byte code
+   versions and the compiler optimization level.  A file holds a
+   serialized list of these and the compiled code; all but the code
+   are compared to the current values before the code is used, so hash
+   collisions and stale files only cost a compilation.  Like the
+   in-memory cache this assumes that compilation depends only on which
+   variables are bound, not on their values.  Code with attributes,
+   in particular with source references (which refer to session
+   specific srcfile environments), is not cached. */
+
+#define JIT_DISK_KEY     0
+#define JIT_DISK_FORMALS 1
+#define JIT_DISK_EXPR    2
+#define JIT_DISK_LOCALS  3
+#define JIT_DISK_CODE    4
+#define JIT_DISK_LENGTH  5
+
+/* 64-bit FNV-1a */
+static R_INLINE uint64_t stable_hash(const void *p, size_t n, uint64_t h)
+{
+    const unsigned char *s = (const unsigned char *) p;
+    for (size_t i = 0; i < n; i++) {
+	h ^= s[i];
+	h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+#define STABLE_HASH(x, h) stable_hash(&(x), sizeof(x), h)
+
+static R_INLINE uint64_t stable_hash_string(SEXP s, uint64_t h)
+{
+    int len = s == NA_STRING ? -1 : LENGTH(s);
+    h = STABLE_HASH(len, h);
+    return len > 0 ? stable_hash(CHAR(s), len, h) : h;
+}
+
+/* Returns FALSE if e contains values that cannot be hashed by
+   contents or that have attributes. */
+static Rboolean stable_hashexpr(SEXP e, uint64_t *h)
+{
+    int type = TYPEOF(e);
+    *h = STABLE_HASH(type, *h);
+
+    switch(type) {
+    case NILSXP:
+	return TRUE;
+    case SYMSXP:
+	*h = stable_hash_string(PRINTNAME(e), *h);
+	return TRUE;
+    case LANGSXP:
+    case LISTSXP:
+	R_CheckStack();
+	for (; e != R_NilValue; e = CDR(e)) {
+	    if ((TYPEOF(e) != LANGSXP && TYPEOF(e) != LISTSXP) ||
+		ATTRIB(e) != R_NilValue)
+		return FALSE;
+	    if (TAG(e) != R_NilValue)
+		*h = stable_hash_string(PRINTNAME(TAG(e)), *h);
+	    if (! stable_hashexpr(CAR(e), h))
+		return FALSE;
+	}
+	return TRUE;
+    case LGLSXP:
+    case INTSXP:
+    case REALSXP:
+    case CPLXSXP:
+    case STRSXP:
+	if (ATTRIB(e) != R_NilValue || ALTREP(e))
+	    return FALSE;
+	R_xlen_t n = XLENGTH(e);
+	*h = STABLE_HASH(n, *h);
+	switch(type) {
+	case LGLSXP:
+	case INTSXP:
+	    *h = stable_hash(DATAPTR(e), n * sizeof(int), *h);
+	    break;
+	case REALSXP:
+	    *h = stable_hash(DATAPTR(e), n * sizeof(double), *h);
+	    break;
+	case CPLXSXP:
+	    *h = stable_hash(DATAPTR(e), n * sizeof(Rcomplex), *h);
+	    break;
+	case STRSXP:
+	    for (R_xlen_t i = 0; i < n; i++)
+		*h = stable_hash_string(STRING_ELT(e, i), *h);
+	    break;
+	}
+	return TRUE;
+    default:
+	return FALSE;
+    }
+}
+
+/* Names of the local variables in the frames from env up to the
+   global environment, or NULL if the top level environment of env is
+   not the global environment or a frame is not a standard unhashed
+   one (as jit_env_match requires). */
+static SEXP jit_disk_locals(SEXP env)
+{
+    if (topenv(R_NilValue, env) != R_GlobalEnv)
+	return NULL;
+
+    int n = 0;
+    for (SEXP rho = env; rho != R_GlobalEnv; rho = ENCLOS(rho)) {
+	if (! IS_STANDARD_UNHASHED_FRAME(rho))
+	    return NULL;
+	n += length(FRAME(rho));
+    }
+    SEXP names = allocVector(STRSXP, n);
+    int i = 0;
+    for (SEXP rho = env; rho != R_GlobalEnv; rho = ENCLOS(rho))
+	for (SEXP frame = FRAME(rho); frame != R_NilValue; frame = CDR(frame))
+	    SET_STRING_ELT(names, i++, PRINTNAME(TAG(frame)));
+    return names;
+}
+
+static int R_bcVersion;
+
+static SEXP jit_disk_key(const char *kind)
+{
+    int old_visible = R_Visible;
+    SEXP fcall = PROTECT(lang3(R_TripleColonSymbol, install("compiler"),
+			       install("getCompilerOption")));
+    SEXP call = PROTECT(lang2(fcall, mkString("optimize")));
+    int optimize = asInteger(eval(call, R_GlobalEnv));
+    UNPROTECT(2); /* fcall, call */
+    R_Visible = old_visible;
+
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s R %s.%s r%d bc %d optimize %d", kind,
+	     R_MAJOR, R_MINOR, R_SVN_REVISION, R_bcVersion, optimize);
+    return mkString(buf);
+}
+
+/* Returns the list to be compared with, and completed and stored in,
+   the cache file for compiling expr in env, or R_NilValue if this
+   code cannot be cached.  The hash is stored in *ph. */
+static SEXP jit_disk_info(const char *kind, SEXP formals, SEXP expr,
+			  SEXP env, uint64_t *ph)
+{
+    uint64_t h = 14695981039346656037ULL;
+    if (! stable_hashexpr(formals, &h) || ! stable_hashexpr(expr, &h))
+	return R_NilValue;
+    SEXP locals = jit_disk_locals(env);
+    if (locals == NULL)
+	return R_NilValue;
+    PROTECT(locals);
+    SEXP key = PROTECT(jit_disk_key(kind));
+    stable_hashexpr(locals, &h);
+    stable_hashexpr(key, &h);
+
+    SEXP info = allocVector(VECSXP, JIT_DISK_LENGTH);
+    SET_VECTOR_ELT(info, JIT_DISK_KEY, key);
+    SET_VECTOR_ELT(info, JIT_DISK_FORMALS, formals);
+    SET_VECTOR_ELT(info, JIT_DISK_EXPR, expr);
+    SET_VECTOR_ELT(info, JIT_DISK_LOCALS, locals);
+    UNPROTECT(2); /* locals, key */
+    *ph = h;
+    return info;
+}
+
+static void jit_disk_path(char *buf, size_t size, uint64_t h)
+{
+    snprintf(buf, size, "%s/%016" PRIx64 ".rds", JIT_disk_cache_dir, h);
+}
+
+static SEXP jit_disk_read(void *data)
+{
+    struct R_inpstream_st in;
+    R_InitFileInPStream(&in, (FILE *) data, R_pstream_any_format,
+			NULL, R_NilValue);
+    return R_Unserialize(&in);
+}
+
+struct jit_disk_wdata { FILE *fp; SEXP info; };
+
+static SEXP jit_disk_write(void *data)
+{
+    struct jit_disk_wdata *d = data;
+    struct R_outpstream_st out;
+    R_InitFileOutPStream(&out, d->fp, R_pstream_xdr_format, 3,
+			 NULL, R_NilValue);
+    R_Serialize(d->info, &out);
+    return R_TrueValue;
+}
+
+static SEXP jit_disk_error(SEXP cond, void *data)
+{
+    return R_NilValue;
+}
+
+/* Returns the cached code matching info, or R_NilValue. Unreadable or
+   corrupt files are treated as missing. */
+static SEXP jit_disk_lookup(SEXP info, uint64_t h)
+{
+    char path[PATH_MAX];
+    jit_disk_path(path, sizeof(path), h);
+    FILE *fp = R_fopen(path, "rb");
+    if (fp == NULL)
+	return R_NilValue;
+    SEXP val = PROTECT(R_tryCatchError(jit_disk_read, fp,
+				       jit_disk_error, NULL));
+    fclose(fp);
+
+    SEXP code = R_NilValue;
+    if (TYPEOF(val) == VECSXP && XLENGTH(val) == JIT_DISK_LENGTH &&
+	TYPEOF(VECTOR_ELT(val, JIT_DISK_CODE)) == BCODESXP) {
+	code = VECTOR_ELT(val, JIT_DISK_CODE);
+	for (int i = 0; i < JIT_DISK_CODE; i++)
+	    if (! R_compute_identical(VECTOR_ELT(val, i),
+				      VECTOR_ELT(info, i), 16))
+		code = R_NilValue;
+    }
+    UNPROTECT(1); /* val */
+    return code;
+}
+
+/* Writes to a temporary file renamed into place, so that concurrent
+   processes never see a partial file. Failures are silently ignored. */
+static void jit_disk_store(SEXP info, uint64_t h, SEXP code)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 32];
+    jit_disk_path(path, sizeof(path), h);
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+    FILE *fp = R_fopen(tmp, "wb");
+    if (fp == NULL)
+	return;
+
+    SET_VECTOR_ELT(info, JIT_DISK_CODE, code);
+    struct jit_disk_wdata data = { fp, info };
+    SEXP ok = R_tryCatchError(jit_disk_write, &data, jit_disk_error, NULL);
+    if (fclose(fp) == 0 && ok == R_TrueValue && rename(tmp, path) == 0)
+	return;
+    unlink(tmp);
+}
+
 SEXP attribute_hidden R_cmpfun1(SEXP fun)
 {
     int old_visible = R_Visible;
@@ -1471,6 +2086,26 @@ static void R_cmpfun(SEXP fun)
 	PRINT_JIT_INFO;
     }
 
+    uint64_t dhash = 0;
+    SEXP dinfo = R_NilValue;
+    if (JIT_disk_cache_dir != NULL &&
+	getAttrib(fun, R_SrcrefSymbol) == R_NilValue)
+	dinfo = jit_disk_info("closure", FORMALS(fun), BODY(fun),
+			      CLOENV(fun), &dhash);
+    PROTECT(dinfo);
+    if (dinfo != R_NilValue) {
+	SEXP code = PROTECT(jit_disk_lookup(dinfo, dhash));
+	if (code != R_NilValue) {
+	    if (jit_strategy != STRATEGY_NO_CACHE)
+		set_jit_cache_entry(hash, mkCLOSXP(FORMALS(fun), code,
+						   CLOENV(fun)));
+	    SET_BODY(fun, code);
+	    UNPROTECT(2); /* dinfo, code */
+	    return;
+	}
+	UNPROTECT(1); /* code */
+    }
+
     SEXP val = R_cmpfun1(fun);
 
     if (TYPEOF(BODY(val)) != BCODESXP)
@@ -1479,7 +2114,10 @@ static void R_cmpfun(SEXP fun)
 	if (jit_strategy != STRATEGY_NO_CACHE)
 	    set_jit_cache_entry(hash, val); /* val is protected by callee */
 	SET_BODY(fun, BODY(val));
+	if (dinfo != R_NilValue)
+	    jit_disk_store(dinfo, dhash, BODY(fun));
     }
+    UNPROTECT(1); /* dinfo */
 }
 
 static SEXP R_compileExpr(SEXP expr, SEXP rho)
@@ -1511,7 +2149,22 @@ static Rboolean R_compileAndExecute(SEXP call, SEXP rho)
     R_jit_enabled = 0;
     PROTECT(call);
     PROTECT(rho);
-    PROTECT(code = R_compileExpr(call, rho));
+    uint64_t dhash = 0;
+    SEXP dinfo = R_NilValue;
+    if (JIT_disk_cache_dir != NULL && R_getCurrentSrcref() == R_NilValue)
+	dinfo = jit_disk_info("loop", R_NilValue, call, rho, &dhash);
+    PROTECT(dinfo);
+    code = dinfo != R_NilValue ? jit_disk_lookup(dinfo, dhash) : R_NilValue;
+    if (code == R_NilValue) {
+	code = R_compileExpr(call, rho);
+	if (TYPEOF(code) == BCODESXP && dinfo != R_NilValue) {
+	    PROTECT(code);
+	    jit_disk_store(dinfo, dhash, code);
+	    UNPROTECT(1); /* code */
+	}
+    }
+    UNPROTECT(1); /* dinfo */
+    PROTECT(code);
     R_jit_enabled = old_enabled;
 
     if (TYPEOF(code) == BCODESXP) {
@@ -3877,7 +4530,7 @@ int DispatchGroup(const char* group, SEXP call, SEXP op, SEXP args, SEXP rho,
 }
 
 /* start of bytecode section */
-static int R_bcVersion = 12;
+static int R_bcVersion = 13;
 static int R_bcMinVersion = 9;
 
 static SEXP R_AddSym = NULL;
@@ -4091,6 +4744,38 @@ enum {
   DECLNK_N_OP,
   INCLNKSTK_OP,
   DECLNKSTK_OP,
+  SETVAR_POP_OP,
+  LDCONST_ADD_OP,
+  LDCONST_SUB_OP,
+  LDCONST_MUL_OP,
+  LDCONST_DIV_OP,
+  LDCONST_LT_OP,
+  LDCONST_LE_OP,
+  LDCONST_GT_OP,
+  LDCONST_GE_OP,
+  LDCONST_EQ_OP,
+  LDCONST_NE_OP,
+  GETVAR_ADD_OP,
+  GETVAR_SUB_OP,
+  GETVAR_MUL_OP,
+  GETVAR_DIV_OP,
+  GETVAR_LT_OP,
+  GETVAR_LE_OP,
+  GETVAR_GT_OP,
+  GETVAR_GE_OP,
+  GETVAR_EQ_OP,
+  GETVAR_NE_OP,
+  GETVAR_LDCONST_ADD_OP,
+  GETVAR_LDCONST_SUB_OP,
+  GETVAR_LDCONST_MUL_OP,
+  GETVAR_LDCONST_DIV_OP,
+  GETVAR_LDCONST_LT_OP,
+  GETVAR_LDCONST_LE_OP,
+  GETVAR_LDCONST_GT_OP,
+  GETVAR_LDCONST_GE_OP,
+  GETVAR_LDCONST_EQ_OP,
+  GETVAR_LDCONST_NE_OP,
+  GETVAR_VECSUBSET_OP,
   OPCOUNT
 };
 
@@ -4959,20 +5644,22 @@ static struct { void *addr; int argc; char *instname; } opinfo[OPCOUNT];
 #define LASTOP } retvalue = R_NilValue; goto done
 #define INITIALIZE_MACHINE() if (body == NULL) goto init
 
-#define NEXT() (__extension__ ({currentpc = pc; goto *(*pc++).v;}))
+#define NEXT() (__extension__ ({currentpc = pc; BC_INSTRUMENT(); \
+				 goto *(*pc++).v;}))
 #define GETOP() (*pc++).i
 #define SKIP_OP() (pc++)
+#define PEEKOP(k) (pc[k]).i
 
 #define BCCODE(e) (BCODE *) INTEGER(BCODE_CODE(e))
 #else
 typedef int BCODE;
 
-#define OP(name,argc) case name##_OP
+#define OP(name,argc) case name##_OP: op_##name
 
 #ifdef BC_PROFILING
 #define BEGIN_MACHINE  loop: currentpc = pc; current_opcode = *pc; switch(*pc++)
 #else
-#define BEGIN_MACHINE  loop: currentpc = pc; switch(*pc++)
+#define BEGIN_MACHINE  loop: currentpc = pc; BC_INSTRUMENT(); switch(*pc++)
 #endif
 #define LASTOP  default: error(_("bad opcode"))
 #define INITIALIZE_MACHINE()
@@ -4980,10 +5667,24 @@ typedef int BCODE;
 #define NEXT() goto loop
 #define GETOP() *pc++
 #define SKIP_OP() (pc++)
+#define PEEKOP(k) pc[k]
 
 #define BCCODE(e) INTEGER(BCODE_CODE(e))
 #endif
 
+/* Byte code instrumentation: when enabled by bcinstrument(), each
+   instruction executed is counted, and charged with the time and the
+   bytes of vector data allocated until the next instruction starts,
+   in a record for its address.  The check is a single test of a
+   static flag per instruction when instrumentation is off. */
+static Rboolean bc_instrumenting = FALSE;
+static void bcInstrumentStep(BCODE *pc, BCODE *codebase, SEXP body,
+			     SEXP rho);
+#define BC_INSTRUMENT() do {					\
+	if (bc_instrumenting)					\
+	    bcInstrumentStep(pc, codebase, body, rho);		\
+    } while (0)
+
 /**** is there a way to avoid the locked check here? */
 /**** always boxing on lock is one option */
 #define BNDCELL_TAG_WR(v) (BINDING_IS_LOCKED(v) ? 0 : BNDCELL_TAG(v))
@@ -5200,17 +5901,26 @@ static R_INLINE SEXP getvar(SEXP symbol, SEXP rho,
    not needed. Active bindings will have functions as their values.
    Skipping SYMSXP values rules out R_MissingArg and R_UnboundValue as
    these are implemented s symbols.  It also rules other symbols, but
-   as those are rare they are handled by the getvar() call. */
-#define DO_GETVAR(dd,keepmiss) do { \
+   as those are rare they are handled by the getvar() call.  With a
+   larger cache a cell is used only if it is the one for the symbol,
+   so that immediate bindings are read without boxing here too. */
+#define DO_GETVAR_THEN(dd,keepmiss,done__) do { \
     int sidx = GETOP(); \
     R_Visible = TRUE;	     \
-    if (!dd && smallcache) {						\
-	SEXP cell = GET_SMALLCACHE_BINDING_CELL(vcache, sidx);		\
+    if (!dd && (smallcache || vcache != NULL)) {			\
+	SEXP cell;							\
+	if (smallcache)							\
+	    cell = GET_SMALLCACHE_BINDING_CELL(vcache, sidx);		\
+	else {								\
+	    cell = GET_CACHED_BINDING_CELL(vcache, sidx);		\
+	    if (TAG(cell) != VECTOR_ELT(constants, sidx))		\
+		cell = R_NilValue;					\
+	}								\
 	/* handle immediate binings */					\
 	switch (BNDCELL_TAG(cell)) {					\
-	case REALSXP: BCNPUSH_REAL(BNDCELL_DVAL(cell)); NEXT();		\
-	case INTSXP: BCNPUSH_INTEGER(BNDCELL_IVAL(cell)); NEXT();	\
-	case LGLSXP: BCNPUSH_LOGICAL(BNDCELL_LVAL(cell)); NEXT();	\
+	case REALSXP: BCNPUSH_REAL(BNDCELL_DVAL(cell)); done__;		\
+	case INTSXP: BCNPUSH_INTEGER(BNDCELL_IVAL(cell)); done__;	\
+	case LGLSXP: BCNPUSH_LOGICAL(BNDCELL_LVAL(cell)); done__;	\
 	}								\
 	SEXP value = CAR(cell);						\
 	int type = TYPEOF(value);					\
@@ -5233,30 +5943,99 @@ static R_INLINE SEXP getvar(SEXP symbol, SEXP rho,
 	case VECSXP:							\
 	case RAWSXP:							\
 	    BCNPUSH(value);						\
-	    NEXT();							\
+	    done__;							\
 	case SYMSXP:							\
 	case PROMSXP:							\
 	    break;							\
 	default:							\
 	    if (cell != R_NilValue && ! IS_ACTIVE_BINDING(cell)) {	\
 		BCNPUSH(value);						\
-		NEXT();							\
+		done__;							\
 	    }								\
 	}								\
     }									\
     SEXP symbol = VECTOR_ELT(constants, sidx);				\
     BCNPUSH(getvar(symbol, rho, dd, keepmiss, vcache, sidx));		\
-    NEXT();								\
+    done__;								\
 } while (0)
 #else
-#define DO_GETVAR(dd,keepmiss) do { \
+#define DO_GETVAR_THEN(dd,keepmiss,done__) do { \
   int sidx = GETOP(); \
   SEXP symbol = VECTOR_ELT(constants, sidx); \
   R_Visible = TRUE; \
   BCNPUSH(getvar(symbol, rho, dd, keepmiss, vcache, sidx));	\
-  NEXT(); \
+  done__; \
 } while (0)
 #endif
+#define DO_GETVAR(dd,keepmiss) DO_GETVAR_THEN(dd, keepmiss, NEXT())
+
+/* continue a superinstruction with the body of its next component */
+#define NEXT_COMPONENT(name) do { currentpc = pc - 1; goto op_##name; } while (0)
+
+#define DO_LDCONST(done__) do {                                         \
+    R_Visible = TRUE;                                                   \
+    SEXP value = VECTOR_ELT(constants, GETOP());                        \
+    int type = TYPEOF(value);                                           \
+    switch(type) {                                                      \
+    case REALSXP:                                                       \
+	if (IS_SIMPLE_SCALAR(value, REALSXP)) {                         \
+	    BCNPUSH_REAL(REAL0(value)[0]);                              \
+	    done__;                                                     \
+	}                                                               \
+	break;                                                          \
+    case INTSXP:                                                        \
+	if (IS_SIMPLE_SCALAR(value, INTSXP)) {                          \
+	    BCNPUSH_INTEGER(INTEGER0(value)[0]);                        \
+	    done__;                                                     \
+	}                                                               \
+	break;                                                          \
+    case LGLSXP:                                                        \
+	if (IS_SIMPLE_SCALAR(value, LGLSXP)) {                          \
+	    BCNPUSH_LOGICAL(LOGICAL0(value)[0]);                        \
+	    done__;                                                     \
+	}                                                               \
+	break;                                                          \
+    }                                                                   \
+    if (R_check_constants < 0)                                          \
+	value = duplicate(value);                                       \
+    MARK_NOT_MUTABLE(value);                                            \
+    BCNPUSH(value);                                                     \
+    done__;                                                             \
+} while (0)
+
+#define DO_SETVAR(done__) do {                                          \
+    int sidx = GETOP();                                                 \
+    SEXP loc = smallcache ?                                             \
+	GET_SMALLCACHE_BINDING_CELL(vcache, sidx) : R_NilValue;         \
+    /* a variable only assigned to is not in the cache yet */           \
+    if (loc == R_NilValue) {                                            \
+	SEXP symbol = VECTOR_ELT(constants, sidx);                      \
+	loc = GET_BINDING_CELL_CACHE(symbol, rho, vcache, sidx);        \
+    }                                                                   \
+    R_bcstack_t *s = R_BCNodeStackTop - 1;                              \
+    int tag = s->tag;                                                   \
+    if (tag == BNDCELL_TAG_WR(loc))                                     \
+	switch (tag) {                                                  \
+	case REALSXP: SET_BNDCELL_DVAL(loc, s->u.dval); done__;         \
+	case INTSXP: SET_BNDCELL_IVAL(loc, s->u.ival); done__;          \
+	case LGLSXP: SET_BNDCELL_LVAL(loc, s->u.ival); done__;          \
+	}                                                               \
+    else if (BNDCELL_WRITABLE(loc))                                     \
+	switch (tag) {                                                  \
+	case REALSXP: NEW_BNDCELL_DVAL(loc, s->u.dval); done__;         \
+	case INTSXP: NEW_BNDCELL_IVAL(loc, s->u.ival); done__;          \
+	case LGLSXP: NEW_BNDCELL_LVAL(loc, s->u.ival); done__;          \
+	}                                                               \
+    SEXP value = GETSTACK(-1);                                          \
+    INCREMENT_NAMED(value);                                             \
+    if (! SET_BINDING_VALUE(loc, value)) {                              \
+	SEXP symbol = VECTOR_ELT(constants, sidx);                      \
+	PROTECT(value);                                                 \
+	defineVar(symbol, value, rho);                                  \
+	UNPROTECT(1);                                                   \
+    }                                                                   \
+    done__;                                                             \
+} while (0)
 
 /* call frame accessors */
 #define CALL_FRAME_FUN() GETSTACK(-3)
@@ -6836,84 +7615,18 @@ static SEXP bcEval(SEXP body, SEXP rho, Rboolean useCache)
     OP(SETLOOPVAL, 0):
       BCNPOP_IGNORE_VALUE(); SETSTACK(-1, R_NilValue); NEXT();
     OP(INVISIBLE,0): R_Visible = FALSE; NEXT();
-    OP(LDCONST, 1):
-      {
-	R_Visible = TRUE;
-	SEXP value = VECTOR_ELT(constants, GETOP());
-	int type = TYPEOF(value);
-	switch(type) {
-	case REALSXP:
-	    if (IS_SIMPLE_SCALAR(value, REALSXP)) {
-		BCNPUSH_REAL(REAL0(value)[0]);
-		NEXT();
-	    }
-	    break;
-	case INTSXP:
-	    if (IS_SIMPLE_SCALAR(value, INTSXP)) {
-		BCNPUSH_INTEGER(INTEGER0(value)[0]);
-		NEXT();
-	    }
-	    break;
-	case LGLSXP:
-	    if (IS_SIMPLE_SCALAR(value, LGLSXP)) {
-		BCNPUSH_LOGICAL(LOGICAL0(value)[0]);
-		NEXT();
-	    }
-	    break;
-	}
-	if (R_check_constants < 0)
-	    value = duplicate(value);
-	MARK_NOT_MUTABLE(value);
-	BCNPUSH(value);
-	NEXT();
-      }
+    OP(LDCONST, 1): DO_LDCONST(NEXT());
     OP(LDNULL, 0): R_Visible = TRUE; BCNPUSH(R_NilValue); NEXT();
     OP(LDTRUE, 0): R_Visible = TRUE; BCNPUSH_LOGICAL(TRUE); NEXT();
     OP(LDFALSE, 0): R_Visible = TRUE; BCNPUSH_LOGICAL(FALSE); NEXT();
     OP(GETVAR, 1): DO_GETVAR(FALSE, FALSE);
     OP(DDVAL, 1): DO_GETVAR(TRUE, FALSE);
-    OP(SETVAR, 1):
-      {
-	int sidx = GETOP();
-	SEXP loc;
-	if (smallcache)
-	    loc = GET_SMALLCACHE_BINDING_CELL(vcache, sidx);
-	else {
-	    SEXP symbol = VECTOR_ELT(constants, sidx);
-	    loc = GET_BINDING_CELL_CACHE(symbol, rho, vcache, sidx);
-	}
-
-	R_bcstack_t *s = R_BCNodeStackTop - 1;
-	int tag = s->tag;
-
-	if (tag == BNDCELL_TAG_WR(loc))
-	    switch (tag) {
-	    case REALSXP: SET_BNDCELL_DVAL(loc, s->u.dval); NEXT();
-	    case INTSXP: SET_BNDCELL_IVAL(loc, s->u.ival); NEXT();
-	    case LGLSXP: SET_BNDCELL_LVAL(loc, s->u.ival); NEXT();
-	    }
-	else if (BNDCELL_WRITABLE(loc))
-	    switch (tag) {
-	    case REALSXP: NEW_BNDCELL_DVAL(loc, s->u.dval); NEXT();
-	    case INTSXP: NEW_BNDCELL_IVAL(loc, s->u.ival); NEXT();
-	    case LGLSXP: NEW_BNDCELL_LVAL(loc, s->u.ival); NEXT();
-	    }
-
-	SEXP value = GETSTACK(-1);
-	INCREMENT_NAMED(value);
-	if (! SET_BINDING_VALUE(loc, value)) {
-	    SEXP symbol = VECTOR_ELT(constants, sidx);
-	    PROTECT(value);
-	    defineVar(symbol, value, rho);
-	    UNPROTECT(1);
-	}
-	NEXT();
-      }
+    OP(SETVAR, 1): DO_SETVAR(NEXT());
     OP(GETFUN, 1):
       {
 	/* get the function */
 	SEXP symbol = VECTOR_ELT(constants, GETOP());
-	SEXP value = findFun(symbol, rho);
+	SEXP value = R_findFunCached(symbol, rho);
 	INIT_CALL_FRAME(value);
 	if(RTRACE(value)) {
 	  Rprintf("trace: ");
@@ -6925,7 +7638,7 @@ static SEXP bcEval(SEXP body, SEXP rho, Rboolean useCache)
       {
 	/* get the function */
 	SEXP symbol = VECTOR_ELT(constants, GETOP());
-	SEXP value = findFun(symbol, R_GlobalEnv);
+	SEXP value = R_findFunCached(symbol, R_GlobalEnv);
 	INIT_CALL_FRAME(value);
 	if(RTRACE(value)) {
 	  Rprintf("trace: ");
@@ -7706,6 +8419,92 @@ static SEXP bcEval(SEXP body, SEXP rho, Rboolean useCache)
 	  R_BCNodeStackTop--;
 	  NEXT();
       }	  
+    /* Superinstructions emitted by the compiler for common sequences
+       of instructions.  Each one runs the bodies of its components
+       in turn, with the operands laid out as in the unfused sequence.
+       Before moving on to the next component currentpc is set to the
+       cell preceding that component's operands; the compiler records
+       the component's expression and srcref there. */
+    OP(SETVAR_POP, 1): DO_SETVAR(goto op_POP);
+    OP(LDCONST_ADD, 2): DO_LDCONST(NEXT_COMPONENT(ADD));
+    OP(LDCONST_SUB, 2): DO_LDCONST(NEXT_COMPONENT(SUB));
+    OP(LDCONST_MUL, 2): DO_LDCONST(NEXT_COMPONENT(MUL));
+    OP(LDCONST_DIV, 2): DO_LDCONST(NEXT_COMPONENT(DIV));
+    OP(LDCONST_LT, 2): DO_LDCONST(NEXT_COMPONENT(LT));
+    OP(LDCONST_LE, 2): DO_LDCONST(NEXT_COMPONENT(LE));
+    OP(LDCONST_GT, 2): DO_LDCONST(NEXT_COMPONENT(GT));
+    OP(LDCONST_GE, 2): DO_LDCONST(NEXT_COMPONENT(GE));
+    OP(LDCONST_EQ, 2): DO_LDCONST(NEXT_COMPONENT(EQ));
+    OP(LDCONST_NE, 2): DO_LDCONST(NEXT_COMPONENT(NE));
+    OP(GETVAR_ADD, 2): DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(ADD));
+    OP(GETVAR_SUB, 2): DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(SUB));
+    OP(GETVAR_MUL, 2): DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(MUL));
+    OP(GETVAR_DIV, 2): DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(DIV));
+    OP(GETVAR_LT, 2): DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(LT));
+    OP(GETVAR_LE, 2): DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(LE));
+    OP(GETVAR_GT, 2): DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(GT));
+    OP(GETVAR_GE, 2): DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(GE));
+    OP(GETVAR_EQ, 2): DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(EQ));
+    OP(GETVAR_NE, 2): DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(NE));
+    OP(GETVAR_LDCONST_ADD, 3):
+      DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(LDCONST_ADD));
+    OP(GETVAR_LDCONST_SUB, 3):
+      DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(LDCONST_SUB));
+    OP(GETVAR_LDCONST_MUL, 3):
+      DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(LDCONST_MUL));
+    OP(GETVAR_LDCONST_DIV, 3):
+      DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(LDCONST_DIV));
+    OP(GETVAR_LDCONST_LT, 3):
+      DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(LDCONST_LT));
+    OP(GETVAR_LDCONST_LE, 3):
+      DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(LDCONST_LE));
+    OP(GETVAR_LDCONST_GT, 3):
+      DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(LDCONST_GT));
+    OP(GETVAR_LDCONST_GE, 3):
+      DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(LDCONST_GE));
+    OP(GETVAR_LDCONST_EQ, 3):
+      DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(LDCONST_EQ));
+    OP(GETVAR_LDCONST_NE, 3):
+      DO_GETVAR_THEN(FALSE, FALSE, NEXT_COMPONENT(LDCONST_NE));
+    OP(GETVAR_VECSUBSET, 1):
+      {
+	/* Replaces the GETVAR of GETVAR x; STARTSUBSET_N ci l;
+	   GETVAR i; VECSUBSET ci, or of the same sequence for [[,
+	   with the rest of the sequence left in place.  When x is an
+	   atomic vector without attributes and i an in-range integer
+	   the element is pushed and the sequence skipped; otherwise
+	   the generic instructions are run. */
+	if (smallcache) {
+	    SEXP xcell = GET_SMALLCACHE_BINDING_CELL(vcache, PEEKOP(0));
+	    SEXP icell = GET_SMALLCACHE_BINDING_CELL(vcache, PEEKOP(5));
+	    if (BNDCELL_TAG(icell) == INTSXP && BNDCELL_TAG(xcell) == 0) {
+		SEXP vec = CAR(xcell);
+		if (TYPEOF(vec) == PROMSXP)
+		    vec = PRVALUE(vec);
+		R_xlen_t i = BNDCELL_IVAL(icell);
+		int type = TYPEOF(vec);
+		if ((type == REALSXP || type == INTSXP || type == LGLSXP) &&
+		    ATTRIB(vec) == R_NilValue && ! ALTREP(vec) &&
+		    i > 0 && i <= XLENGTH(vec))
+		    switch (type) {
+		    case REALSXP:
+			BCNPUSH_REAL(REAL0(vec)[i - 1]);
+			goto vecsubset_done;
+		    case INTSXP:
+			BCNPUSH_INTEGER(INTEGER0(vec)[i - 1]);
+			goto vecsubset_done;
+		    case LGLSXP:
+			BCNPUSH_LOGICAL(LOGICAL0(vec)[i - 1]);
+			goto vecsubset_done;
+		    }
+	    }
+	}
+	goto op_GETVAR;
+      vecsubset_done:
+	R_Visible = TRUE;
+	pc += 8;
+	NEXT();
+      }
     LASTOP;
   }
 
@@ -8349,6 +9148,211 @@ SEXP NORET do_bcprofstop(SEXP call, SEXP op, SEXP args, SEXP env) {
 }
 #endif
 
+typedef struct {
+    BCODE *pc;		/* the instruction */
+    int relpc, opcode;
+    double count, time, bytes;
+} bcinstrec_t;
+
+static bcinstrec_t *bcinst_recs = NULL;
+static int bcinst_n, bcinst_size;
+static int *bcinst_tab = NULL;	/* hash table of record indices */
+static int bcinst_tabsize;
+static SEXP bcinst_objs = NULL;	/* the body and function of each record */
+static int bcinst_last;		/* the record being charged, or -1 */
+static SEXP bcinst_exclude = NULL;	/* frame whose code is not recorded */
+static double bcinst_time, bcinst_bytes;
+
+static R_INLINE int bcInstrumentHash(BCODE *pc)
+{
+    uintptr_t h = (uintptr_t) pc >> 2;
+    return (int) ((h ^ (h >> 15)) & (bcinst_tabsize - 1));
+}
+
+static void bcInstrumentClear(void)
+{
+    free(bcinst_recs);
+    free(bcinst_tab);
+    bcinst_recs = NULL;
+    bcinst_tab = NULL;
+    bcinst_n = bcinst_size = bcinst_tabsize = 0;
+    if (bcinst_objs != NULL) {
+	R_ReleaseObject(bcinst_objs);
+	bcinst_objs = NULL;
+    }
+    bcinst_last = -1;
+}
+
+/* Grow the records and the hash table to hold 'size' records */
+static void bcInstrumentGrow(int size)
+{
+    bcinstrec_t *recs = realloc(bcinst_recs, size * sizeof(bcinstrec_t));
+    int *tab = malloc(2 * size * sizeof(int));
+    if (recs == NULL || tab == NULL) {
+	free(tab);
+	if (recs != NULL) bcinst_recs = recs;
+	bc_instrumenting = FALSE;
+	error(_("cannot allocate byte code instrumentation records"));
+    }
+    bcinst_recs = recs;
+    free(bcinst_tab);
+    bcinst_tab = tab;
+    bcinst_size = size;
+    bcinst_tabsize = 2 * size;
+    for (int i = 0; i < bcinst_tabsize; i++)
+	bcinst_tab[i] = -1;
+    for (int i = 0; i < bcinst_n; i++) {
+	int h = bcInstrumentHash(bcinst_recs[i].pc);
+	while (bcinst_tab[h] >= 0)
+	    h = (h + 1) & (bcinst_tabsize - 1);
+	bcinst_tab[h] = i;
+    }
+
+    SEXP objs = allocVector(VECSXP, 2 * (R_xlen_t) size);
+    if (bcinst_objs != NULL) {
+	for (int i = 0; i < 2 * bcinst_n; i++)
+	    SET_VECTOR_ELT(objs, i, VECTOR_ELT(bcinst_objs, i));
+	R_ReleaseObject(bcinst_objs);
+    }
+    R_PreserveObject(objs);
+    bcinst_objs = objs;
+}
+
+/* The function whose code is being run in 'rho', as the function part
+   of its call, or NULL at top level */
+static SEXP bcInstrumentFunction(SEXP rho)
+{
+    for (RCNTXT *cptr = R_GlobalContext;
+	 cptr != NULL && cptr->callflag != CTXT_TOPLEVEL;
+	 cptr = cptr->nextcontext)
+	if ((cptr->callflag & CTXT_FUNCTION) && cptr->cloenv == rho)
+	    return TYPEOF(cptr->call) == LANGSXP ? CAR(cptr->call) : R_NilValue;
+    return R_NilValue;
+}
+
+static void bcInstrumentStep(BCODE *pc, BCODE *codebase, SEXP body,
+			     SEXP rho)
+{
+    double now = currentTime(), bytes = R_GetVallocBytes();
+    if (bcinst_last >= 0) {
+	bcinst_recs[bcinst_last].time += now - bcinst_time;
+	bcinst_recs[bcinst_last].bytes += bytes - bcinst_bytes;
+    }
+    if (rho == bcinst_exclude) {
+	bcinst_last = -1;
+	bcinst_time = now;
+	bcinst_bytes = bytes;
+	return;
+    }
+
+    int h = bcInstrumentHash(pc);
+    while (bcinst_tab[h] >= 0 && bcinst_recs[bcinst_tab[h]].pc != pc)
+	h = (h + 1) & (bcinst_tabsize - 1);
+    int i = bcinst_tab[h];
+    if (i < 0) {
+	if (bcinst_n == bcinst_size) {
+	    bcInstrumentGrow(2 * bcinst_size);
+	    h = bcInstrumentHash(pc);
+	    while (bcinst_tab[h] >= 0)
+		h = (h + 1) & (bcinst_tabsize - 1);
+	}
+	i = bcinst_n++;
+	bcinst_tab[h] = i;
+	bcinstrec_t *rec = bcinst_recs + i;
+	rec->pc = pc;
+	rec->relpc = (int) (pc - codebase);
+#ifdef THREADED_CODE
+	rec->opcode = findOp(pc->v);
+#else
+	rec->opcode = *pc;
+#endif
+	rec->count = rec->time = rec->bytes = 0;
+	SET_VECTOR_ELT(bcinst_objs, 2 * i, body);
+	SET_VECTOR_ELT(bcinst_objs, 2 * i + 1, bcInstrumentFunction(rho));
+	/* don't charge the instruction with the growth of the tables */
+	now = currentTime();
+	bytes = R_GetVallocBytes();
+    }
+    bcinst_recs[i].count++;
+    bcinst_last = i;
+    bcinst_time = now;
+    bcinst_bytes = bytes;
+}
+
+SEXP attribute_hidden do_bcinstrument(SEXP call, SEXP op, SEXP args,
+				      SEXP env)
+{
+    checkArity(op, args);
+    int on = asLogical(CAR(args));
+    if (on == NA_LOGICAL)
+	error(_("invalid '%s' argument"), "on");
+    SEXP exclude = CADR(args);
+    if (on) {
+	bc_instrumenting = FALSE;
+	bcInstrumentClear();
+	bcInstrumentGrow(1024);
+	bcinst_exclude = TYPEOF(exclude) == ENVSXP ? exclude : NULL;
+	bcinst_time = currentTime();
+	bcinst_bytes = R_GetVallocBytes();
+	bc_instrumenting = TRUE;
+    }
+    else if (bc_instrumenting) {
+	bc_instrumenting = FALSE;
+	if (bcinst_last >= 0) {
+	    bcinst_recs[bcinst_last].time += currentTime() - bcinst_time;
+	    bcinst_recs[bcinst_last].bytes +=
+		R_GetVallocBytes() - bcinst_bytes;
+	}
+	bcinst_last = -1;
+	bcinst_exclude = NULL;
+    }
+    return R_NilValue;
+}
+
+/* The records of the last instrumentation, as a list with the
+   function and srcref of each instruction, its position in the code
+   and its opcode, and the counts, seconds and bytes charged to it. */
+SEXP attribute_hidden do_bcinstrumentdata(SEXP call, SEXP op, SEXP args,
+					  SEXP env)
+{
+    checkArity(op, args);
+    int n = bcinst_n;
+    const char *names[] = { "fun", "srcref", "pc", "opcode",
+			    "count", "time", "bytes", "" };
+    SEXP ans = PROTECT(mkNamed(VECSXP, names));
+    SEXP fun = allocVector(VECSXP, n);
+    SET_VECTOR_ELT(ans, 0, fun);
+    SEXP srcref = allocVector(VECSXP, n);
+    SET_VECTOR_ELT(ans, 1, srcref);
+    SEXP relpc = allocVector(INTSXP, n);
+    SET_VECTOR_ELT(ans, 2, relpc);
+    SEXP opcode = allocVector(INTSXP, n);
+    SET_VECTOR_ELT(ans, 3, opcode);
+    SEXP count = allocVector(REALSXP, n);
+    SET_VECTOR_ELT(ans, 4, count);
+    SEXP time = allocVector(REALSXP, n);
+    SET_VECTOR_ELT(ans, 5, time);
+    SEXP bytes = allocVector(REALSXP, n);
+    SET_VECTOR_ELT(ans, 6, bytes);
+    for (int i = 0; i < n; i++) {
+	bcinstrec_t *rec = bcinst_recs + i;
+	SEXP body = VECTOR_ELT(bcinst_objs, 2 * i);
+	SEXP constants = BCCONSTS(body);
+	SET_VECTOR_ELT(fun, i, VECTOR_ELT(bcinst_objs, 2 * i + 1));
+	SET_VECTOR_ELT(srcref, i,
+		       getLocTableElt(rec->relpc,
+				      findLocTable(constants, "srcrefsIndex"),
+				      constants));
+	INTEGER(relpc)[i] = rec->relpc;
+	INTEGER(opcode)[i] = rec->opcode;
+	REAL(count)[i] = rec->count;
+	REAL(time)[i] = rec->time;
+	REAL(bytes)[i] = rec->bytes;
+    }
+    UNPROTECT(1); /* ans */
+    return ans;
+}
+
 /* end of byte code section */
 
 SEXP attribute_hidden do_setnumthreads(SEXP call, SEXP op, SEXP args, SEXP rho)
@@ -209,6 +209,7 @@ Rf_ReplIteration(SEXP rho, int savestack, int browselevel, R_ReplState *state)
 
     if(!*state->bufp) {
 	    R_Busy(0);
+	    R_gc_idle_sweep();
 	    if (R_ReadConsole(R_PromptString(browselevel, state->prompt_type),
 			      state->buf, CONSOLE_BUFFER_SIZE, 1) == 0)
 		return(-1);
@@ -175,6 +175,141 @@ SEXP attribute_hidden matchArgExact(SEXP tag, SEXP * list)
 #define SET_ARGUSED(x,v) SETLEVELS(x,v)
 
 
+/* Matching plans
+
+   The result of matching depends only on the formals and on the tags
+   of the supplied arguments and which of them are R_MissingArg, the
+   shape of the call.  The outcome of a successful match, the supplied
+   argument giving each formal, the final ARGUSED levels of the
+   supplied arguments and the position of ... is stored in a plan
+   keyed on the formals and the shape, and later calls with the same
+   shape just copy the arguments into place.  The plans are kept in a
+   direct mapped table, which also keeps the formals alive so that
+   their address cannot be reused while a plan refers to it.  Matches
+   involving partial matching are only replayed while partial
+   matching is not to be warned about.  Calls with more than
+   ARGPLAN_MAXARGS arguments (e.g. from do.call) are matched as usual,
+   as replaying a plan needs stack space for each argument. */
+
+#define ARGPLAN_SIZE 4096
+#define ARGPLAN_MAXARGS 64
+
+static SEXP ArgPlanCache = NULL;
+
+typedef struct {
+    int nformals, nsupplied, dots, partial;
+} argplan_t;
+
+#define ARGPLAN_KEYS(p) ((uintptr_t *) ((p) + 1))
+#define ARGPLAN_SRC(p) ((int *) (ARGPLAN_KEYS(p) + (p)->nsupplied))
+#define ARGPLAN_USED(p) (ARGPLAN_SRC(p) + (p)->nformals)
+
+static R_INLINE uintptr_t argPlanKey(SEXP b)
+{
+    return (uintptr_t) TAG(b) | (CAR(b) == R_MissingArg);
+}
+
+static R_INLINE int argPlanIndex(SEXP formals, SEXP supplied, int *pm)
+{
+    uintptr_t h = (uintptr_t) formals >> 4;
+    int m = 0;
+    for (SEXP b = supplied; b != R_NilValue; b = CDR(b), m++)
+	h = h * 31 + argPlanKey(b);
+    *pm = m;
+    return (int) ((h ^ (h >> 17)) % ARGPLAN_SIZE);
+}
+
+static SEXP matchArgsByPlan(SEXP formals, SEXP supplied)
+{
+    if (ArgPlanCache == NULL)
+	return NULL;
+    int m, idx = argPlanIndex(formals, supplied, &m);
+    if (m > ARGPLAN_MAXARGS || VECTOR_ELT(ArgPlanCache, 2 * idx) != formals)
+	return NULL;
+    SEXP plan = VECTOR_ELT(ArgPlanCache, 2 * idx + 1);
+    argplan_t *p = (argplan_t *) RAW(plan);
+    if (p->nsupplied != m || (p->partial && R_warn_partial_match_args))
+	return NULL;
+    uintptr_t *keys = ARGPLAN_KEYS(p);
+    SEXP sv[m ? m : 1];
+    int k = 0;
+    for (SEXP b = supplied; b != R_NilValue; b = CDR(b), k++) {
+	if (argPlanKey(b) != keys[k])
+	    return NULL;
+	sv[k] = b;
+    }
+
+    PROTECT(plan);
+    int *src = ARGPLAN_SRC(p), *used = ARGPLAN_USED(p);
+    for (k = 0; k < m; k++)
+	SET_ARGUSED(sv[k], used[k]);
+    SEXP actuals = R_NilValue, dots = R_NilValue;
+    for (int j = p->nformals - 1; j >= 0; j--) {
+	actuals = CONS_NR(R_MissingArg, actuals);
+	SET_MISSING(actuals, 1);
+	if (src[j] >= 0) {
+	    SEXP val = CAR(sv[src[j]]);
+	    SETCAR(actuals, val);
+	    if (val != R_MissingArg) SET_MISSING(actuals, 0);
+	}
+	else if (j == p->dots)
+	    dots = actuals;
+    }
+    if (dots != R_NilValue) {
+	/* the unused arguments, as in matchArgs_NR */
+	SET_MISSING(dots, 0);
+	int ndots = 0;
+	for (k = 0; k < m; k++)
+	    if (!used[k]) ndots++;
+	if (ndots) {
+	    PROTECT(actuals);
+	    SEXP a = allocList(ndots);
+	    SET_TYPEOF(a, DOTSXP);
+	    SETCAR(dots, a);
+	    for (k = 0; k < m; k++)
+		if (!used[k]) {
+		    SETCAR(a, CAR(sv[k]));
+		    SET_TAG(a, TAG(sv[k]));
+		    a = CDR(a);
+		}
+	    UNPROTECT(1); /* actuals */
+	}
+    }
+    UNPROTECT(1); /* plan */
+    return actuals;
+}
+
+static void storeArgPlan(SEXP formals, SEXP supplied, int n, const int *src,
+			 int dots, Rboolean partial)
+{
+    if (ArgPlanCache == NULL) {
+	ArgPlanCache = allocVector(VECSXP, 2 * ARGPLAN_SIZE);
+	R_PreserveObject(ArgPlanCache);
+    }
+    int m;
+    int idx = argPlanIndex(formals, supplied, &m);
+    if (m > ARGPLAN_MAXARGS)
+	return;
+    SEXP plan = allocVector(RAWSXP, sizeof(argplan_t) +
+			    m * sizeof(uintptr_t) + (n + m) * sizeof(int));
+    argplan_t *p = (argplan_t *) RAW(plan);
+    p->nformals = n;
+    p->nsupplied = m;
+    p->dots = dots;
+    p->partial = partial;
+    uintptr_t *keys = ARGPLAN_KEYS(p);
+    int *used = ARGPLAN_USED(p), k = 0;
+    for (SEXP b = supplied; b != R_NilValue; b = CDR(b), k++) {
+	keys[k] = argPlanKey(b);
+	used[k] = ARGUSED(b);
+    }
+    memcpy(ARGPLAN_SRC(p), src, n * sizeof(int));
+    /* the slot is written only after 'plan' has been allocated, so it
+       is never left holding 'formals' with another call's plan */
+    SET_VECTOR_ELT(ArgPlanCache, 2 * idx, formals);
+    SET_VECTOR_ELT(ArgPlanCache, 2 * idx + 1, plan);
+}
+
 /* We need to leave 'supplied' unchanged in case we call UseMethod */
 /* MULTIPLE_MATCHES was added by RI in Jan 2005 but never activated:
    code in R-2-8-branch */
@@ -183,10 +318,14 @@ SEXP attribute_hidden matchArgExact(SEXP tag, SEXP * list)
 
 SEXP attribute_hidden matchArgs_NR(SEXP formals, SEXP supplied, SEXP call)
 {
-    Rboolean seendots;
-    int i, arg_i = 0;
+    Rboolean seendots, partial = FALSE;
+    int i, arg_i = 0, dots_i = -1;
     SEXP f, a, b, dots, actuals;
 
+    actuals = matchArgsByPlan(formals, supplied);
+    if (actuals != NULL)
+	return actuals;
+
     actuals = R_NilValue;
     for (f = formals ; f != R_NilValue ; f = CDR(f), arg_i++) {
 	/* CONS_NR is used since argument lists created here are only
@@ -205,6 +344,9 @@ SEXP attribute_hidden matchArgs_NR(SEXP formals, SEXP supplied, SEXP call)
      */
     int fargused[arg_i ? arg_i : 1]; // avoid undefined behaviour
     memset(fargused, 0, sizeof(fargused));
+    /* the supplied argument last stored in each formal, for the plan */
+    int nformals = arg_i, fsrc[arg_i ? arg_i : 1];
+    for (i = 0; i < nformals; i++) fsrc[i] = -1;
 
     for(b = supplied; b != R_NilValue; b = CDR(b)) SET_ARGUSED(b, 0);
 
@@ -238,6 +380,7 @@ SEXP attribute_hidden matchArgs_NR(SEXP formals, SEXP supplied, SEXP call)
 		      if(CAR(b) != R_MissingArg) SET_MISSING(a, 0);
 		      SET_ARGUSED(b, 2);
 		      fargused[arg_i] = 2;
+		      fsrc[arg_i] = i - 1;
 		  }
 	      }
 	    }
@@ -261,6 +404,7 @@ SEXP attribute_hidden matchArgs_NR(SEXP formals, SEXP supplied, SEXP call)
 	    if (TAG(f) == R_DotsSymbol && !seendots) {
 		/* Record where ... value goes */
 		dots = a;
+		dots_i = arg_i;
 		seendots = TRUE;
 	    } else {
 		for (b = supplied, i = 1; b != R_NilValue; b = CDR(b), i++) {
@@ -283,6 +427,8 @@ SEXP attribute_hidden matchArgs_NR(SEXP formals, SEXP supplied, SEXP call)
 			if (CAR(b) != R_MissingArg) SET_MISSING(a, 0);
 			SET_ARGUSED(b, 1);
 			fargused[arg_i] = 1;
+			fsrc[arg_i] = i - 1;
+			partial = TRUE;
 		    }
 		}
 	    }
@@ -303,6 +449,8 @@ SEXP attribute_hidden matchArgs_NR(SEXP formals, SEXP supplied, SEXP call)
     a = actuals;
     b = supplied;
     seendots = FALSE;
+    arg_i = 0;
+    i = 0;
 
     while (f != R_NilValue && b != R_NilValue && !seendots) {
 	if (TAG(f) == R_DotsSymbol) {
@@ -310,11 +458,13 @@ SEXP attribute_hidden matchArgs_NR(SEXP formals, SEXP supplied, SEXP call)
 	    seendots = TRUE;
 	    f = CDR(f);
 	    a = CDR(a);
+	    arg_i++;
 	} else if (CAR(a) != R_MissingArg) {
 	    /* Already matched by tag */
 	    /* skip to next formal */
 	    f = CDR(f);
 	    a = CDR(a);
+	    arg_i++;
 	} else if (ARGUSED(b) || TAG(b) != R_NilValue) {
 	    /* This value used or tagged , skip to next value */
 	    /* The second test above is needed because we */
@@ -322,14 +472,18 @@ SEXP attribute_hidden matchArgs_NR(SEXP formals, SEXP supplied, SEXP call)
 	    /* matches. */
 	    /* The formal being considered remains the same */
 	    b = CDR(b);
+	    i++;
 	} else {
 	    /* We have a positional match */
 	    SETCAR(a, CAR(b));
 	    if(CAR(b) != R_MissingArg) SET_MISSING(a, 0);
 	    SET_ARGUSED(b, 1);
+	    fsrc[arg_i] = i;
 	    b = CDR(b);
+	    i++;
 	    f = CDR(f);
 	    a = CDR(a);
+	    arg_i++;
 	}
     }
 
@@ -378,6 +532,7 @@ SEXP attribute_hidden matchArgs_NR(SEXP formals, SEXP supplied, SEXP call)
 		      strchr(CHAR(asChar(deparse1line(unused, 0))), '('));
 	}
     }
+    storeArgPlan(formals, supplied, nformals, fsrc, dots_i, partial);
     UNPROTECT(1);
     return(actuals);
 }
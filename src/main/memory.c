@@ -35,6 +35,7 @@
 #endif
 
 #include <stdarg.h>
+#include <errno.h>
 
 #include <R_ext/RS.h> /* for S4 allocation */
 #include <R_ext/Print.h>
@@ -361,6 +362,74 @@ static double R_VGrowIncrFrac = 0.2, R_VShrinkIncrFrac = 0.2;
 static int R_VGrowIncrMin = 80000, R_VShrinkIncrMin = 0;
 #endif
 
+/* Sweeping of the free lists after full collections is deferred to
+   allocation time if the environment variable R_GC_LAZY_SWEEP is set
+   to 1 or 2; see DeferSweep below. */
+static int R_GCLazySweep = 0;
+
+/* Full collections can share the marking work among a team of
+   threads.  The number of threads is taken from the environment
+   variable R_GC_MARK_THREADS; the default of one thread uses the
+   serial collector.  Parallel marking needs OpenMP and GCC-style
+   atomic builtins, and is not used with PROTECTCHECK. */
+#if defined(_OPENMP) && defined(__GNUC__) && ! defined(PROTECTCHECK)
+# define PARALLEL_MARK
+# define MAX_MARK_THREADS 64
+static int R_GCMarkThreads = 1;
+#endif
+
+/* Full collections are run incrementally, with the marking done in
+   slices of at most R_GCMaxPause seconds interleaved with the mutator,
+   if the environment variable R_GC_MAX_PAUSE gives a target pause in
+   milliseconds; see IncrementalSlice. */
+static double R_GCMaxPause = 0.0;
+
+/* Collections can be recorded in a ring buffer of events, enabled by
+   gctrace() or by setting the environment variable R_GC_TRACE to the
+   number of events to keep.  The counters are updated during every
+   collection, as that is cheaper than testing whether to do it. */
+typedef struct {
+    double start, elapsed, mark;
+    int level, trigger, slice;
+    double promoted, pages_released, large_freed, ncells, vcells;
+} gc_event_t;
+
+enum {
+    GC_TRIGGER_NONE = 0,
+    GC_TRIGGER_REQUEST,
+    GC_TRIGGER_RETRY,
+    GC_TRIGGER_DEFERRED,
+    GC_TRIGGER_NODES,
+    GC_TRIGGER_VECTORS,
+    GC_TRIGGER_TORTURE
+};
+
+static const char *const gc_trigger_names[] =
+    { "", "request", "retry", "deferred", "nodes", "vectors", "torture" };
+
+static gc_event_t *gc_trace = NULL;
+static int gc_trace_size = 0;
+/* events gc_trace_first, ..., gc_trace_count - 1 are available */
+static R_size_t gc_trace_first = 0, gc_trace_count = 0;
+static int gc_trigger = GC_TRIGGER_NONE;
+static double gc_trace_mark;
+static R_size_t gc_trace_promoted, gc_trace_pages, gc_trace_large_freed;
+
+static Rboolean set_gc_trace_size(int size)
+{
+    free(gc_trace);
+    gc_trace = NULL;
+    gc_trace_size = 0;
+    gc_trace_first = gc_trace_count = 0;
+    if (size > 0) {
+	gc_trace = malloc(size * sizeof(gc_event_t));
+	if (gc_trace == NULL)
+	    return FALSE;
+	gc_trace_size = size;
+    }
+    return TRUE;
+}
+
 static void init_gc_grow_settings()
 {
     char *arg;
@@ -415,6 +484,32 @@ static void init_gc_grow_settings()
 	if (0.05 <= frac && frac <= 0.80)
 	    R_VGrowIncrFrac = frac;
     }
+    arg = getenv("R_GC_LAZY_SWEEP");
+    if (arg != NULL) {
+	int which = atoi(arg);
+	if (0 <= which && which <= 2)
+	    R_GCLazySweep = which;
+    }
+#ifdef PARALLEL_MARK
+    arg = getenv("R_GC_MARK_THREADS");
+    if (arg != NULL) {
+	int nthreads = atoi(arg);
+	if (1 <= nthreads && nthreads <= MAX_MARK_THREADS)
+	    R_GCMarkThreads = nthreads;
+    }
+#endif
+    arg = getenv("R_GC_MAX_PAUSE");
+    if (arg != NULL) {
+	double msecs = atof(arg);
+	if (msecs > 0)
+	    R_GCMaxPause = msecs / 1000.0;
+    }
+    arg = getenv("R_GC_TRACE");
+    if (arg != NULL) {
+	int size = atoi(arg);
+	if (size > 0)
+	    set_gc_trace_size(size);
+    }
 }
 
 /* Maximal Heap Limits.  These variables contain upper limits on the
@@ -497,6 +592,7 @@ static SEXP R_VStack = NULL;		/* R_alloc stack pointer */
 static SEXP R_PreciousList = NULL;      /* List of Persistent Objects */
 static R_size_t R_LargeVallocSize = 0;
 static R_size_t R_SmallVallocSize = 0;
+static R_size_t R_VallocTotal = 0;	/* vector cells allocated, ever */
 static R_size_t orig_R_NSize;
 static R_size_t orig_R_VSize;
 
@@ -551,6 +647,10 @@ static int num_old_gens_to_collect = 0;
 static int gen_gc_counts[NUM_OLD_GENERATIONS + 1];
 static int collect_counts[NUM_OLD_GENERATIONS];
 
+/* elapsed time spent marking, accumulated by collection level */
+static double gen_gc_mark_times[NUM_OLD_GENERATIONS + 1];
+static double gc_last_mark_time = 0.0;
+
 
 /* Node Pages.  Non-vector nodes and small vector nodes are allocated
    from fixed size pages.  The pages for each node class are kept in a
@@ -612,10 +712,18 @@ static struct {
     SEXP OldToNew[NUM_OLD_GENERATIONS];
     SEXPREC OldToNewPeg[NUM_OLD_GENERATIONS];
 #endif
+    SEXP Grey;
+    SEXPREC GreyPeg;
     int OldCount[NUM_OLD_GENERATIONS], AllocCount, PageCount;
-    PAGE_HEADER *pages;
+    PAGE_HEADER *pages, *sweep;
 } R_GenHeap[NUM_NODE_CLASSES];
 
+/* Incremental collection relies on the old-to-new lists to find
+   marked nodes that have been given references to unmarked ones. */
+#if ! defined(PROTECTCHECK) && ! defined(EXPEL_OLD_TO_NEW)
+# define INCREMENTAL_GC
+#endif
+
 static R_size_t R_NodesInUse = 0;
 
 #define NEXT_NODE(s) (s)->gengc_next_node
@@ -666,21 +774,11 @@ static R_size_t R_NodesInUse = 0;
 
 /* This macro calls dc__action__ for each child of __n__, passing
    dc__extra__ as a second argument for each call. */
-/* When the CHARSXP hash chains are maintained through the ATTRIB
-   field it is important that we NOT trace those fields otherwise too
-   many CHARSXPs will be kept alive artificially. As a safety we don't
-   ignore all non-NULL ATTRIB values for CHARSXPs but only those that
-   are themselves CHARSXPs, which is what they will be if they are
-   part of a hash chain.  Theoretically, for CHARSXPs the ATTRIB field
-   should always be either R_NilValue or a CHARSXP. */
 #ifdef PROTECTCHECK
 # define HAS_GENUINE_ATTRIB(x) \
-    (TYPEOF(x) != FREESXP && ATTRIB(x) != R_NilValue && \
-     (TYPEOF(x) != CHARSXP || TYPEOF(ATTRIB(x)) != CHARSXP))
+    (TYPEOF(x) != FREESXP && ATTRIB(x) != R_NilValue)
 #else
-# define HAS_GENUINE_ATTRIB(x) \
-    (ATTRIB(x) != R_NilValue && \
-     (TYPEOF(x) != CHARSXP || TYPEOF(ATTRIB(x)) != CHARSXP))
+# define HAS_GENUINE_ATTRIB(x) (ATTRIB(x) != R_NilValue)
 #endif
 
 #ifdef PROTECTCHECK
@@ -786,10 +884,13 @@ static R_size_t R_NodesInUse = 0;
 
 /* Node Allocation. */
 
+static Rboolean SweepPages(int node_class, Rboolean all);
+
 #define CLASS_GET_FREE_NODE(c,s) do { \
   SEXP __n__ = R_GenHeap[c].Free; \
   if (__n__ == R_GenHeap[c].New) { \
-    GetNewPage(c); \
+    if (R_GenHeap[c].sweep == NULL || ! SweepPages(c, FALSE)) \
+      GetNewPage(c); \
     __n__ = R_GenHeap[c].Free; \
   } \
   R_GenHeap[c].Free = NEXT_NODE(__n__); \
@@ -1035,6 +1136,7 @@ static void TryToReleasePages(void)
 		}
 		if (! in_use) {
 		    ReleasePage(page, i);
+		    gc_trace_pages++;
 		    if (last == NULL)
 			R_GenHeap[i].pages = next;
 		    else
@@ -1088,6 +1190,186 @@ static R_INLINE R_size_t getVecSizeInVEC(SEXP s)
     return BYTE2VEC(size);
 }
 
+/* Large vector allocation policies, set by options(largeVectorPolicy).
+
+   Each large vector node is preceded by a header recording how its
+   memory was obtained.  With a policy other than "default", vectors
+   of at least LARGEVEC_MAP_MIN bytes are mapped directly, aligned so
+   that they can be backed by transparent huge pages, and optionally
+   interleaved across or bound to a set of NUMA nodes.  If the policy
+   cannot be applied, because huge pages cannot be requested or the
+   NUMA placement fails, the vector is allocated with malloc instead,
+   so the bytes are accounted to the policy actually used. */
+
+#if defined(HAVE_MMAP)
+# include <sys/mman.h>
+# define LARGEVEC_USE_MMAP
+# if defined(__linux__)
+#  include <unistd.h>
+#  include <sys/syscall.h>
+#  ifdef SYS_mbind
+#   define LARGEVEC_USE_MBIND
+#   define LARGEVEC_MPOL_BIND 2
+#   define LARGEVEC_MPOL_INTERLEAVE 3
+#  endif
+# endif
+#endif
+
+enum {
+    LARGEVEC_DEFAULT = 0,
+    LARGEVEC_HUGEPAGES,
+    LARGEVEC_INTERLEAVE,
+    LARGEVEC_BIND,
+    NUM_LARGEVEC_POLICIES
+};
+
+static const char *const LargeVecPolicyNames[NUM_LARGEVEC_POLICIES] =
+    { "malloc", "huge pages", "interleaved", "bound" };
+
+typedef union {
+    struct {
+	R_size_t size;	/* bytes obtained, including this header */
+	int policy;
+    } h;
+    double align[2];
+} LargeVecHdr;
+
+#define LARGEVEC_MAP_MIN (2 * 1024 * 1024) /* the usual huge page size */
+
+static int R_LargeVecPolicy = LARGEVEC_DEFAULT;
+static unsigned long R_LargeVecNodes = 0;
+static R_size_t LargeVecBytes[NUM_LARGEVEC_POLICIES];
+
+/* Parse "default", "hugepages", "interleave", "interleave:<nodes>" or
+   "bind:<nodes>", with <nodes> a comma-separated list of NUMA node
+   numbers.  Returns FALSE, leaving the policy unchanged, if 'spec' is
+   not valid. */
+Rboolean attribute_hidden R_SetLargeVecPolicy(const char *spec)
+{
+    int policy;
+    unsigned long nodes = 0;
+    const char *p = NULL;
+
+    if (streql(spec, "default"))
+	policy = LARGEVEC_DEFAULT;
+    else if (streql(spec, "hugepages"))
+	policy = LARGEVEC_HUGEPAGES;
+    else if (streql(spec, "interleave")) {
+	policy = LARGEVEC_INTERLEAVE;
+	nodes = ~0UL; /* all nodes the process may use */
+    }
+    else if (strncmp(spec, "interleave:", 11) == 0) {
+	policy = LARGEVEC_INTERLEAVE;
+	p = spec + 11;
+    }
+    else if (strncmp(spec, "bind:", 5) == 0) {
+	policy = LARGEVEC_BIND;
+	p = spec + 5;
+    }
+    else return FALSE;
+
+    if (p != NULL) {
+	do {
+	    char *end;
+	    long node = strtol(p, &end, 10);
+	    if (end == p || node < 0 || node >= 8 * (long) sizeof(nodes))
+		return FALSE;
+	    nodes |= 1UL << node;
+	    p = end;
+	} while (*p++ == ',');
+	if (p[-1] != '\0') return FALSE;
+    }
+
+#ifndef LARGEVEC_USE_MMAP
+    if (policy != LARGEVEC_DEFAULT)
+	warning(_("large vector policy '%s' is not supported on this platform"),
+		spec);
+#elif !defined(LARGEVEC_USE_MBIND)
+    if (policy == LARGEVEC_INTERLEAVE || policy == LARGEVEC_BIND)
+	warning(_("NUMA placement is not supported on this platform"));
+#endif
+    R_LargeVecPolicy = policy;
+    R_LargeVecNodes = nodes;
+    return TRUE;
+}
+
+#ifdef LARGEVEC_USE_MMAP
+static LargeVecHdr *large_vec_map(R_size_t *plen, int *ppolicy)
+{
+    size_t align = LARGEVEC_MAP_MIN;
+    size_t len = ((*plen - 1) / align + 1) * align;
+    if (len + align < len) return NULL; /* overflow */
+
+    char *p = mmap(NULL, len + align, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    /* trim to an aligned region: there is always some tail to drop */
+    char *q = (char *) (((uintptr_t) p + align - 1) & ~(uintptr_t) (align - 1));
+    if (q > p)
+	munmap(p, q - p);
+    munmap(q + len, p + len + align - (q + len));
+
+    int policy = LARGEVEC_DEFAULT;
+#ifdef MADV_HUGEPAGE
+    if (madvise(q, len, MADV_HUGEPAGE) == 0)
+	policy = LARGEVEC_HUGEPAGES;
+#endif
+#ifdef LARGEVEC_USE_MBIND
+    if (R_LargeVecPolicy == LARGEVEC_INTERLEAVE ||
+	R_LargeVecPolicy == LARGEVEC_BIND) {
+	int mode = R_LargeVecPolicy == LARGEVEC_INTERLEAVE ?
+	    LARGEVEC_MPOL_INTERLEAVE : LARGEVEC_MPOL_BIND;
+	unsigned long nodes = R_LargeVecNodes;
+	policy = syscall(SYS_mbind, q, len, mode, &nodes,
+			 8 * sizeof(nodes) + 1, 0) == 0 ?
+	    R_LargeVecPolicy : LARGEVEC_DEFAULT;
+    }
+#endif
+    if (policy == LARGEVEC_DEFAULT) { /* nothing gained over malloc */
+	munmap(q, len);
+	return NULL;
+    }
+    *plen = len;
+    *ppolicy = policy;
+    return (LargeVecHdr *) q;
+}
+#endif
+
+static void *large_vec_alloc(R_size_t bytes)
+{
+    R_size_t len = bytes + sizeof(LargeVecHdr);
+    int policy = LARGEVEC_DEFAULT;
+    LargeVecHdr *h = NULL;
+
+    if (len < bytes) return NULL; /* overflow */
+#ifdef LARGEVEC_USE_MMAP
+    if (R_LargeVecPolicy != LARGEVEC_DEFAULT && len >= LARGEVEC_MAP_MIN)
+	h = large_vec_map(&len, &policy);
+#endif
+    if (h == NULL) {
+	policy = LARGEVEC_DEFAULT;
+	h = malloc(len);
+	if (h == NULL) return NULL;
+    }
+    h->h.size = len;
+    h->h.policy = policy;
+    LargeVecBytes[policy] += len;
+    return h + 1;
+}
+
+static void large_vec_free(void *ptr)
+{
+    LargeVecHdr *h = ((LargeVecHdr *) ptr) - 1;
+    LargeVecBytes[h->h.policy] -= h->h.size;
+#ifdef LARGEVEC_USE_MMAP
+    if (h->h.policy != LARGEVEC_DEFAULT) {
+	munmap(h, h->h.size);
+	return;
+    }
+#endif
+    free(h);
+}
+
 static void custom_node_free(void *ptr);
 
 static void ReleaseLargeFreeVectors()
@@ -1109,9 +1391,10 @@ static void ReleaseLargeFreeVectors()
 #endif
 		UNSNAP_NODE(s);
 		R_GenHeap[node_class].AllocCount--;
+		gc_trace_large_freed += size * sizeof(VECREC);
 		if (node_class == LARGE_NODE_CLASS) {
 		    R_LargeVallocSize -= size;
-		    free(s);
+		    large_vec_free(s);
 		} else {
 		    custom_node_free(s);
 		}
@@ -1211,6 +1494,7 @@ static void AgeNodeAndChildren(SEXP s, int gen)
 	    gc_error("****snapping into wrong generation\n");
 	SNAP_NODE(s, R_GenHeap[NODE_CLASS(s)].Old[gen]);
 	R_GenHeap[NODE_CLASS(s)].OldCount[gen]++;
+	gc_trace_promoted++;
 	DO_CHILDREN(s, AGE_NODE, gen);
     }
 }
@@ -1298,6 +1582,74 @@ static void SortNodes(void)
 }
 #endif
 
+/* Lazy Sweeping.  With lazy sweeping enabled the sort of the free
+   lists at the end of a full collection is not done immediately.
+   Instead the free list of each small node class is emptied, leaving
+   the unmarked nodes in the pages unlinked, and the pages are swept
+   one at a time when the allocator runs out of free nodes of that
+   class.  Between the end of a full collection and the point where a
+   page is swept the nodes on the page that are not marked are exactly
+   the free ones, since all nodes allocated in the meantime come from
+   pages that have already been swept.  Any pages not yet swept when
+   the next collection starts are swept then, before marks are
+   cleared.
+
+   With R_GCLazySweep set to 2 the remaining pages are also swept
+   between top level evaluations, when R is waiting for input. */
+
+static void DeferSweep(void)
+{
+    for (int i = 0; i < NUM_SMALL_NODE_CLASSES; i++) {
+	SET_NEXT_NODE(R_GenHeap[i].New, R_GenHeap[i].New);
+	SET_PREV_NODE(R_GenHeap[i].New, R_GenHeap[i].New);
+	R_GenHeap[i].Free = R_GenHeap[i].New;
+	R_GenHeap[i].sweep = R_GenHeap[i].pages;
+    }
+}
+
+/* Sweep pages of a class onto its free list until there are free
+   nodes, or until all pages are swept if 'all' is true.  Returns TRUE
+   if free nodes are available. */
+static Rboolean SweepPages(int node_class, Rboolean all)
+{
+    PAGE_HEADER *page;
+    SEXP s, base = R_GenHeap[node_class].New;
+    int node_size = NODE_SIZE(node_class);
+    int page_count = (R_PAGE_SIZE - sizeof(PAGE_HEADER)) / node_size;
+
+    while ((page = R_GenHeap[node_class].sweep) != NULL) {
+	int j;
+	char *data = PAGE_DATA(page);
+
+	R_GenHeap[node_class].sweep = page->next;
+	for (j = 0; j < page_count; j++, data += node_size) {
+	    s = (SEXP) data;
+	    if (! NODE_IS_MARKED(s)) {
+		SNAP_NODE(s, base);
+		if (R_GenHeap[node_class].Free == base)
+		    R_GenHeap[node_class].Free = s;
+	    }
+	}
+	if (! all && R_GenHeap[node_class].Free != base)
+	    break;
+    }
+    return R_GenHeap[node_class].Free != base;
+}
+
+static void FinishSweep(void)
+{
+    for (int i = 0; i < NUM_SMALL_NODE_CLASSES; i++)
+	if (R_GenHeap[i].sweep != NULL)
+	    SweepPages(i, TRUE);
+}
+
+/* called from the REPL when waiting for input */
+void attribute_hidden R_gc_idle_sweep(void)
+{
+    if (R_GCLazySweep > 1 && ! R_in_gc)
+	FinishSweep();
+}
+
 
 /* Finalization and Weak References */
 
@@ -1626,15 +1978,561 @@ SEXP attribute_hidden do_regFinaliz(SEXP call, SEXP op, SEXP args, SEXP rho)
     } \
 } while (0)
 
+/* Parallel Marking.  When more than one mark thread is requested the
+   transitive part of the marking in full collections, the work done
+   by PROCESS_NODES, is shared among a team of OpenMP threads.  Roots
+   are still forwarded serially.  The node lists are not thread safe,
+   so the workers only set mark bits, atomically, and leave reachable
+   nodes where they are; RelinkMarkedNodes then moves the marked nodes
+   into the old generation in a single pass once marking is complete.
+
+   Each worker has a private mark stack.  A worker with plenty of work
+   offers a chunk from the bottom of its stack in its shared buffer,
+   and workers that run out of work steal these chunks.  Marking is
+   complete when all workers are idle; since only the owner adds to a
+   shared buffer and a worker empties its own buffer before going
+   idle, no work can be left at that point.
+
+   If a mark stack cannot be grown the node is instead unsnapped and
+   placed on an overflow list under a lock, and the overflow list is
+   processed in another round once the workers are done. */
+
+#ifdef PARALLEL_MARK
+#include <omp.h>
+#ifdef HAVE_SCHED_H
+# include <sched.h>
+#endif
+
+#define MARK_SHARE_CHUNK 256
+#define MARK_STACK_INIT_SIZE 16384
+
+typedef struct {
+    SEXP *stack;
+    R_size_t bottom, top, size;
+    SEXP shared[MARK_SHARE_CHUNK];
+    int nshared;
+    omp_lock_t lock;
+} R_mark_worker_t;
+
+static R_mark_worker_t *mark_workers = NULL;
+static int mark_idle_count;
+static SEXP mark_overflow_nodes = NULL;
+static omp_lock_t mark_overflow_lock;
+static int mark_bit_word;
+static unsigned int mark_bit_mask;
+
+static Rboolean InitParallelMark(void)
+{
+    static Rboolean failed = FALSE;
+    int i;
+
+    if (mark_workers != NULL)
+	return TRUE;
+    if (failed)
+	return FALSE;
+
+    /* locate the mark bit within the sxpinfo header */
+    union {
+	struct sxpinfo_struct info;
+	unsigned int words[sizeof(struct sxpinfo_struct) / sizeof(unsigned int)];
+    } u;
+    memset(&u, 0, sizeof(u));
+    u.info.mark = 1;
+    for (mark_bit_word = 0; u.words[mark_bit_word] == 0; mark_bit_word++);
+    mark_bit_mask = u.words[mark_bit_word];
+
+    R_mark_worker_t *workers = calloc(MAX_MARK_THREADS, sizeof(R_mark_worker_t));
+    if (workers == NULL) {
+	failed = TRUE;
+	return FALSE;
+    }
+    for (i = 0; i < MAX_MARK_THREADS; i++) {
+	workers[i].stack = malloc(MARK_STACK_INIT_SIZE * sizeof(SEXP));
+	if (workers[i].stack == NULL) {
+	    while (--i >= 0) {
+		free(workers[i].stack);
+		omp_destroy_lock(&workers[i].lock);
+	    }
+	    free(workers);
+	    failed = TRUE;
+	    return FALSE;
+	}
+	workers[i].size = MARK_STACK_INIT_SIZE;
+	omp_init_lock(&workers[i].lock);
+    }
+    omp_init_lock(&mark_overflow_lock);
+    mark_workers = workers;
+    return TRUE;
+}
+
+/* returns TRUE if this call set the mark */
+static R_INLINE Rboolean PAR_MARK_NODE(SEXP s)
+{
+    unsigned int *word = ((unsigned int *) &(s->sxpinfo)) + mark_bit_word;
+    return (__atomic_fetch_or(word, mark_bit_mask, __ATOMIC_RELAXED) &
+	    mark_bit_mask) == 0;
+}
+
+static void mark_stack_push(R_mark_worker_t *w, SEXP s)
+{
+    if (w->top == w->size) {
+	if (w->bottom > 0) {
+	    memmove(w->stack, w->stack + w->bottom,
+		    (w->top - w->bottom) * sizeof(SEXP));
+	    w->top -= w->bottom;
+	    w->bottom = 0;
+	}
+	else {
+	    SEXP *stack = realloc(w->stack, 2 * w->size * sizeof(SEXP));
+	    if (stack == NULL) {
+		omp_set_lock(&mark_overflow_lock);
+		UNSNAP_NODE(s);
+		SET_NEXT_NODE(s, mark_overflow_nodes);
+		mark_overflow_nodes = s;
+		omp_unset_lock(&mark_overflow_lock);
+		return;
+	    }
+	    w->stack = stack;
+	    w->size *= 2;
+	}
+    }
+    w->stack[w->top++] = s;
+}
+
+#define PAR_FORWARD_NODE(s, w) do { \
+  SEXP pf__n__ = (s); \
+  if (pf__n__ && ! NODE_IS_MARKED(pf__n__) && PAR_MARK_NODE(pf__n__)) \
+    mark_stack_push(w, pf__n__); \
+} while (0)
+
+#define PAR_FORWARD_CHILDREN(__n__, w) DO_CHILDREN(__n__, PAR_FORWARD_NODE, w)
+
+static void ShareMarkWork(R_mark_worker_t *w)
+{
+    omp_set_lock(&w->lock);
+    if (w->nshared == 0) {
+	memcpy(w->shared, w->stack + w->bottom,
+	       MARK_SHARE_CHUNK * sizeof(SEXP));
+	w->bottom += MARK_SHARE_CHUNK;
+	__atomic_store_n(&w->nshared, MARK_SHARE_CHUNK, __ATOMIC_RELEASE);
+    }
+    omp_unset_lock(&w->lock);
+}
+
+/* Move a shared chunk, preferably our own, onto our empty stack. */
+static Rboolean StealMarkWork(int id, int nthreads)
+{
+    R_mark_worker_t *w = mark_workers + id;
+    for (int k = 0; k < nthreads; k++) {
+	R_mark_worker_t *v = mark_workers + (id + k) % nthreads;
+	if (__atomic_load_n(&v->nshared, __ATOMIC_ACQUIRE) > 0) {
+	    int n;
+	    omp_set_lock(&v->lock);
+	    n = v->nshared;
+	    if (n > 0) {
+		memcpy(w->stack, v->shared, n * sizeof(SEXP));
+		__atomic_store_n(&v->nshared, 0, __ATOMIC_RELEASE);
+	    }
+	    omp_unset_lock(&v->lock);
+	    if (n > 0) {
+		w->bottom = 0;
+		w->top = n;
+		return TRUE;
+	    }
+	}
+    }
+    return FALSE;
+}
+
+static Rboolean MarkWorkAvailable(int nthreads)
+{
+    for (int k = 0; k < nthreads; k++)
+	if (__atomic_load_n(&mark_workers[k].nshared, __ATOMIC_ACQUIRE) > 0)
+	    return TRUE;
+    return FALSE;
+}
+
+static void ParallelMarkWorker(int id, int nthreads)
+{
+    R_mark_worker_t *w = mark_workers + id;
+    SEXP s;
+
+    for (;;) {
+	while (w->top > w->bottom) {
+	    s = w->stack[--w->top];
+	    PAR_FORWARD_CHILDREN(s, w);
+	    if (w->top - w->bottom > 2 * MARK_SHARE_CHUNK &&
+		__atomic_load_n(&w->nshared, __ATOMIC_RELAXED) == 0)
+		ShareMarkWork(w);
+	}
+	w->top = w->bottom = 0;
+	if (StealMarkWork(id, nthreads))
+	    continue;
+
+	/* idle until more work is shared or all workers are idle */
+	__atomic_add_fetch(&mark_idle_count, 1, __ATOMIC_SEQ_CST);
+	for (;;) {
+	    if (__atomic_load_n(&mark_idle_count, __ATOMIC_SEQ_CST) == nthreads)
+		return;
+	    if (MarkWorkAvailable(nthreads)) {
+		__atomic_sub_fetch(&mark_idle_count, 1, __ATOMIC_SEQ_CST);
+		if (StealMarkWork(id, nthreads))
+		    break;
+		__atomic_add_fetch(&mark_idle_count, 1, __ATOMIC_SEQ_CST);
+	    }
+#ifdef HAVE_SCHED_H
+	    sched_yield();
+#endif
+	}
+    }
+}
+
+/* Parallel version of PROCESS_NODES.  The nodes on the forwarding
+   list are snapped into their generations as usual and their children
+   are pushed on the stack of the first worker to seed the team. */
+static void ParallelProcessNodes(SEXP forwarded_nodes)
+{
+    SEXP s;
+    while (forwarded_nodes != NULL) {
+	while (forwarded_nodes != NULL) {
+	    s = forwarded_nodes;
+	    forwarded_nodes = NEXT_NODE(forwarded_nodes);
+	    SNAP_NODE(s, R_GenHeap[NODE_CLASS(s)].Old[NODE_GENERATION(s)]);
+	    R_GenHeap[NODE_CLASS(s)].OldCount[NODE_GENERATION(s)]++;
+	    PAR_FORWARD_CHILDREN(s, mark_workers);
+	}
+	mark_idle_count = 0;
+#pragma omp parallel num_threads(R_GCMarkThreads)
+	ParallelMarkWorker(omp_get_thread_num(), omp_get_num_threads());
+	forwarded_nodes = mark_overflow_nodes;
+	mark_overflow_nodes = NULL;
+    }
+}
+
+/* Move the nodes marked by the workers out of New space.  In a full
+   collection all reachable nodes are marked and all OldToNew lists
+   are empty, so the lists of the small node classes can be rebuilt
+   from the pages; this also leaves the free lists sorted, as
+   SortNodes would. */
+static void RelinkMarkedNodes(void)
+{
+    SEXP s;
+    int i, gen;
+
+    for (i = 0; i < NUM_SMALL_NODE_CLASSES; i++) {
+	PAGE_HEADER *page;
+	int node_size = NODE_SIZE(i);
+	int page_count = (R_PAGE_SIZE - sizeof(PAGE_HEADER)) / node_size;
+
+	for (gen = 0; gen < NUM_OLD_GENERATIONS; gen++) {
+	    SET_NEXT_NODE(R_GenHeap[i].Old[gen], R_GenHeap[i].Old[gen]);
+	    SET_PREV_NODE(R_GenHeap[i].Old[gen], R_GenHeap[i].Old[gen]);
+	    R_GenHeap[i].OldCount[gen] = 0;
+	}
+	SET_NEXT_NODE(R_GenHeap[i].New, R_GenHeap[i].New);
+	SET_PREV_NODE(R_GenHeap[i].New, R_GenHeap[i].New);
+	for (page = R_GenHeap[i].pages; page != NULL; page = page->next) {
+	    int j;
+	    char *data = PAGE_DATA(page);
+
+	    for (j = 0; j < page_count; j++, data += node_size) {
+		s = (SEXP) data;
+		if (NODE_IS_MARKED(s)) {
+		    gen = NODE_GENERATION(s);
+		    SNAP_NODE(s, R_GenHeap[i].Old[gen]);
+		    R_GenHeap[i].OldCount[gen]++;
+		}
+		else
+		    SNAP_NODE(s, R_GenHeap[i].New);
+	    }
+	}
+	R_GenHeap[i].Free = NEXT_NODE(R_GenHeap[i].New);
+    }
+
+    for (i = CUSTOM_NODE_CLASS; i <= LARGE_NODE_CLASS; i++) {
+	s = NEXT_NODE(R_GenHeap[i].New);
+	while (s != R_GenHeap[i].New) {
+	    SEXP next = NEXT_NODE(s);
+	    if (NODE_IS_MARKED(s)) {
+		gen = NODE_GENERATION(s);
+		UNSNAP_NODE(s);
+		SNAP_NODE(s, R_GenHeap[i].Old[gen]);
+		R_GenHeap[i].OldCount[gen]++;
+	    }
+	    s = next;
+	}
+    }
+}
+
+# define MARK_PROCESS_NODES() do { \
+    if (par_mark) { \
+	ParallelProcessNodes(forwarded_nodes); \
+	forwarded_nodes = NULL; \
+    } \
+    else if (inc_remark) INC_PROCESS_NODES(); \
+    else PROCESS_NODES(); \
+} while (0)
+#else
+# define MARK_PROCESS_NODES() do { \
+    if (inc_remark) INC_PROCESS_NODES(); \
+    else PROCESS_NODES(); \
+} while (0)
+#endif /* PARALLEL_MARK */
+
+/* Incremental Collection.  When a pause target is set, a full
+   collection that is not explicitly requested starts an incremental
+   cycle instead: the old generations are unmarked and the roots
+   forwarded as usual, but the marking of the heap is then done in
+   slices of bounded duration, one each time the collector is
+   triggered, with the mutator running in between.  No memory is
+   reclaimed until the cycle is finished, so each slice raises the
+   heap limits enough for the mutator to continue.
+
+   Nodes that have been marked but not yet scanned are kept on the
+   Grey lists.  The write barrier puts marked nodes that are given a
+   reference to an unmarked node on an old-to-new list, so each slice
+   first scans those nodes again.  The cycle is finished, with a pause
+   that is proportional to the roots and the nodes allocated during
+   the cycle rather than to the heap, by an ordinary full collection
+   that skips unmarking, takes over the grey nodes, and re-forwards
+   the roots.  All nodes marked during a cycle are placed in the
+   oldest generation, so that the old-to-new invariant holds for the
+   references created while it ran; the free lists are swept lazily
+   afterwards.  Incremental cycles are not used with PROTECTCHECK. */
+
+static Rboolean gc_inc_active = FALSE;
+static Rboolean gc_inc_finish = FALSE; /* set for explicit requests */
+static R_size_t gc_inc_nsize, gc_inc_vsize; /* heap limits at the start */
+
+#define GREY_NODE(s) do { \
+  SEXP gn__n__ = (s); \
+  SET_NODE_GENERATION(gn__n__, NUM_OLD_GENERATIONS - 1); \
+  SNAP_NODE(gn__n__, R_GenHeap[NODE_CLASS(gn__n__)].Grey); \
+  R_GenHeap[NODE_CLASS(gn__n__)].OldCount[NUM_OLD_GENERATIONS - 1]++; \
+} while (0)
+
+#define INC_FORWARD_NODE(s) do { \
+  SEXP if__n__ = (s); \
+  if (if__n__ && ! NODE_IS_MARKED(if__n__)) { \
+    MARK_NODE(if__n__); \
+    UNSNAP_NODE(if__n__); \
+    GREY_NODE(if__n__); \
+  } \
+} while (0)
+
+#define INC_FC_FORWARD_NODE(__n__,__dummy__) INC_FORWARD_NODE(__n__)
+
+/* as PROCESS_NODES, but placing the nodes in the oldest generation */
+#define INC_PROCESS_NODES() do { \
+    while (forwarded_nodes != NULL) { \
+	s = forwarded_nodes; \
+	forwarded_nodes = NEXT_NODE(forwarded_nodes); \
+	SET_NODE_GENERATION(s, NUM_OLD_GENERATIONS - 1); \
+	SNAP_NODE(s, R_GenHeap[NODE_CLASS(s)].Old[NUM_OLD_GENERATIONS - 1]); \
+	R_GenHeap[NODE_CLASS(s)].OldCount[NUM_OLD_GENERATIONS - 1]++; \
+	FORWARD_CHILDREN(s); \
+    } \
+} while (0)
+
+#ifdef INCREMENTAL_GC
+/* move the nodes on a forwarding list to the grey lists */
+static void GreyForwardedNodes(SEXP forwarded_nodes)
+{
+    while (forwarded_nodes != NULL) {
+	SEXP s = forwarded_nodes;
+	forwarded_nodes = NEXT_NODE(forwarded_nodes);
+	GREY_NODE(s);
+    }
+}
+
+/* move all grey nodes to a forwarding list, which is returned */
+static SEXP TakeGreyNodes(void)
+{
+    SEXP forwarded_nodes = NULL;
+    for (int i = 0; i < NUM_NODE_CLASSES; i++) {
+	SEXP peg = R_GenHeap[i].Grey, s;
+	while ((s = NEXT_NODE(peg)) != peg) {
+	    UNSNAP_NODE(s);
+	    R_GenHeap[i].OldCount[NODE_GENERATION(s)]--;
+	    SET_NEXT_NODE(s, forwarded_nodes);
+	    forwarded_nodes = s;
+	}
+    }
+    return forwarded_nodes;
+}
+
+/* Raise the heap limits so the mutator can continue until the next
+   slice.  Returns FALSE if this would exceed the maximal sizes, or if
+   the mutator is allocating so much faster than the marking proceeds
+   that the heap has doubled since the start of the cycle. */
+static Rboolean IncrementalGrowHeap(R_size_t size_needed)
+{
+    R_size_t nincr = (R_size_t) (0.05 * R_NSize);
+    R_size_t vincr = (R_size_t) (0.05 * R_VSize);
+    if (nincr < (R_size_t) R_NGrowIncrMin) nincr = R_NGrowIncrMin;
+    if (vincr < (R_size_t) R_VGrowIncrMin) vincr = R_VGrowIncrMin;
+
+    R_size_t nsize = R_NodesInUse + nincr;
+    R_size_t vsize = R_SmallVallocSize + R_LargeVallocSize +
+	size_needed + vincr;
+    if (nsize > 2 * gc_inc_nsize || vsize > 2 * gc_inc_vsize)
+	return FALSE;
+    if (nsize > R_MaxNSize) nsize = R_MaxNSize;
+    if (vsize > R_MaxVSize) vsize = R_MaxVSize;
+    if (nsize > R_NSize) R_NSize = nsize;
+    if (vsize > R_VSize) R_VSize = vsize;
+    return ! NO_FREE_NODES() && VHEAP_FREE() >= size_needed;
+}
+
+/* Scan the old-to-new lists and then grey nodes until the pause
+   target is reached.  Returns TRUE if the cycle can continue, and
+   FALSE if marking is complete or no more memory can be provided, in
+   which case the cycle must be finished now. */
+static Rboolean IncrementalSlice(R_size_t size_needed)
+{
+    double start = currentTime(), deadline = start + R_GCMaxPause;
+    Rboolean more = TRUE, cont = FALSE;
+    int n = 0;
+
+    for (int gen = 0; gen < NUM_OLD_GENERATIONS; gen++)
+	for (int i = 0; i < NUM_NODE_CLASSES; i++) {
+	    SEXP peg = R_GenHeap[i].OldToNew[gen], s;
+	    while ((s = NEXT_NODE(peg)) != peg) {
+		UNSNAP_NODE(s);
+		SNAP_NODE(s, R_GenHeap[i].Old[gen]);
+		DO_CHILDREN(s, INC_FC_FORWARD_NODE, 0);
+	    }
+	}
+
+    while (more) {
+	more = FALSE;
+	for (int i = 0; i < NUM_NODE_CLASSES; i++) {
+	    SEXP peg = R_GenHeap[i].Grey, s;
+	    while ((s = NEXT_NODE(peg)) != peg) {
+		more = TRUE;
+		UNSNAP_NODE(s);
+		SNAP_NODE(s, R_GenHeap[i].Old[NODE_GENERATION(s)]);
+		DO_CHILDREN(s, INC_FC_FORWARD_NODE, 0);
+		if (++n % 256 == 0 && currentTime() >= deadline) {
+		    cont = IncrementalGrowHeap(size_needed);
+		    goto done;
+		}
+	    }
+	}
+    }
+
+ done:
+    gc_last_mark_time = currentTime() - start;
+    gen_gc_mark_times[NUM_OLD_GENERATIONS] += gc_last_mark_time;
+    gc_trace_mark += gc_last_mark_time;
+    return cont;
+}
+#endif
+
+/* The roots of the collector.  The action is applied to each root;
+   this is also used for heap snapshots. */
+
+#define DO_ROOTS(dr__action__) do {                                            \
+    dr__action__(R_NilValue);              /* Builtin constants */             \
+    dr__action__(NA_STRING);                                                   \
+    dr__action__(R_BlankString);                                               \
+    dr__action__(R_BlankScalarString);                                         \
+    dr__action__(R_CurrentExpression);                                         \
+    dr__action__(R_UnboundValue);                                              \
+    dr__action__(R_RestartToken);                                              \
+    dr__action__(R_MissingArg);                                                \
+    dr__action__(R_InBCInterpreter);                                           \
+                                                                               \
+    dr__action__(R_GlobalEnv);             /* Global environment */            \
+    dr__action__(R_BaseEnv);                                                   \
+    dr__action__(R_EmptyEnv);                                                  \
+    dr__action__(R_Warnings);              /* Warnings, if any */              \
+    dr__action__(R_ReturnedValue);                                             \
+                                                                               \
+    dr__action__(R_HandlerStack);          /* Condition handler stack */       \
+    dr__action__(R_RestartStack);          /* Available restarts stack */      \
+                                                                               \
+    dr__action__(R_BCbody);                /* Current byte code object */      \
+    dr__action__(R_Srcref);                /* Current source reference */      \
+                                                                               \
+    dr__action__(R_TrueValue);                                                 \
+    dr__action__(R_FalseValue);                                                \
+    dr__action__(R_LogicalNAValue);                                            \
+                                                                               \
+    dr__action__(R_print.na_string);                                           \
+    dr__action__(R_print.na_string_noquote);                                   \
+                                                                               \
+    if (R_SymbolTable != NULL)             /* in case of GC during startup */  \
+        for (int i = 0; i < HSIZE; i++) {      /* Symbol table */              \
+            dr__action__(R_SymbolTable[i]);                                    \
+            SEXP s;                                                            \
+            for (s = R_SymbolTable[i]; s != R_NilValue; s = CDR(s))            \
+                if (ATTRIB(CAR(s)) != R_NilValue)                              \
+                    gc_error("****found a symbol with attributes\n");          \
+        }                                                                      \
+                                                                               \
+    if (R_CurrentExpr != NULL)             /* Current expression */            \
+        dr__action__(R_CurrentExpr);                                           \
+                                                                               \
+    for (int i = 0; i < R_MaxDevices; i++) {   /* Device display lists */      \
+        pGEDevDesc gdd = GEgetDevice(i);                                       \
+        if (gdd) {                                                             \
+            dr__action__(gdd->displayList);                                    \
+            dr__action__(gdd->savedSnapshot);                                  \
+            if (gdd->dev)                                                      \
+                dr__action__(gdd->dev->eventEnv);                              \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    for (RCNTXT *ctxt = R_GlobalContext; ctxt; ctxt = ctxt->nextcontext) {     \
+        dr__action__(ctxt->conexit);       /* on.exit expressions */           \
+        dr__action__(ctxt->promargs);      /* promises supplied to closure */  \
+        dr__action__(ctxt->callfun);       /* the closure called */            \
+        dr__action__(ctxt->sysparent);     /* calling environment */           \
+        dr__action__(ctxt->call);          /* the call */                      \
+        dr__action__(ctxt->cloenv);        /* the closure environment */       \
+        dr__action__(ctxt->bcbody);        /* the current byte code object */  \
+        dr__action__(ctxt->handlerstack);  /* the condition handler stack */   \
+        dr__action__(ctxt->restartstack);  /* the available restarts stack */  \
+        dr__action__(ctxt->srcref);        /* the current source reference */  \
+        dr__action__(ctxt->returnValue);   /* For on.exit calls */             \
+    }                                                                          \
+                                                                               \
+    dr__action__(R_PreciousList);                                              \
+                                                                               \
+    for (int i = 0; i < R_PPStackTop; i++)         /* Protected pointers */    \
+        dr__action__(R_PPStack[i]);                                            \
+                                                                               \
+    dr__action__(R_VStack);                /* R_alloc stack */                 \
+                                                                               \
+    for (R_bcstack_t *sp = R_BCNodeStackBase; sp < R_BCNodeStackTop; sp++) {   \
+        if (sp->tag == RAWMEM_TAG)                                             \
+            sp += sp->u.ival;                                                  \
+        else if (sp->tag == 0 || IS_PARTIAL_SXP_TAG(sp->tag))                  \
+            dr__action__(sp->u.sxpval);                                        \
+    }                                                                          \
+} while (0)
+
+static Rboolean CharsxpUnmarked(SEXP s)
+{
+    return ! NODE_IS_MARKED(s);
+}
+
 static int RunGenCollect(R_size_t size_needed)
 {
     int i, gen, gens_collected;
-    RCNTXT *ctxt;
     SEXP s;
     SEXP forwarded_nodes;
+    double mark_start;
+    Rboolean timed;
+    Rboolean par_mark = FALSE, inc_start = FALSE, inc_remark = FALSE;
 
     bad_sexp_type_seen = 0;
 
+    /* pages left unswept since the last full collection must be swept
+       before any marks are cleared */
+    FinishSweep();
+
     /* determine number of generations to collect */
     while (num_old_gens_to_collect < NUM_OLD_GENERATIONS) {
 	if (collect_counts[num_old_gens_to_collect]-- <= 0) {
@@ -1650,7 +2548,25 @@ static int RunGenCollect(R_size_t size_needed)
 #endif
 
  again:
+#ifdef INCREMENTAL_GC
+    if (gc_inc_active) {
+	if (! gc_inc_finish && IncrementalSlice(size_needed))
+	    return -1;
+	num_old_gens_to_collect = NUM_OLD_GENERATIONS;
+	inc_remark = TRUE;
+    }
+    else if (R_GCMaxPause > 0 && ! gc_inc_finish &&
+	     num_old_gens_to_collect == NUM_OLD_GENERATIONS)
+	inc_start = TRUE;
+#endif
     gens_collected = num_old_gens_to_collect;
+    /* the marking is only timed for the verbose report and gctrace() */
+    timed = gc_reporting || gc_trace != NULL;
+    mark_start = timed ? currentTime() : 0;
+#ifdef PARALLEL_MARK
+    par_mark = R_GCMarkThreads > 1 && ! inc_start && ! inc_remark &&
+	gens_collected == NUM_OLD_GENERATIONS && InitParallelMark();
+#endif
 
 #ifndef EXPEL_OLD_TO_NEW
     /* eliminate old-to-new references in generations to collect by
@@ -1674,8 +2590,8 @@ static int RunGenCollect(R_size_t size_needed)
     DEBUG_CHECK_NODE_COUNTS("at start");
 
     /* unmark all marked nodes in old generations to be collected and
-       move to New space */
-    for (gen = 0; gen < num_old_gens_to_collect; gen++) {
+       move to New space, unless finishing an incremental cycle */
+    for (gen = 0; gen < num_old_gens_to_collect && ! inc_remark; gen++) {
 	for (i = 0; i < NUM_NODE_CLASSES; i++) {
 	    R_GenHeap[i].OldCount[gen] = 0;
 	    s = NEXT_NODE(R_GenHeap[i].Old[gen]);
@@ -1692,6 +2608,10 @@ static int RunGenCollect(R_size_t size_needed)
     }
 
     forwarded_nodes = NULL;
+#ifdef INCREMENTAL_GC
+    if (inc_remark)
+	forwarded_nodes = TakeGreyNodes();
+#endif
 
 #ifndef EXPEL_OLD_TO_NEW
     /* scan nodes in uncollected old generations with old-to-new pointers */
@@ -1704,87 +2624,23 @@ static int RunGenCollect(R_size_t size_needed)
 #endif
 
     /* forward all roots */
-    FORWARD_NODE(R_NilValue);	           /* Builtin constants */
-    FORWARD_NODE(NA_STRING);
-    FORWARD_NODE(R_BlankString);
-    FORWARD_NODE(R_BlankScalarString);
-    FORWARD_NODE(R_CurrentExpression);
-    FORWARD_NODE(R_UnboundValue);
-    FORWARD_NODE(R_RestartToken);
-    FORWARD_NODE(R_MissingArg);
-    FORWARD_NODE(R_InBCInterpreter);
-
-    FORWARD_NODE(R_GlobalEnv);	           /* Global environment */
-    FORWARD_NODE(R_BaseEnv);
-    FORWARD_NODE(R_EmptyEnv);
-    FORWARD_NODE(R_Warnings);	           /* Warnings, if any */
-    FORWARD_NODE(R_ReturnedValue);
-
-    FORWARD_NODE(R_HandlerStack);          /* Condition handler stack */
-    FORWARD_NODE(R_RestartStack);          /* Available restarts stack */
-
-    FORWARD_NODE(R_BCbody);                /* Current byte code object */
-    FORWARD_NODE(R_Srcref);                /* Current source reference */
-
-    FORWARD_NODE(R_TrueValue);
-    FORWARD_NODE(R_FalseValue);
-    FORWARD_NODE(R_LogicalNAValue);
-
-    FORWARD_NODE(R_print.na_string);
-    FORWARD_NODE(R_print.na_string_noquote);
-
-    if (R_SymbolTable != NULL)             /* in case of GC during startup */
-	for (i = 0; i < HSIZE; i++) {      /* Symbol table */
-	    FORWARD_NODE(R_SymbolTable[i]);
-	    SEXP s;
-	    for (s = R_SymbolTable[i]; s != R_NilValue; s = CDR(s))
-		if (ATTRIB(CAR(s)) != R_NilValue)
-		    gc_error("****found a symbol with attributes\n");
-	}
-
-    if (R_CurrentExpr != NULL)	           /* Current expression */
-	FORWARD_NODE(R_CurrentExpr);
-
-    for (i = 0; i < R_MaxDevices; i++) {   /* Device display lists */
-	pGEDevDesc gdd = GEgetDevice(i);
-	if (gdd) {
-	    FORWARD_NODE(gdd->displayList);
-	    FORWARD_NODE(gdd->savedSnapshot);
-	    if (gdd->dev)
-		FORWARD_NODE(gdd->dev->eventEnv);
-	}
-    }
-
-    for (ctxt = R_GlobalContext ; ctxt != NULL ; ctxt = ctxt->nextcontext) {
-	FORWARD_NODE(ctxt->conexit);       /* on.exit expressions */
-	FORWARD_NODE(ctxt->promargs);	   /* promises supplied to closure */
-	FORWARD_NODE(ctxt->callfun);       /* the closure called */
-	FORWARD_NODE(ctxt->sysparent);     /* calling environment */
-	FORWARD_NODE(ctxt->call);          /* the call */
-	FORWARD_NODE(ctxt->cloenv);        /* the closure environment */
-	FORWARD_NODE(ctxt->bcbody);        /* the current byte code object */
-	FORWARD_NODE(ctxt->handlerstack);  /* the condition handler stack */
-	FORWARD_NODE(ctxt->restartstack);  /* the available restarts stack */
-	FORWARD_NODE(ctxt->srcref);	   /* the current source reference */
-	FORWARD_NODE(ctxt->returnValue);   /* For on.exit calls */
-    }
-
-    FORWARD_NODE(R_PreciousList);
-
-    for (i = 0; i < R_PPStackTop; i++)	   /* Protected pointers */
-	FORWARD_NODE(R_PPStack[i]);
-
-    FORWARD_NODE(R_VStack);		   /* R_alloc stack */
-
-    for (R_bcstack_t *sp = R_BCNodeStackBase; sp < R_BCNodeStackTop; sp++) {
-	if (sp->tag == RAWMEM_TAG)
-	    sp += sp->u.ival;
-	else if (sp->tag == 0 || IS_PARTIAL_SXP_TAG(sp->tag))
-	    FORWARD_NODE(sp->u.sxpval);
+    DO_ROOTS(FORWARD_NODE);
+
+#ifdef INCREMENTAL_GC
+    if (inc_start) {
+	GreyForwardedNodes(forwarded_nodes);
+	gc_inc_active = TRUE;
+	gc_inc_nsize = R_NSize;
+	gc_inc_vsize = R_VSize;
+	if (IncrementalSlice(size_needed))
+	    return -1;
+	forwarded_nodes = TakeGreyNodes();
+	inc_remark = TRUE;
     }
+#endif
 
     /* main processing loop */
-    PROCESS_NODES();
+    MARK_PROCESS_NODES();
 
     /* identify weakly reachable nodes */
     {
@@ -1803,7 +2659,7 @@ static int RunGenCollect(R_size_t size_needed)
 		    }
 		}
 	    }
-	    PROCESS_NODES();
+	    MARK_PROCESS_NODES();
 	} while (recheck_weak_refs);
     }
 
@@ -1817,38 +2673,24 @@ static int RunGenCollect(R_size_t size_needed)
 	FORWARD_NODE(WEAKREF_VALUE(s));
 	FORWARD_NODE(WEAKREF_FINALIZER(s));
     }
-    PROCESS_NODES();
+    MARK_PROCESS_NODES();
 
     DEBUG_CHECK_NODE_COUNTS("after processing forwarded list");
 
-    /* process CHARSXP cache */
-    if (R_StringHash != NULL) /* in case of GC during initialization */
-    {
-	SEXP t;
-	int nc = 0;
-	for (i = 0; i < LENGTH(R_StringHash); i++) {
-	    s = VECTOR_ELT(R_StringHash, i);
-	    t = R_NilValue;
-	    while (s != R_NilValue) {
-		if (! NODE_IS_MARKED(CXHEAD(s))) { /* remove unused CHARSXP and cons cell */
-		    if (t == R_NilValue) /* head of list */
-			VECTOR_ELT(R_StringHash, i) = CXTAIL(s);
-		    else
-			CXTAIL(t) = CXTAIL(s);
-		    s = CXTAIL(s);
-		    continue;
-		}
-		FORWARD_NODE(s);
-		FORWARD_NODE(CXHEAD(s));
-		t = s;
-		s = CXTAIL(s);
-	    }
-	    if(VECTOR_ELT(R_StringHash, i) != R_NilValue) nc++;
-	}
-	SET_TRUELENGTH(R_StringHash, nc); /* SET_HASHPRI, really */
+    /* process CHARSXP cache: unused CHARSXPs are removed */
+    R_StringHashPurge(CharsxpUnmarked);
+
+#ifdef PARALLEL_MARK
+    if (par_mark)
+	RelinkMarkedNodes();
+#endif
+    if (timed) {
+	gc_last_mark_time = currentTime() - mark_start;
+	gen_gc_mark_times[gens_collected] += gc_last_mark_time;
+	gc_trace_mark += gc_last_mark_time;
     }
-    FORWARD_NODE(R_StringHash);
-    PROCESS_NODES();
+    if (inc_remark)
+	gc_inc_active = FALSE;
 
 #ifdef PROTECTCHECK
     for(i=0; i< NUM_SMALL_NODE_CLASSES;i++){
@@ -1949,8 +2791,13 @@ static int RunGenCollect(R_size_t size_needed)
 	DEBUG_CHECK_NODE_COUNTS("after heap adjustment");
     }
 #ifdef SORT_NODES
-    if (gens_collected == NUM_OLD_GENERATIONS)
-	SortNodes();
+    /* after parallel marking RelinkMarkedNodes has sorted the nodes */
+    if (gens_collected == NUM_OLD_GENERATIONS && ! par_mark) {
+	if (R_GCLazySweep || inc_remark)
+	    DeferSweep();
+	else
+	    SortNodes();
+    }
 #endif
 
     return gens_collected;
@@ -2048,6 +2895,401 @@ SEXP attribute_hidden do_gcinfo(SEXP call, SEXP op, SEXP args, SEXP rho)
     return old;
 }
 
+SEXP attribute_hidden do_gctrace(SEXP call, SEXP op, SEXP args, SEXP rho)
+{
+    checkArity(op, args);
+    SEXP old = ScalarLogical(gc_trace != NULL);
+    int on = asLogical(CAR(args));
+    int size = asInteger(CADR(args));
+    if (on == NA_LOGICAL)
+	error(_("invalid '%s' argument"), "on");
+    if (on) {
+	if (size == NA_INTEGER || size <= 0)
+	    error(_("invalid '%s' argument"), "size");
+	if (size != gc_trace_size && ! set_gc_trace_size(size))
+	    error(_("cannot allocate buffer for %d events"), size);
+    }
+    else set_gc_trace_size(0);
+    return old;
+}
+
+/* Returns the recorded events, oldest first, as a list of columns.
+   The events are copied first as allocating the result may add more. */
+SEXP attribute_hidden do_gcevents(SEXP call, SEXP op, SEXP args, SEXP rho)
+{
+    checkArity(op, args);
+    int clear = asLogical(CAR(args));
+    const void *vmax = vmaxget();
+    gc_event_t *ev = gc_trace_size > 0 ?
+	(gc_event_t *) R_alloc(gc_trace_size, sizeof(gc_event_t)) : NULL;
+    R_size_t first = gc_trace_first, last = gc_trace_count;
+    R_xlen_t n = (R_xlen_t) (last - first);
+    for (R_xlen_t i = 0; i < n; i++)
+	ev[i] = gc_trace[(first + i) % gc_trace_size];
+    if (clear == TRUE)
+	gc_trace_first = last;
+
+    const char *names[] = { "start", "level", "trigger", "elapsed", "mark",
+			    "sweep", "promoted", "pages.released",
+			    "large.freed", "ncells", "vcells", "slice", "" };
+    SEXP val = PROTECT(mkNamed(VECSXP, names));
+    SET_VECTOR_ELT(val, 1, allocVector(INTSXP, n));
+    SET_VECTOR_ELT(val, 2, allocVector(STRSXP, n));
+    for (int j = 0; j < 11; j++)
+	if (j != 1 && j != 2)
+	    SET_VECTOR_ELT(val, j, allocVector(REALSXP, n));
+    SET_VECTOR_ELT(val, 11, allocVector(LGLSXP, n));
+    for (R_xlen_t i = 0; i < n; i++) {
+	gc_event_t *e = ev + i;
+	REAL(VECTOR_ELT(val, 0))[i] = e->start;
+	INTEGER(VECTOR_ELT(val, 1))[i] = e->level;
+	SET_STRING_ELT(VECTOR_ELT(val, 2), i,
+		       mkChar(gc_trigger_names[e->trigger]));
+	REAL(VECTOR_ELT(val, 3))[i] = e->elapsed;
+	REAL(VECTOR_ELT(val, 4))[i] = e->mark;
+	REAL(VECTOR_ELT(val, 5))[i] = e->elapsed - e->mark;
+	REAL(VECTOR_ELT(val, 6))[i] = e->promoted;
+	REAL(VECTOR_ELT(val, 7))[i] = e->pages_released;
+	REAL(VECTOR_ELT(val, 8))[i] = e->large_freed;
+	REAL(VECTOR_ELT(val, 9))[i] = e->ncells;
+	REAL(VECTOR_ELT(val, 10))[i] = e->vcells;
+	LOGICAL(VECTOR_ELT(val, 11))[i] = e->slice;
+    }
+    vmaxset(vmax);
+    UNPROTECT(1); /* val */
+    return val;
+}
+
+/* Heap snapshots.  All nodes reachable from the roots used by the
+   collector are numbered in breadth-first order and written to a
+   binary file in columns: type, flags, size in bytes, length, number
+   of references and the references themselves, in the order
+   DO_CHILDREN visits them (so the attributes come first when flag 1
+   is set, and null pointers are written as NA).  Weak references
+   hold on to their values and finalizers, and are included, as
+   roots, when their keys are reachable.  The roots and the names of
+   symbols and of package, namespace and other named environments
+   follow.  The file is read by utils:::readHeapSnapshot, which
+   recovers the referrers by inverting the references. */
+
+#define HEAP_SNAPSHOT_MAGIC "RHEAPSNAPSHOT"
+#define HEAP_SNAPSHOT_VERSION 1
+
+typedef struct {
+    SEXP *nodes;	/* the nodes in order of discovery */
+    int *nrefs;		/* the number of references of each node */
+    int count, size;
+    int cur;		/* the node whose references are being added */
+    SEXP *keys;		/* open addressing table of nodes ... */
+    int *ids;		/* ... and their numbers */
+    int tabsize;	/* a power of 2 */
+    double nedges;
+    Rboolean failed;
+} heap_snapshot_t;
+
+static R_INLINE int snapshot_hash(heap_snapshot_t *hs, SEXP s)
+{
+    R_size_t h = ((R_size_t) s) >> 3;
+    h *= (R_size_t) 0x9E3779B97F4A7C15ULL;
+    return (int) ((h >> 16) & (hs->tabsize - 1));
+}
+
+static int snapshot_lookup(heap_snapshot_t *hs, SEXP s)
+{
+    for (int h = snapshot_hash(hs, s); hs->keys[h] != NULL;
+	 h = (h + 1) & (hs->tabsize - 1))
+	if (hs->keys[h] == s)
+	    return hs->ids[h];
+    return NA_INTEGER;
+}
+
+static Rboolean snapshot_grow(heap_snapshot_t *hs)
+{
+    int oldsize = hs->tabsize, newsize;
+    if (oldsize > INT_MAX / 2)
+	return FALSE;
+    newsize = 2 * oldsize;
+    SEXP *oldkeys = hs->keys;
+    int *oldids = hs->ids;
+    SEXP *keys = calloc(newsize, sizeof(SEXP));
+    int *ids = malloc(newsize * sizeof(int));
+    if (keys == NULL || ids == NULL) {
+	free(keys);
+	free(ids);
+	return FALSE;
+    }
+    hs->keys = keys;
+    hs->ids = ids;
+    hs->tabsize = newsize;
+    for (int i = 0; i < oldsize; i++)
+	if (oldkeys[i] != NULL) {
+	    int h = snapshot_hash(hs, oldkeys[i]);
+	    while (keys[h] != NULL)
+		h = (h + 1) & (newsize - 1);
+	    keys[h] = oldkeys[i];
+	    ids[h] = oldids[i];
+	}
+    free(oldkeys);
+    free(oldids);
+
+    SEXP *nodes = realloc(hs->nodes, (newsize / 2) * sizeof(SEXP));
+    if (nodes == NULL)
+	return FALSE;
+    hs->nodes = nodes;
+    int *nrefs = realloc(hs->nrefs, (newsize / 2) * sizeof(int));
+    if (nrefs == NULL)
+	return FALSE;
+    hs->nrefs = nrefs;
+    hs->size = newsize / 2;
+    return TRUE;
+}
+
+/* number a node if it has not been seen yet */
+static void snapshot_add(heap_snapshot_t *hs, SEXP s)
+{
+    if (s == NULL || hs->failed)
+	return;
+    int h = snapshot_hash(hs, s);
+    for (; hs->keys[h] != NULL; h = (h + 1) & (hs->tabsize - 1))
+	if (hs->keys[h] == s)
+	    return;
+    if (hs->count == hs->size) {
+	if (! snapshot_grow(hs)) {
+	    hs->failed = TRUE;
+	    return;
+	}
+	h = snapshot_hash(hs, s);
+	while (hs->keys[h] != NULL)
+	    h = (h + 1) & (hs->tabsize - 1);
+    }
+    hs->keys[h] = s;
+    hs->ids[h] = hs->count;
+    hs->nodes[hs->count] = s;
+    hs->nrefs[hs->count] = 0;
+    hs->count++;
+}
+
+/* a reference from node hs->cur to 's' */
+static R_INLINE void snapshot_ref(SEXP s, heap_snapshot_t *hs)
+{
+    snapshot_add(hs, s);
+    hs->nrefs[hs->cur]++;
+}
+#define SNAPSHOT_ROOT(s) snapshot_add(hs, s)
+
+static void snapshot_children(heap_snapshot_t *hs, int from)
+{
+    for (hs->cur = from; hs->cur < hs->count && ! hs->failed; hs->cur++) {
+	SEXP s = hs->nodes[hs->cur];
+	DO_CHILDREN(s, snapshot_ref, hs);
+	if (TYPEOF(s) == WEAKREFSXP) {
+	    snapshot_ref(WEAKREF_VALUE(s), hs);
+	    snapshot_ref(WEAKREF_FINALIZER(s), hs);
+	}
+    }
+}
+
+static int snapshot_traverse(heap_snapshot_t *hs)
+{
+    int nroots;
+    DO_ROOTS(SNAPSHOT_ROOT);
+    nroots = hs->count;
+    snapshot_children(hs, 0);
+
+    /* as in the collector, weak references with reachable keys are
+       kept, and may make more keys reachable */
+    Rboolean again;
+    do {
+	again = FALSE;
+	for (SEXP s = R_weak_refs; s != R_NilValue && ! hs->failed;
+	     s = WEAKREF_NEXT(s))
+	    if (snapshot_lookup(hs, WEAKREF_KEY(s)) != NA_INTEGER &&
+		snapshot_lookup(hs, s) == NA_INTEGER) {
+		int from = hs->count;
+		snapshot_add(hs, s);
+		snapshot_children(hs, from);
+		again = TRUE;
+	    }
+    } while (again && ! hs->failed);
+    return nroots;
+}
+
+static double snapshot_node_size(SEXP s)
+{
+    int nc = NODE_CLASS(s);
+    if (nc == 0)
+	return (double) sizeof(SEXPREC);
+    else if (nc < NUM_SMALL_NODE_CLASSES)
+	return (double) (sizeof(SEXPREC_ALIGN) +
+			 NodeClassSize[nc] * sizeof(VECREC));
+    else {
+	/* getVecSizeInVEC sets the length of a growable vector to its
+	   true length, as it is about to be freed */
+	Rboolean growable = IS_GROWABLE(s);
+	R_xlen_t len = XLENGTH(s);
+	R_size_t size = getVecSizeInVEC(s);
+	if (growable)
+	    SET_STDVEC_LENGTH(s, len);
+	return (double) (sizeof(SEXPREC_ALIGN) + size * sizeof(VECREC));
+    }
+}
+
+static const char *snapshot_env_name(SEXP rho, char *buf, size_t len)
+{
+    if (rho == R_GlobalEnv)
+	return "R_GlobalEnv";
+    else if (rho == R_BaseEnv)
+	return "base";
+    else if (rho == R_EmptyEnv)
+	return "R_EmptyEnv";
+    else if (rho == R_BaseNamespace)
+	return "namespace:base";
+    else if (R_IsPackageEnv(rho))
+	return CHAR(STRING_ELT(R_PackageEnvName(rho), 0));
+    else if (R_IsNamespaceEnv(rho)) {
+	snprintf(buf, len, "namespace:%s",
+		 CHAR(STRING_ELT(R_NamespaceEnvSpec(rho), 0)));
+	return buf;
+    }
+    else
+	return NULL;
+}
+
+#define SNAPSHOT_WRITE(p, size, n) do { \
+	if (fwrite(p, size, n, fp) != (size_t) (n)) goto fail; \
+    } while (0)
+#define SNAPSHOT_REF(s, hs) do { \
+	int id__ = snapshot_lookup(hs, s); \
+	SNAPSHOT_WRITE(&id__, sizeof(int), 1); \
+    } while (0)
+
+#define SNAPSHOT_WEAK_ROOT(s, hs) \
+    (snapshot_lookup(hs, WEAKREF_KEY(s)) != NA_INTEGER && \
+     snapshot_lookup(hs, s) != NA_INTEGER)
+
+static Rboolean snapshot_write(heap_snapshot_t *hs, int nroots, FILE *fp)
+{
+    int n = hs->count, one = 1, nnames = 0, nweak = 0;
+    char buf[256];
+    for (SEXP s = R_weak_refs; s != R_NilValue; s = WEAKREF_NEXT(s))
+	if (SNAPSHOT_WEAK_ROOT(s, hs))
+	    nweak++;
+    SNAPSHOT_WRITE(HEAP_SNAPSHOT_MAGIC, 1, strlen(HEAP_SNAPSHOT_MAGIC) + 1);
+    int header[] = { one, HEAP_SNAPSHOT_VERSION, n, nroots + nweak };
+    SNAPSHOT_WRITE(header, sizeof(int), 4);
+    SNAPSHOT_WRITE(&hs->nedges, sizeof(double), 1);
+
+    for (int i = 0; i < n; i++) {
+	unsigned char type = (unsigned char) TYPEOF(hs->nodes[i]);
+	SNAPSHOT_WRITE(&type, 1, 1);
+    }
+    for (int i = 0; i < n; i++) {
+	SEXP s = hs->nodes[i];
+	unsigned char flags = (HAS_GENUINE_ATTRIB(s) ? 1 : 0) |
+	    (OBJECT(s) ? 2 : 0) | (ALTREP(s) ? 4 : 0);
+	SNAPSHOT_WRITE(&flags, 1, 1);
+    }
+    for (int i = 0; i < n; i++) {
+	double size = snapshot_node_size(hs->nodes[i]);
+	SNAPSHOT_WRITE(&size, sizeof(double), 1);
+    }
+    for (int i = 0; i < n; i++) {
+	SEXP s = hs->nodes[i];
+	double len = (isVector(s) || TYPEOF(s) == CHARSXP) && ! ALTREP(s) ?
+	    (double) XLENGTH(s) : 0;
+	SNAPSHOT_WRITE(&len, sizeof(double), 1);
+    }
+    SNAPSHOT_WRITE(hs->nrefs, sizeof(int), n);
+    for (int i = 0; i < n; i++) {
+	SEXP s = hs->nodes[i];
+	DO_CHILDREN(s, SNAPSHOT_REF, hs);
+	if (TYPEOF(s) == WEAKREFSXP) {
+	    SNAPSHOT_REF(WEAKREF_VALUE(s), hs);
+	    SNAPSHOT_REF(WEAKREF_FINALIZER(s), hs);
+	}
+    }
+    for (int i = 0; i < nroots; i++)
+	SNAPSHOT_WRITE(&i, sizeof(int), 1);
+    for (SEXP s = R_weak_refs; s != R_NilValue; s = WEAKREF_NEXT(s))
+	if (SNAPSHOT_WEAK_ROOT(s, hs))
+	    SNAPSHOT_REF(s, hs);
+
+    for (int i = 0; i < n; i++) {
+	SEXP s = hs->nodes[i];
+	if (TYPEOF(s) == SYMSXP ||
+	    (TYPEOF(s) == ENVSXP && snapshot_env_name(s, buf, sizeof buf)))
+	    nnames++;
+    }
+    SNAPSHOT_WRITE(&nnames, sizeof(int), 1);
+    for (int i = 0; i < n; i++) {
+	SEXP s = hs->nodes[i];
+	if (TYPEOF(s) == SYMSXP ||
+	    (TYPEOF(s) == ENVSXP && snapshot_env_name(s, buf, sizeof buf)))
+	    SNAPSHOT_WRITE(&i, sizeof(int), 1);
+    }
+    for (int i = 0; i < n; i++) {
+	SEXP s = hs->nodes[i];
+	const char *name = NULL;
+	if (TYPEOF(s) == SYMSXP)
+	    /* R_UnboundValue has no print name */
+	    name = TYPEOF(PRINTNAME(s)) == CHARSXP ? CHAR(PRINTNAME(s)) : "";
+	else if (TYPEOF(s) == ENVSXP)
+	    name = snapshot_env_name(s, buf, sizeof buf);
+	if (name)
+	    SNAPSHOT_WRITE(name, 1, strlen(name) + 1);
+    }
+    return TRUE;
+
+ fail:
+    return FALSE;
+}
+
+SEXP do_heapsnapshot(SEXP args)
+{
+    SEXP filename = CAR(args);
+    if (!isString(filename) || LENGTH(filename) != 1 ||
+	STRING_ELT(filename, 0) == NA_STRING)
+	error(_("invalid '%s' argument"), "file");
+    FILE *fp = RC_fopen(STRING_ELT(filename, 0), "wb", TRUE);
+    if (fp == NULL)
+	error(_("cannot open file '%s': %s"),
+	      translateChar(STRING_ELT(filename, 0)), strerror(errno));
+
+    heap_snapshot_t hs = { NULL, NULL, 0, 0, 0, NULL, NULL, 1024, 0, FALSE };
+    hs.keys = calloc(hs.tabsize, sizeof(SEXP));
+    hs.ids = malloc(hs.tabsize * sizeof(int));
+    hs.nodes = malloc((hs.tabsize / 2) * sizeof(SEXP));
+    hs.nrefs = malloc((hs.tabsize / 2) * sizeof(int));
+    hs.size = hs.tabsize / 2;
+    hs.failed = hs.keys == NULL || hs.ids == NULL || hs.nodes == NULL ||
+	hs.nrefs == NULL;
+
+    /* nothing is allocated on the R heap from here on, so no
+       collection can change the graph while it is being written */
+    Rboolean ok = FALSE;
+    if (! hs.failed) {
+	int nroots = snapshot_traverse(&hs);
+	for (int i = 0; i < hs.count; i++)
+	    hs.nedges += hs.nrefs[i];
+	if (! hs.failed)
+	    ok = snapshot_write(&hs, nroots, fp);
+    }
+    if (fclose(fp) != 0)
+	ok = FALSE;
+    int count = hs.count;
+    free(hs.keys);
+    free(hs.ids);
+    free(hs.nodes);
+    free(hs.nrefs);
+
+    if (hs.failed)
+	error(_("not enough memory to take a heap snapshot"));
+    if (! ok)
+	error(_("error writing heap snapshot to '%s'"),
+	      translateChar(STRING_ELT(filename, 0)));
+    return ScalarInteger(count);
+}
+
 /* reports memory use to profiler in eval.c */
 
 void attribute_hidden get_current_mem(size_t *smallvsize,
@@ -2060,6 +3302,14 @@ void attribute_hidden get_current_mem(size_t *smallvsize,
     return;
 }
 
+/* reports the bytes of vector data allocated so far, for byte code
+   instrumentation in eval.c */
+
+double attribute_hidden R_GetVallocBytes(void)
+{
+    return (double) R_VallocTotal * sizeof(VECREC);
+}
+
 SEXP attribute_hidden do_gc(SEXP call, SEXP op, SEXP args, SEXP rho)
 {
     SEXP value;
@@ -2174,6 +3424,9 @@ void attribute_hidden InitMemory()
       R_GenHeap[i].New = &R_GenHeap[i].NewPeg;
       SET_PREV_NODE(R_GenHeap[i].New, R_GenHeap[i].New);
       SET_NEXT_NODE(R_GenHeap[i].New, R_GenHeap[i].New);
+      R_GenHeap[i].Grey = &R_GenHeap[i].GreyPeg;
+      SET_PREV_NODE(R_GenHeap[i].Grey, R_GenHeap[i].Grey);
+      SET_NEXT_NODE(R_GenHeap[i].Grey, R_GenHeap[i].Grey);
     }
 
     for (i = 0; i < NUM_NODE_CLASSES; i++)
@@ -2643,6 +3896,7 @@ SEXP allocVector3(SEXPTYPE type, R_xlen_t length, R_allocator_t *allocator)
 	    SETSCALAR(s, 1);
 	    SET_NODE_CLASS(s, node_class);
 	    R_SmallVallocSize += alloc_size;
+	    R_VallocTotal += alloc_size;
 	    /* Note that we do not include the header size into VallocSize,
 	       but it is counted into memory usage via R_NodesInUse. */
 	    ATTRIB(s) = R_NilValue;
@@ -2789,6 +4043,7 @@ SEXP allocVector3(SEXPTYPE type, R_xlen_t length, R_allocator_t *allocator)
 	    INIT_REFCNT(s);
 	    SET_NODE_CLASS(s, node_class);
 	    R_SmallVallocSize += alloc_size;
+	    R_VallocTotal += alloc_size;
 	    SET_STDVEC_LENGTH(s, (R_len_t) length);
 	}
 	else {
@@ -2803,7 +4058,7 @@ SEXP allocVector3(SEXPTYPE type, R_xlen_t length, R_allocator_t *allocator)
 		   indexable by size_t. - TK */
 		mem = allocator ?
 		    custom_node_alloc(allocator, hdrsize + size * sizeof(VECREC)) :
-		    malloc(hdrsize + size * sizeof(VECREC));
+		    large_vec_alloc(hdrsize + size * sizeof(VECREC));
 		if (mem == NULL) {
 		    /* If we are near the address space limit, we
 		       might be short of address space.  So return
@@ -2811,7 +4066,7 @@ SEXP allocVector3(SEXPTYPE type, R_xlen_t length, R_allocator_t *allocator)
 		    R_gc_no_finalizers(alloc_size);
 		    mem = allocator ?
 			custom_node_alloc(allocator, hdrsize + size * sizeof(VECREC)) :
-			malloc(hdrsize + size * sizeof(VECREC));
+			large_vec_alloc(hdrsize + size * sizeof(VECREC));
 		}
 		if (mem != NULL) {
 		    s = mem;
@@ -2844,6 +4099,7 @@ SEXP allocVector3(SEXPTYPE type, R_xlen_t length, R_allocator_t *allocator)
 	    INIT_REFCNT(s);
 	    SET_NODE_CLASS(s, node_class);
 	    if (!allocator) R_LargeVallocSize += size;
+	    R_VallocTotal += size;
 	    R_GenHeap[node_class].AllocCount++;
 	    R_NodesInUse++;
 	    SNAP_NODE(s, R_GenHeap[node_class].New);
@@ -2900,6 +4156,197 @@ SEXP allocVector3(SEXPTYPE type, R_xlen_t length, R_allocator_t *allocator)
     return s;
 }
 
+/* Worker arenas.
+
+   Threads other than the main R thread must not call the R API, and
+   on some platforms must not even use the allocator of the memory
+   manager.  A worker arena gives each worker thread a buffer,
+   obtained by the main thread, from which it can carve out atomic
+   vectors without locking.  At a synchronisation point the main
+   thread calls R_AdoptWorkerVectors to link the new vectors into the
+   heap as custom allocator nodes, after which they are ordinary R
+   objects.  A buffer is freed once the arena has let go of it and
+   all vectors carved out of it have been collected. */
+
+typedef struct worker_chunk {
+    size_t size;	/* usable bytes */
+    size_t used;	/* bytes handed out to the worker */
+    size_t adopted;	/* bytes already adopted into the heap */
+    int refcnt;		/* the arena plus each live adopted vector */
+} worker_chunk_t;
+
+#define WORKER_CHUNK_HDRSIZE \
+    (BYTE2VEC(sizeof(worker_chunk_t)) * sizeof(VECREC))
+#define WORKER_CHUNK_DATA(c) ((char *) (c) + WORKER_CHUNK_HDRSIZE)
+#define WORKER_RECORD_HDRSIZE (sizeof(R_allocator_t) + sizeof(SEXPREC_ALIGN))
+
+struct R_WorkerArena_st {
+    int nworkers;
+    size_t size;
+    worker_chunk_t **chunks;
+};
+
+static worker_chunk_t *new_worker_chunk(size_t size)
+{
+    worker_chunk_t *c = malloc(WORKER_CHUNK_HDRSIZE + size);
+    if (c != NULL) {
+	c->size = size;
+	c->used = 0;
+	c->adopted = 0;
+	c->refcnt = 1;
+    }
+    return c;
+}
+
+static void release_worker_chunk(worker_chunk_t *c)
+{
+    if (--c->refcnt == 0)
+	free(c);
+}
+
+/* only called by the collector, i.e. on the main thread */
+static void worker_node_free(R_allocator_t *allocator, void *ptr)
+{
+    release_worker_chunk((worker_chunk_t *) allocator->data);
+}
+
+/* size in VECREC units, or -1 for a type workers cannot allocate */
+static R_xlen_t worker_vec_size(SEXPTYPE type, R_xlen_t length)
+{
+    switch (type) {
+    case RAWSXP: return BYTE2VEC(length);
+    case LGLSXP:
+    case INTSXP: return INT2VEC(length);
+    case REALSXP: return FLOAT2VEC(length);
+    case CPLXSXP: return COMPLEX2VEC(length);
+    default: return -1;
+    }
+}
+
+void R_FreeWorkerArena(R_WorkerArena arena)
+{
+    if (arena == NULL) return;
+    for (int i = 0; i < arena->nworkers; i++)
+	if (arena->chunks[i] != NULL)
+	    release_worker_chunk(arena->chunks[i]);
+    free(arena->chunks);
+    free(arena);
+}
+
+R_WorkerArena R_NewWorkerArena(int nworkers, size_t size)
+{
+    if (nworkers <= 0)
+	error(_("invalid '%s' argument"), "nworkers");
+    if (size < WORKER_RECORD_HDRSIZE || size > R_SIZE_T_MAX / 2)
+	error(_("invalid '%s' argument"), "size");
+    size = BYTE2VEC(size) * sizeof(VECREC);
+
+    R_WorkerArena arena = malloc(sizeof(struct R_WorkerArena_st));
+    worker_chunk_t **chunks = calloc(nworkers, sizeof(worker_chunk_t *));
+    if (arena == NULL || chunks == NULL) {
+	free(arena);
+	free(chunks);
+	error(_("cannot allocate worker arena"));
+    }
+    arena->nworkers = nworkers;
+    arena->size = size;
+    arena->chunks = chunks;
+    for (int i = 0; i < nworkers; i++)
+	if ((chunks[i] = new_worker_chunk(size)) == NULL) {
+	    R_FreeWorkerArena(arena);
+	    error(_("cannot allocate worker arena"));
+	}
+    return arena;
+}
+
+/* May be called from any thread, but each worker index by only one
+   thread at a time and not concurrently with R_AdoptWorkerVectors
+   or R_FreeWorkerArena.  Never signals an error: returns NULL if the
+   type is not supported or the worker's buffer is exhausted. */
+SEXP R_WorkerAllocVector(R_WorkerArena arena, int worker,
+			 SEXPTYPE type, R_xlen_t length)
+{
+    if (arena == NULL || worker < 0 || worker >= arena->nworkers ||
+	length < 0)
+	return NULL;
+    R_xlen_t size = worker_vec_size(type, length);
+    if (size < 0)
+	return NULL;
+
+    worker_chunk_t *c = arena->chunks[worker];
+    size_t avail = c->size - c->used;
+    if (avail < WORKER_RECORD_HDRSIZE ||
+	(avail - WORKER_RECORD_HDRSIZE) / sizeof(VECREC) < (size_t) size)
+	return NULL;
+
+    R_allocator_t *ca = (R_allocator_t *) (WORKER_CHUNK_DATA(c) + c->used);
+    ca->mem_alloc = NULL;
+    ca->mem_free = worker_node_free;
+    ca->res = NULL;
+    ca->data = c;
+
+    SEXP s = (SEXP) (ca + 1);
+    s->sxpinfo = UnmarkedNodeTemplate.sxpinfo;
+    INIT_REFCNT(s);
+    SET_NODE_CLASS(s, CUSTOM_NODE_CLASS);
+    ATTRIB(s) = R_NilValue;
+    SET_TYPEOF(s, type);
+    SET_STDVEC_LENGTH(s, length);
+    SET_STDVEC_TRUELENGTH(s, 0);
+    SETALTREP(s, 0);
+
+    c->used += WORKER_RECORD_HDRSIZE + size * sizeof(VECREC);
+    return s;
+}
+
+/* Called on the main thread while no worker is allocating.  Returns
+   a list of the vectors allocated since the previous call, in worker
+   order and within a worker in allocation order. */
+SEXP R_AdoptWorkerVectors(R_WorkerArena arena)
+{
+    if (arena == NULL)
+	error(_("invalid '%s' argument"), "arena");
+
+    R_xlen_t n = 0;
+    for (int i = 0; i < arena->nworkers; i++) {
+	worker_chunk_t *c = arena->chunks[i];
+	for (size_t off = c->adopted; off < c->used; n++) {
+	    SEXP s = (SEXP) ((R_allocator_t *) (WORKER_CHUNK_DATA(c) + off) + 1);
+	    off += WORKER_RECORD_HDRSIZE +
+		worker_vec_size(TYPEOF(s), STDVEC_LENGTH(s)) * sizeof(VECREC);
+	}
+    }
+
+    SEXP val = PROTECT(allocVector(VECSXP, n));
+    R_xlen_t k = 0;
+    for (int i = 0; i < arena->nworkers; i++) {
+	worker_chunk_t *c = arena->chunks[i];
+	while (c->adopted < c->used) {
+	    SEXP s = (SEXP) ((R_allocator_t *)
+			     (WORKER_CHUNK_DATA(c) + c->adopted) + 1);
+	    c->adopted += WORKER_RECORD_HDRSIZE +
+		worker_vec_size(TYPEOF(s), STDVEC_LENGTH(s)) * sizeof(VECREC);
+	    c->refcnt++;
+	    R_VallocTotal += worker_vec_size(TYPEOF(s), STDVEC_LENGTH(s));
+	    R_GenHeap[CUSTOM_NODE_CLASS].AllocCount++;
+	    R_NodesInUse++;
+	    SNAP_NODE(s, R_GenHeap[CUSTOM_NODE_CLASS].New);
+	    SET_VECTOR_ELT(val, k++, s);
+	}
+	/* Replace a buffer that is mostly used up; the old one lives on
+	   until its last vector has been collected. */
+	if (c->size - c->used < c->size / 4) {
+	    worker_chunk_t *nc = new_worker_chunk(arena->size);
+	    if (nc != NULL) {
+		release_worker_chunk(c);
+		arena->chunks[i] = nc;
+	    }
+	}
+    }
+    UNPROTECT(1); /* val */
+    return val;
+}
+
 /* For future hiding of allocVector(CHARSXP) */
 SEXP attribute_hidden allocCharsxp(R_len_t len)
 {
@@ -2980,6 +4427,7 @@ SEXP allocFormalsList6(SEXP sym1, SEXP sym2, SEXP sym3, SEXP sym4,
 void R_gc(void)
 {
     num_old_gens_to_collect = NUM_OLD_GENERATIONS;
+    gc_trigger = GC_TRIGGER_REQUEST;
     R_gc_internal(0);
 #ifndef IMMEDIATE_FINALIZERS
     R_RunPendingFinalizers();
@@ -2988,6 +4436,7 @@ void R_gc(void)
 
 void R_gc_lite(void)
 {
+    gc_trigger = GC_TRIGGER_REQUEST;
     R_gc_internal(0);
 #ifndef IMMEDIATE_FINALIZERS
     R_RunPendingFinalizers();
@@ -2997,6 +4446,7 @@ void R_gc_lite(void)
 static void R_gc_no_finalizers(R_size_t size_needed)
 {
     num_old_gens_to_collect = NUM_OLD_GENERATIONS;
+    gc_trigger = GC_TRIGGER_RETRY;
     R_gc_internal(size_needed);
 }
 
@@ -3095,9 +4545,26 @@ static void R_gc_internal(R_size_t size_needed)
 	R_VSize += size_needed - VHEAP_FREE();
 
       gc_pending = TRUE;
+      gc_trigger = GC_TRIGGER_NONE;
       return;
     }
+
+    /* work out why we are here before gc_pending is cleared */
+    int trigger = gc_trigger;
+    gc_trigger = GC_TRIGGER_NONE;
+    if (trigger == GC_TRIGGER_NONE) {
+	if (gc_pending)
+	    trigger = GC_TRIGGER_DEFERRED;
+	else if (NO_FREE_NODES())
+	    trigger = GC_TRIGGER_NODES;
+	else if (VHEAP_FREE() < size_needed)
+	    trigger = GC_TRIGGER_VECTORS;
+	else
+	    trigger = GC_TRIGGER_TORTURE;
+    }
     gc_pending = FALSE;
+    gc_inc_finish =
+	trigger == GC_TRIGGER_REQUEST || trigger == GC_TRIGGER_RETRY;
 
     R_size_t onsize = R_NSize /* can change during collection */;
     double ncells, vcells, vfrac, nfrac;
@@ -3119,6 +4586,10 @@ static void R_gc_internal(R_size_t size_needed)
     R_N_maxused = R_MAX(R_N_maxused, R_NodesInUse);
     R_V_maxused = R_MAX(R_V_maxused, R_VSize - VHEAP_FREE());
 
+    double trace_start = gc_trace != NULL ? currentTime() : 0;
+    gc_trace_mark = 0;
+    gc_trace_promoted = gc_trace_pages = gc_trace_large_freed = 0;
+
     BEGIN_SUSPEND_INTERRUPTS {
 	R_in_gc = TRUE;
 	gc_start_timing();
@@ -3127,6 +4598,24 @@ static void R_gc_internal(R_size_t size_needed)
 	R_in_gc = FALSE;
     } END_SUSPEND_INTERRUPTS;
 
+    if (gc_trace != NULL) {
+	gc_event_t *e = gc_trace + gc_trace_count++ % gc_trace_size;
+	if (gc_trace_count - gc_trace_first > (R_size_t) gc_trace_size)
+	    gc_trace_first++;
+	e->start = trace_start;
+	e->elapsed = currentTime() - trace_start;
+	e->mark = gc_trace_mark;
+	e->level = gens_collected < 0 ? NUM_OLD_GENERATIONS : gens_collected;
+	e->trigger = trigger;
+	e->slice = gens_collected < 0;
+	e->promoted = (double) gc_trace_promoted;
+	e->pages_released = (double) gc_trace_pages;
+	e->large_freed = (double) gc_trace_large_freed;
+	e->ncells = (double) (gens_collected < 0 ? R_NodesInUse :
+			      onsize - R_Collected);
+	e->vcells = (double) (R_VSize - VHEAP_FREE());
+    }
+
     if (R_check_constants > 2 ||
 	    (R_check_constants > 1 && gens_collected == NUM_OLD_GENERATIONS))
 	R_checkConstants(TRUE);
@@ -3135,7 +4624,10 @@ static void R_gc_internal(R_size_t size_needed)
 	REprintf("Garbage collection %d = %d", gc_count, gen_gc_counts[0]);
 	for (int i = 0; i < NUM_OLD_GENERATIONS; i++)
 	    REprintf("+%d", gen_gc_counts[i + 1]);
-	REprintf(" (level %d) ... ", gens_collected);
+	if (gens_collected < 0)
+	    REprintf(" (incremental) ... ");
+	else
+	    REprintf(" (level %d) ... ", gens_collected);
 	DEBUG_GC_SUMMARY(gens_collected == NUM_OLD_GENERATIONS);
     }
 
@@ -3160,6 +4652,21 @@ static void R_gc_internal(R_size_t size_needed)
 	vcells = 0.1*ceil(10*vcells * vsfac/Mega);
 	REprintf("%.1f Mbytes of vectors used (%d%%)\n",
 		 vcells, (int) (vfrac + 0.5));
+	REprintf("Mark time %.3f secs", gc_last_mark_time);
+#ifdef PARALLEL_MARK
+	if (R_GCMarkThreads > 1 && mark_workers != NULL &&
+	    gens_collected == NUM_OLD_GENERATIONS)
+	    REprintf(" (%d threads)", R_GCMarkThreads);
+#endif
+	REprintf("; totals by level %.3f", gen_gc_mark_times[0]);
+	for (int i = 0; i < NUM_OLD_GENERATIONS; i++)
+	    REprintf("+%.3f", gen_gc_mark_times[i + 1]);
+	REprintf(" secs\n");
+	REprintf("Large vectors:");
+	for (int i = 0; i < NUM_LARGEVEC_POLICIES; i++)
+	    REprintf("%s %.1f Mbytes %s", i ? "," : "",
+		     0.1*ceil(10*LargeVecBytes[i]/Mega), LargeVecPolicyNames[i]);
+	REprintf("\n");
     }
 
 #ifdef IMMEDIATE_FINALIZERS
@@ -4368,18 +5875,6 @@ attribute_hidden
 void (SET_HASHVALUE)(SEXP x, int v) { SET_HASHVALUE(CHK(x), v); }
 #endif
 
-attribute_hidden
-SEXP (SET_CXTAIL)(SEXP x, SEXP v) {
-#ifdef USE_TYPE_CHECKING
-    if(TYPEOF(v) != CHARSXP && TYPEOF(v) != NILSXP)
-	error("value of 'SET_CXTAIL' must be a char or NULL, not a '%s'",
-	      type2char(TYPEOF(v)));
-#endif
-    /*CHECK_OLD_TO_NEW(x, v); *//* not needed since not properly traced */
-    ATTRIB(x) = v;
-    return x;
-}
-
 /* Test functions */
 Rboolean Rf_isNull(SEXP s) { return isNull(CHK(s)); }
 Rboolean Rf_isSymbol(SEXP s) { return isSymbol(CHK(s)); }
@@ -228,14 +228,34 @@ static SEXP findFunWithBaseEnvAfterGlobalEnv(SEXP symbol, SEXP rho)
  *    3. fix up the argument list; it should be the arguments to the
  *	 generic matched to the formals of the method to be invoked */
 
+static SEXP s_S3MethodsTable = NULL;
+static int lookup_baseenv_after_globalenv = -1;
+static int lookup_report_search_path_uses = -1;
+
+static void initS3LookupOptions(void)
+{
+    char *lookup;
+
+    if (!s_S3MethodsTable)
+	s_S3MethodsTable = install(".__S3MethodsTable__.");
+
+    if(lookup_baseenv_after_globalenv == -1) {
+	lookup = getenv("_R_S3_METHOD_LOOKUP_BASEENV_AFTER_GLOBALENV_");
+	lookup_baseenv_after_globalenv = 
+	    ((lookup != NULL) && StringFalse(lookup)) ? 0 : 1;
+    }
+
+    if(lookup_report_search_path_uses == -1) {
+	lookup = getenv("_R_S3_METHOD_LOOKUP_REPORT_SEARCH_PATH_USES_");
+	lookup_report_search_path_uses = 
+	    ((lookup != NULL) && StringTrue(lookup)) ? 1 : 0;
+    }
+}
+
 attribute_hidden
 SEXP R_LookupMethod(SEXP method, SEXP rho, SEXP callrho, SEXP defrho)
 {
     SEXP val, top = R_NilValue;	/* -Wall */
-    static SEXP s_S3MethodsTable = NULL;
-    static int lookup_baseenv_after_globalenv = -1;
-    static int lookup_report_search_path_uses = -1;
-    char *lookup;
     PROTECT_INDEX validx;
 
     if (TYPEOF(callrho) != ENVSXP) {
@@ -253,17 +273,7 @@ SEXP R_LookupMethod(SEXP method, SEXP rho, SEXP callrho, SEXP defrho)
 	    error(_("bad generic definition environment"));
     }
 
-    if(lookup_baseenv_after_globalenv == -1) {
-	lookup = getenv("_R_S3_METHOD_LOOKUP_BASEENV_AFTER_GLOBALENV_");
-	lookup_baseenv_after_globalenv = 
-	    ((lookup != NULL) && StringFalse(lookup)) ? 0 : 1;
-    }
-
-    if(lookup_report_search_path_uses == -1) {
-	lookup = getenv("_R_S3_METHOD_LOOKUP_REPORT_SEARCH_PATH_USES_");
-	lookup_report_search_path_uses = 
-	    ((lookup != NULL) && StringTrue(lookup)) ? 1 : 0;
-    }
+    initS3LookupOptions();
 
     /* This evaluates promises */
     PROTECT(top = topenv(R_NilValue, callrho));
@@ -275,8 +285,6 @@ SEXP R_LookupMethod(SEXP method, SEXP rho, SEXP callrho, SEXP defrho)
 
     PROTECT_WITH_INDEX(val, &validx);
     /* We assume here that no one registered a non-function */
-    if (!s_S3MethodsTable)
-	s_S3MethodsTable = install(".__S3MethodsTable__.");
     SEXP table = findVarInFrame3(defrho, s_S3MethodsTable, TRUE);
     if (TYPEOF(table) == PROMSXP) {
 	PROTECT(table);
@@ -440,11 +448,286 @@ SEXP dispatchMethod(SEXP op, SEXP sxp, SEXP dotClass, RCNTXT *cptr, SEXP method,
     return ans;
 }
 
+/* S3 dispatch cache
+
+   usemethod() remembers, for a generic, a class vector, the top level
+   environment reached from the call environment and the environment
+   in which the generic is defined, which of the candidate methods the
+   lookup found and in which binding.  The method is read from the
+   binding on each use, so redefining it takes effect at once.
+
+   Only lookups that can be replayed through the function lookup cache
+   machinery of envir.c are stored.  The top level environment, the S3
+   methods table and the environments searched after them are marked,
+   as are the candidate method names, so that adding or removing a
+   binding of a candidate in one of them, as registering a method does,
+   or changing an enclosure increments R_FunCacheVersion and
+   invalidates the entries.  The call frames
+   below the top level environment are checked on each hit for local
+   definitions of the candidates. */
+
+#define S3CACHE_SIZE 1024
+#define S3C_GENERIC  0 /* CHARSXP */
+#define S3C_CLASS    1 /* copy of the class vector */
+#define S3C_TOP      2
+#define S3C_DEFENV   3
+#define S3C_TABLOC   4 /* binding of the methods table in the defenv */
+#define S3C_TABLE    5 /* and its value */
+#define S3C_METHODS  6 /* the candidate method symbols tried */
+#define S3C_LOC      7 /* binding of the method found, or R_NilValue */
+#define S3C_LENGTH   8
+
+static SEXP S3Cache = NULL;
+static double S3CacheHits = 0, S3CacheMisses = 0;
+
+static R_INLINE unsigned int
+S3CacheIndex(const char *generic, SEXP klass, SEXP top, SEXP defrho)
+{
+    uintptr_t h = 5381;
+    for (const char *p = generic; *p; p++)
+	h = h * 33 + (unsigned char) *p;
+    for (R_xlen_t i = 0; i < XLENGTH(klass); i++)
+	h = h * 33 + ((uintptr_t) STRING_ELT(klass, i) >> 4);
+    h = h * 33 + ((uintptr_t) top >> 4);
+    h = h * 33 + ((uintptr_t) defrho >> 4);
+    return (unsigned int) (h ^ (h >> 15)) % S3CACHE_SIZE;
+}
+
+/* The environment in which a lookup from 'callrho' leaves the call
+   frames, or R_NilValue if the lookup cannot use the cache. */
+static R_INLINE SEXP S3CacheTop(SEXP callrho, SEXP defrho, SEXP klass)
+{
+    if (TYPEOF(callrho) != ENVSXP || TYPEOF(defrho) != ENVSXP ||
+	TYPEOF(klass) != STRSXP)
+	return R_NilValue;
+    while (callrho != R_EmptyEnv && IS_FUNCACHE_FUNFRAME(callrho))
+	callrho = ENCLOS(callrho);
+    return callrho;
+}
+
+/* TRUE if none of the call frames from 'rho' up to 'top' binds one of
+   the candidates or could make topenv() stop early. */
+static Rboolean S3CacheFramesClear(SEXP rho, SEXP top, SEXP methods)
+{
+    R_xlen_t n = XLENGTH(methods);
+    for (; rho != top; rho = ENCLOS(rho)) {
+	if (ATTRIB(rho) != R_NilValue)
+	    return FALSE;
+	for (SEXP frame = FRAME(rho); frame != R_NilValue;
+	     frame = CDR(frame)) {
+	    SEXP tag = TAG(frame);
+	    if (tag == R_dot_packageName || tag == R_NamespaceEnvSymbol)
+		return FALSE;
+	    for (R_xlen_t i = 0; i < n; i++)
+		if (tag == VECTOR_ELT(methods, i))
+		    return FALSE;
+	}
+    }
+    return TRUE;
+}
+
+/* The value of a cached binding, or R_NilValue if it is not available
+   without evaluation. */
+static R_INLINE SEXP S3CacheLocValue(SEXP loc)
+{
+    SEXP val;
+    if (TYPEOF(loc) == SYMSXP)
+	val = SYMVALUE(loc);
+    else if (BNDCELL_TAG(loc))
+	return R_NilValue;
+    else
+	val = CAR0(loc);
+    if (TYPEOF(val) == PROMSXP) {
+	val = PRVALUE(val);
+	if (val == R_UnboundValue)
+	    return R_NilValue;
+    }
+    return val;
+}
+
+/* Look up a dispatch in the cache.  Returns the number of candidates
+   tried, or 0 if the cache has no valid entry; *psxp is set to the
+   method found, or R_NilValue if there was none. */
+static int S3CacheGet(const char *generic, SEXP klass, SEXP callrho,
+		      SEXP defrho, SEXP *pmethod, SEXP *psxp)
+{
+    SEXP top = S3CacheTop(callrho, defrho, klass);
+    if (top == R_NilValue || S3Cache == NULL)
+	return 0;
+    SEXP entry = VECTOR_ELT(S3Cache, S3CacheIndex(generic, klass, top,
+						  defrho));
+    if (entry == R_NilValue || TRUELENGTH(entry) != R_FunCacheVersion ||
+	VECTOR_ELT(entry, S3C_TOP) != top ||
+	VECTOR_ELT(entry, S3C_DEFENV) != defrho)
+	return 0;
+    SEXP eklass = VECTOR_ELT(entry, S3C_CLASS);
+    R_xlen_t nclass = XLENGTH(klass);
+    if (XLENGTH(eklass) != nclass)
+	return 0;
+    for (R_xlen_t i = 0; i < nclass; i++)
+	if (STRING_ELT(eklass, i) != STRING_ELT(klass, i))
+	    return 0;
+    if (strcmp(CHAR(VECTOR_ELT(entry, S3C_GENERIC)), generic))
+	return 0;
+
+    SEXP tabloc = VECTOR_ELT(entry, S3C_TABLOC);
+    if (tabloc != R_NilValue &&
+	S3CacheLocValue(tabloc) != VECTOR_ELT(entry, S3C_TABLE))
+	return 0;
+    SEXP methods = VECTOR_ELT(entry, S3C_METHODS);
+    if (!S3CacheFramesClear(callrho, top, methods))
+	return 0;
+
+    int ntried = (int) XLENGTH(methods);
+    SEXP loc = VECTOR_ELT(entry, S3C_LOC);
+    if (loc == R_NilValue) {
+	*pmethod = R_NilValue;
+	*psxp = R_NilValue;
+    }
+    else {
+	SEXP sxp = S3CacheLocValue(loc);
+	if (!isFunction(sxp))
+	    return 0;
+	*pmethod = VECTOR_ELT(methods, ntried - 1);
+	*psxp = sxp;
+    }
+    return ntried;
+}
+
+/* Record the bindings of the first 'ntried' candidates in 'methods'
+   for a lookup as done by R_LookupMethod, the last of which found
+   'sxp' unless that is R_NilValue.  Nothing is stored if the lookup
+   depends on anything not covered by the invalidation. */
+static void S3CachePut(const char *generic, SEXP klass, SEXP callrho,
+		       SEXP defrho, SEXP methods, int ntried, SEXP sxp)
+{
+    initS3LookupOptions();
+    if (!lookup_baseenv_after_globalenv || lookup_report_search_path_uses)
+	return;
+    SEXP top = S3CacheTop(callrho, defrho, klass);
+    if (top == R_NilValue || top != topenv(R_NilValue, callrho))
+	return;
+
+    PROTECT(sxp);
+    SEXP tried = PROTECT(allocVector(VECSXP, ntried));
+    for (int i = 0; i < ntried; i++) {
+	SEXP method = VECTOR_ELT(methods, i);
+	if (method == R_SortListSymbol)
+	    goto done;
+	SET_VECTOR_ELT(tried, i, method);
+    }
+    if (!S3CacheFramesClear(callrho, top, tried))
+	goto done;
+
+    SEXP tabloc, table = R_NilValue;
+    if (!R_FunCacheFrameLoc(defrho, s_S3MethodsTable, &tabloc))
+	goto done;
+    if (tabloc != R_NilValue) {
+	if (IS_ACTIVE_BINDING(tabloc))
+	    goto done;
+	table = S3CacheLocValue(tabloc);
+	if (table == R_NilValue)
+	    goto done;
+    }
+
+    SEXP loc = R_NilValue;
+    for (int i = 0; i < ntried; i++) {
+	SEXP method = VECTOR_ELT(tried, i);
+	Rboolean last = (i == ntried - 1 && sxp != R_NilValue);
+	SEXP rho = top;
+	int stage = 0; /* top, methods table, enclosures */
+	while (rho != R_EmptyEnv) {
+	    SEXP l;
+	    if (!R_FunCacheFrameLoc(rho, method, &l))
+		goto done;
+	    if (l != R_NilValue) {
+		/* other values could become methods without notice */
+		if (!last || IS_ACTIVE_BINDING(l) ||
+		    S3CacheLocValue(l) != sxp)
+		    goto done;
+		loc = l;
+		break;
+	    }
+	    if (stage == 0) {
+		stage = 1;
+		if (TYPEOF(table) == ENVSXP) {
+		    rho = table;
+		    continue;
+		}
+	    }
+	    if (stage == 1) {
+		stage = 2;
+		rho = top == R_GlobalEnv ? R_BaseEnv : ENCLOS(top);
+	    }
+	    else if (rho == R_GlobalEnv)
+		rho = R_BaseEnv;
+	    else
+		rho = ENCLOS(rho);
+	}
+	if (last && loc == R_NilValue)
+	    goto done;
+    }
+
+    if (S3Cache == NULL) {
+	S3Cache = allocVector(VECSXP, S3CACHE_SIZE);
+	R_PreserveObject(S3Cache);
+    }
+    SEXP entry = PROTECT(allocVector(VECSXP, S3C_LENGTH));
+    SET_VECTOR_ELT(entry, S3C_GENERIC, mkChar(generic));
+    SET_VECTOR_ELT(entry, S3C_CLASS, duplicate(klass));
+    SET_VECTOR_ELT(entry, S3C_TOP, top);
+    SET_VECTOR_ELT(entry, S3C_DEFENV, defrho);
+    SET_VECTOR_ELT(entry, S3C_TABLOC, tabloc);
+    SET_VECTOR_ELT(entry, S3C_TABLE, table);
+    SET_VECTOR_ELT(entry, S3C_METHODS, tried);
+    SET_VECTOR_ELT(entry, S3C_LOC, loc);
+    SET_TRUELENGTH(entry, R_FunCacheVersion);
+    SET_VECTOR_ELT(S3Cache, S3CacheIndex(generic, klass, top, defrho), entry);
+    UNPROTECT(1); /* entry */
+ done:
+    UNPROTECT(2); /* sxp, tried */
+}
+
+/* .Internal(S3dispatchStats(reset)) */
+SEXP attribute_hidden do_S3dispatchStats(SEXP call, SEXP op, SEXP args,
+					 SEXP env)
+{
+    checkArity(op, args);
+    int reset = asLogical(CAR(args));
+    if (reset == NA_LOGICAL)
+	error(_("invalid '%s' argument"), "reset");
+    double entries = 0;
+    if (S3Cache != NULL)
+	for (int i = 0; i < S3CACHE_SIZE; i++) {
+	    SEXP entry = VECTOR_ELT(S3Cache, i);
+	    if (entry != R_NilValue &&
+		TRUELENGTH(entry) == R_FunCacheVersion)
+		entries++;
+	}
+    SEXP ans = PROTECT(allocVector(REALSXP, 3));
+    SEXP nms = PROTECT(allocVector(STRSXP, 3));
+    REAL(ans)[0] = S3CacheHits;
+    REAL(ans)[1] = S3CacheMisses;
+    REAL(ans)[2] = entries;
+    SET_STRING_ELT(nms, 0, mkChar("hits"));
+    SET_STRING_ELT(nms, 1, mkChar("misses"));
+    SET_STRING_ELT(nms, 2, mkChar("entries"));
+    setAttrib(ans, R_NamesSymbol, nms);
+    if (reset) {
+	S3CacheHits = S3CacheMisses = 0;
+	if (S3Cache != NULL)
+	    for (int i = 0; i < S3CACHE_SIZE; i++)
+		SET_VECTOR_ELT(S3Cache, i, R_NilValue);
+    }
+    UNPROTECT(2); /* ans, nms */
+    return ans;
+}
+
 attribute_hidden
 int usemethod(const char *generic, SEXP obj, SEXP call, SEXP args,
 	      SEXP rho, SEXP callrho, SEXP defrho, SEXP *ans)
 {
-    SEXP klass, method, sxp;
+    SEXP klass, method, sxp, tried;
     SEXP op;
     int i, nclass;
     RCNTXT *cptr;
@@ -454,40 +737,67 @@ int usemethod(const char *generic, SEXP obj, SEXP call, SEXP args,
     cptr = R_GlobalContext;
     op = cptr->callfun;
     PROTECT(klass = R_data_class2(obj));
+    /* as in R_LookupMethod */
+    SEXP defenv = defrho == R_BaseEnv ? R_BaseNamespace : defrho;
 
     nclass = length(klass);
+    i = S3CacheGet(generic, klass, callrho, defenv, &method, &sxp);
+    if (i > 0) {
+	S3CacheHits++;
+	i--;
+	PROTECT(sxp);
+	if (sxp == R_NilValue)
+	    goto none;
+	goto found;
+    }
+    S3CacheMisses++;
+
+    PROTECT(tried = allocVector(VECSXP, nclass + 1));
     for (i = 0; i < nclass; i++) {
 	const void *vmax = vmaxget();
 	const char *ss = translateChar(STRING_ELT(klass, i));
 	method = installS3Signature(generic, ss);
 	vmaxset(vmax);
+	SET_VECTOR_ELT(tried, i, method);
 	sxp = R_LookupMethod(method, rho, callrho, defrho);
 	if (isFunction(sxp)) {
 	    if(method == R_SortListSymbol && CLOENV(sxp) == R_BaseNamespace)
 		continue; /* kludge because sort.list is not a method */
+	    S3CachePut(generic, klass, callrho, defenv, tried, i + 1, sxp);
+	    UNPROTECT(1); /* tried */
 	    PROTECT(sxp);
-	    if (i > 0) {
-		SEXP dotClass = PROTECT(stringSuffix(klass, i));
-		setAttrib(dotClass, R_PreviousSymbol, klass);
-		*ans = dispatchMethod(op, sxp, dotClass, cptr, method, generic,
-				      rho, callrho, defrho);
-		UNPROTECT(1); /* dotClass */
-	    } else {
-		*ans = dispatchMethod(op, sxp, klass, cptr, method, generic,
-				      rho, callrho, defrho);
-	    }
-	    UNPROTECT(2); /* klass, sxp */
-	    return 1;
+	    goto found;
 	}
     }
     method = installS3Signature(generic, "default");
-    PROTECT(sxp = R_LookupMethod(method, rho, callrho, defrho));
-    if (isFunction(sxp)) {
+    SET_VECTOR_ELT(tried, nclass, method);
+    sxp = R_LookupMethod(method, rho, callrho, defrho);
+    if (!isFunction(sxp))
+	sxp = R_NilValue;
+    S3CachePut(generic, klass, callrho, defenv, tried, nclass + 1, sxp);
+    UNPROTECT(1); /* tried */
+    PROTECT(sxp);
+    if (sxp == R_NilValue)
+	goto none;
+
+ found:
+    if (i == nclass)
 	*ans = dispatchMethod(op, sxp, R_NilValue, cptr, method, generic,
 			      rho, callrho, defrho);
-	UNPROTECT(2); /* klass, sxp */
-	return 1;
+    else if (i > 0) {
+	SEXP dotClass = PROTECT(stringSuffix(klass, i));
+	setAttrib(dotClass, R_PreviousSymbol, klass);
+	*ans = dispatchMethod(op, sxp, dotClass, cptr, method, generic,
+			      rho, callrho, defrho);
+	UNPROTECT(1); /* dotClass */
+    } else {
+	*ans = dispatchMethod(op, sxp, klass, cptr, method, generic,
+			      rho, callrho, defrho);
     }
+    UNPROTECT(2); /* klass, sxp */
+    return 1;
+
+ none:
     UNPROTECT(2); /* klass, sxp */
     cptr->callflag = CTXT_RETURN;
     return 0;
@@ -78,6 +78,7 @@
  *	"nwarnings"
 
  *	"matprod"
+ *	"largeVectorPolicy"	./memory.c
  *      "PCRE_study"
  *      "PCRE_use_JIT"
 
@@ -273,9 +274,9 @@ void attribute_hidden InitOptions(void)
 
     /* options set here should be included into mandatory[] in do_options */
 #ifdef HAVE_RL_COMPLETION_MATCHES
-    PROTECT(v = val = allocList(23));
+    PROTECT(v = val = allocList(24));
 #else
-    PROTECT(v = val = allocList(22));
+    PROTECT(v = val = allocList(23));
 #endif
 
     SET_TAG(v, install("prompt"));
@@ -367,6 +368,12 @@ void attribute_hidden InitOptions(void)
     SETCAR(v, mkString(p));
     v = CDR(v);
 
+    p = getenv("R_LARGE_VECTOR_POLICY");
+    if (!p || !R_SetLargeVecPolicy(p)) p = "default";
+    SET_TAG(v, install("largeVectorPolicy"));
+    SETCAR(v, mkString(p));
+    v = CDR(v);
+
     SET_TAG(v, install("PCRE_study"));
     if (R_PCRE_study == -1)
 	SETCAR(v, ScalarLogical(TRUE));
@@ -520,7 +527,7 @@ SEXP attribute_hidden do_options(SEXP call, SEXP op, SEXP args, SEXP rho)
 		  "check.bounds", "keep.source", "keep.source.pkgs",
 		  "keep.parse.data", "keep.parse.data.pkgs", "warning.length",
 		  "nwarnings", "OutDec", "browserNLdisabled", "CBoundsCheck",
-		  "matprod", "PCRE_study", "PCRE_use_JIT",
+		  "matprod", "largeVectorPolicy", "PCRE_study", "PCRE_use_JIT",
 		  "PCRE_limit_recursion", "rl_word_breaks",
 		  /* ^^^ from InitOptions ^^^ */
 		  "warn", "max.print", "show.error.messages",
@@ -777,6 +784,12 @@ SEXP attribute_hidden do_options(SEXP call, SEXP op, SEXP args, SEXP rho)
 		    error(_("invalid value for '%s'"), CHAR(namei));
 		SET_VECTOR_ELT(value, i, SetOption(tag, duplicate(argi)));
 	    }
+	    else if (streql(CHAR(namei), "largeVectorPolicy")) {
+		SEXP s = asChar(argi);
+		if (s == NA_STRING || !R_SetLargeVecPolicy(CHAR(s)))
+		    error(_("invalid value for '%s'"), CHAR(namei));
+		SET_VECTOR_ELT(value, i, SetOption(tag, ScalarString(s)));
+	    }
 	    else if (streql(CHAR(namei), "PCRE_study")) {
 		if (TYPEOF(argi) == LGLSXP) {
 		    int k = asLogical(argi) > 0;
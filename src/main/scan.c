@@ -84,12 +84,17 @@ typedef struct {
     char convbuf[100];
 } LocalData;
 
-static SEXP insertString(char *str, LocalData *l)
+static cetype_t scanEncoding(LocalData *l)
 {
     cetype_t enc = CE_NATIVE;
     if (l->con->UTF8out || l->isUTF8) enc = CE_UTF8;
     else if (l->isLatin1) enc = CE_LATIN1;
-    return mkCharCE(str, enc);
+    return enc;
+}
+
+static SEXP insertString(char *str, LocalData *l)
+{
+    return mkCharCE(str, scanEncoding(l));
 }
 
 static R_INLINE Rboolean Rspace(unsigned int c)
@@ -550,6 +555,61 @@ static void extractItem(char *buffer, SEXP ans, R_xlen_t i, LocalData *d)
     }
 }
 
+/* Character items read by scanVector are collected here and entered
+   into the CHARSXP cache a batch at a time by mkCharBatch, which
+   overlaps the cache probes of neighbouring strings. */
+#define SCAN_STRING_BATCH 256
+
+typedef struct {
+    int n;			/* number of pending items */
+    R_xlen_t first;		/* index in the answer of the first */
+    size_t used, size;		/* bytes used/allocated in buf */
+    char *buf;			/* R_alloc-ed, so freed on exit */
+    size_t off[SCAN_STRING_BATCH];
+    int len[SCAN_STRING_BATCH];	/* -1 for NA */
+} StringBatch;
+
+static void flushStrings(StringBatch *sb, SEXP ans, LocalData *d)
+{
+    const char *names[SCAN_STRING_BATCH];
+
+    if (sb->n == 0) return;
+    for (int k = 0; k < sb->n; k++)
+	names[k] = sb->len[k] < 0 ? NULL : sb->buf + sb->off[k];
+    mkCharBatch(ans, sb->first, sb->n, names, sb->len, scanEncoding(d));
+    sb->n = 0;
+    sb->used = 0;
+}
+
+static void addString(StringBatch *sb, char *buffer, SEXP ans, R_xlen_t i,
+		      LocalData *d)
+{
+    if (sb->n == SCAN_STRING_BATCH) flushStrings(sb, ans, d);
+    if (sb->n == 0) sb->first = i;
+    if (isNAstring(buffer, 1, d))
+	sb->len[sb->n] = -1;
+    else {
+	size_t len = strlen(buffer);
+	if (len > INT_MAX)
+	    error(_("result would exceed 2^31-1 bytes"));
+	if (sb->used + len + 1 > sb->size) {
+	    size_t size = 2 * sb->size;
+	    char *buf;
+	    if (size < sb->used + len + 1) size = sb->used + len + 1;
+	    if (size < 8192) size = 8192;
+	    buf = R_alloc(size, sizeof(char));
+	    if (sb->used) memcpy(buf, sb->buf, sb->used);
+	    sb->buf = buf;
+	    sb->size = size;
+	}
+	memcpy(sb->buf + sb->used, buffer, len + 1);
+	sb->off[sb->n] = sb->used;
+	sb->len[sb->n] = (int) len;
+	sb->used += len + 1;
+    }
+    sb->n++;
+}
+
 static SEXP scanVector(SEXPTYPE type, R_xlen_t maxitems, R_xlen_t maxlines,
 		       int flush, SEXP stripwhite, int blskip, LocalData *d)
 {
@@ -558,6 +618,7 @@ static SEXP scanVector(SEXPTYPE type, R_xlen_t maxitems, R_xlen_t maxlines,
     R_xlen_t i, blocksize, linesread, n, nprev;
     char *buffer;
     R_StringBuffer strBuf = {NULL, 0, MAXELTSIZE};
+    StringBatch sb = {0, 0, 0, 0, NULL};
 
     if (maxitems > 0) blocksize = maxitems;
     else blocksize = SCAN_BLOCKSIZE;
@@ -589,6 +650,7 @@ static SEXP scanVector(SEXPTYPE type, R_xlen_t maxitems, R_xlen_t maxlines,
 	}
 	if (n == blocksize) {
 	    /* enlarge the vector*/
+	    if (type == STRSXP) flushStrings(&sb, ans, d);
 	    bns = ans;
 	    if(blocksize > R_XLEN_T_MAX/2) error(_("too many items"));
 	    blocksize = 2 * blocksize;
@@ -604,7 +666,10 @@ static SEXP scanVector(SEXPTYPE type, R_xlen_t maxitems, R_xlen_t maxlines,
 		break;
 	}
 	else {
-	    extractItem(buffer, ans, n, d);
+	    if (type == STRSXP)
+		addString(&sb, buffer, ans, n, d);
+	    else
+		extractItem(buffer, ans, n, d);
 	    if (++n == maxitems) {
 		if (d->ttyflag && bch != '\n') { /* MBCS-safe */
 		    while ((c = scanchar(FALSE, d)) != '\n')
@@ -618,6 +683,7 @@ static SEXP scanVector(SEXPTYPE type, R_xlen_t maxitems, R_xlen_t maxlines,
 	    bch = c;
 	}
     }
+    if (type == STRSXP) flushStrings(&sb, ans, d);
     if (!d->quiet)
 	REprintf("Read %lld item%s\n", (long long) n, (n == 1) ? "" : "s");
     if (d->ttyflag) ConsolePrompt[0] = '\0';
@@ -258,6 +258,7 @@ static void OutInteger(R_outpstream_t stream, int i)
 	stream->OutBytes(stream, buf, (int)strlen(buf));
 	break;
     case R_pstream_binary_format:
+    case R_pstream_aligned_format:
 	stream->OutBytes(stream, &i, sizeof(int));
 	break;
     case R_pstream_xdr_format:
@@ -305,6 +306,7 @@ static void OutReal(R_outpstream_t stream, double d)
 	stream->OutBytes(stream, buf, (int)strlen(buf));
 	break;
     case R_pstream_binary_format:
+    case R_pstream_aligned_format:
 	stream->OutBytes(stream, &d, sizeof(double));
 	break;
     case R_pstream_xdr_format:
@@ -333,6 +335,7 @@ static void OutByte(R_outpstream_t stream, Rbyte i)
 	break;
     case R_pstream_binary_format:
     case R_pstream_xdr_format:
+    case R_pstream_aligned_format:
 	stream->OutBytes(stream, &i, 1);
 	break;
     default:
@@ -418,6 +421,7 @@ static int InInteger(R_inpstream_t stream)
 	    if(sscanf(buf, "%d", &i) != 1) error(_("read error"));
 	return i;
     case R_pstream_binary_format:
+    case R_pstream_aligned_format:
 	stream->InBytes(stream, &i, sizeof(int));
 	return i;
     case R_pstream_xdr_format:
@@ -461,6 +465,7 @@ static double InReal(R_inpstream_t stream)
 		!= 1) error(_("read error"));
 	return d;
     case R_pstream_binary_format:
+    case R_pstream_aligned_format:
 	stream->InBytes(stream, &d, sizeof(double));
 	return d;
     case R_pstream_xdr_format:
@@ -562,8 +567,8 @@ static void InString(R_inpstream_t stream, char *buf, int length)
 /*
  * Format Header Reading and Writing
  *
- * The header starts with one of three characters, A for ascii, B for
- * binary, or X for xdr.
+ * The header starts with one of four characters, A for ascii, B for
+ * binary, X for xdr, or M for aligned binary (for memory mapping).
  */
 
 static void OutFormat(R_outpstream_t stream)
@@ -580,6 +585,7 @@ static void OutFormat(R_outpstream_t stream)
 	   way as ascii_format; the distinction is handled inside scanf %lg */
     case R_pstream_binary_format: stream->OutBytes(stream, "B\n", 2); break;
     case R_pstream_xdr_format:    stream->OutBytes(stream, "X\n", 2); break;
+    case R_pstream_aligned_format: stream->OutBytes(stream, "M\n", 2); break;
     case R_pstream_any_format:
 	error(_("must specify ascii, binary, or xdr format"));
     default: error(_("unknown output format"));
@@ -595,6 +601,7 @@ static void InFormat(R_inpstream_t stream)
     case 'A': type = R_pstream_ascii_format; break; /* also for asciihex */
     case 'B': type = R_pstream_binary_format; break;
     case 'X': type = R_pstream_xdr_format; break;
+    case 'M': type = R_pstream_aligned_format; break;
     case '\n':
 	/* GROSS HACK: ASCII unserialize may leave a trailing newline
 	   in the stream.  If the stream contains a second
@@ -883,45 +890,184 @@ static void OutStringVec(R_outpstream_t stream, SEXP s, SEXP ref_table)
 	WriteItem(STRING_ELT(s, i), ref_table, stream);
 }
 
-#include <rpc/types.h>
-#include <rpc/xdr.h>
+#include <stdint.h> /* for uint32_t, uint64_t */
 
 #define CHUNK_SIZE 8096
 
 #define min2(a, b) ((a) < (b)) ? (a) : (b)
 
+/* Atomic vectors are transferred in blocks of up to BULK_SIZE bytes
+   where no conversion is needed: each block goes directly between the
+   vector's data and the stream.  XDR is big-endian, so on little-endian
+   platforms converting to and from it is a byte swap (which compilers
+   vectorize), rather than a call to xdr_int or xdr_double per element.
+   Input is read directly into the vector and swapped in place, in
+   chunks of SWAP_SIZE bytes so that the data are still in cache. */
+#define BULK_SIZE (1 << 30)
+#define SWAP_SIZE (1 << 18)
+
+#ifndef WORDS_BIGENDIAN
+static R_INLINE uint32_t bswap_4(uint32_t x)
+{
+    return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) |
+	(x << 24);
+}
+
+static R_INLINE uint64_t bswap_8(uint64_t x)
+{
+    return ((uint64_t) bswap_4((uint32_t) x) << 32) |
+	bswap_4((uint32_t) (x >> 32));
+}
+
+static void swap_copy_4(void *dest, const void *src, R_xlen_t n)
+{
+    uint32_t *d = dest, x;
+    const char *s = src;
+    for (R_xlen_t i = 0; i < n; i++) {
+	memcpy(&x, s + 4 * i, 4);
+	d[i] = bswap_4(x);
+    }
+}
+
+static void swap_copy_8(void *dest, const void *src, R_xlen_t n)
+{
+    uint64_t *d = dest, x;
+    const char *s = src;
+    for (R_xlen_t i = 0; i < n; i++) {
+	memcpy(&x, s + 8 * i, 8);
+	d[i] = bswap_8(x);
+    }
+}
+#endif
+
+/* transfer 'n' elements of size 'size' */
+static void OutBulk(R_outpstream_t stream, void *data, int size, R_xlen_t n)
+{
+    char *p = data;
+    R_xlen_t done, this, chunk = BULK_SIZE / size;
+    for (done = 0; done < n; done += this) {
+	this = min2(chunk, n - done);
+	stream->OutBytes(stream, p + done * size, (int)(size * this));
+    }
+}
+
+static void InBulk(R_inpstream_t stream, void *data, int size, R_xlen_t n)
+{
+    char *p = data;
+    R_xlen_t done, this, chunk = BULK_SIZE / size;
+    for (done = 0; done < n; done += this) {
+	this = min2(chunk, n - done);
+	stream->InBytes(stream, p + done * size, (int)(size * this));
+    }
+}
+
+/* transfer 'n' elements of size 4 or 8 in XDR format */
+static void OutBulkXDR(R_outpstream_t stream, void *data, int size,
+		       R_xlen_t n)
+{
+#ifdef WORDS_BIGENDIAN
+    OutBulk(stream, data, size, n);
+#else
+    static char buf[CHUNK_SIZE * sizeof(double)];
+    char *p = data;
+    R_xlen_t done, this, chunk = sizeof(buf) / size;
+    for (done = 0; done < n; done += this) {
+	this = min2(chunk, n - done);
+	if (size == 4) swap_copy_4(buf, p + done * size, this);
+	else swap_copy_8(buf, p + done * size, this);
+	stream->OutBytes(stream, buf, (int)(size * this));
+    }
+#endif
+}
+
+static void InBulkXDR(R_inpstream_t stream, void *data, int size,
+		      R_xlen_t n)
+{
+#ifdef WORDS_BIGENDIAN
+    InBulk(stream, data, size, n);
+#else
+    char *p = data;
+    R_xlen_t done, this, chunk = SWAP_SIZE / size;
+    for (done = 0; done < n; done += this) {
+	this = min2(chunk, n - done);
+	char *q = p + done * size;
+	stream->InBytes(stream, q, (int)(size * this));
+	if (size == 4) swap_copy_4(q, q, this);
+	else swap_copy_8(q, q, this);
+    }
+#endif
+}
+
+/* The aligned format is the binary format with the data of integer,
+   logical, double and complex vectors starting at a multiple of 8 bytes
+   from the start of the serialization, so that they can be used in
+   place when the serialization is memory-mapped.  R_Serialize and
+   R_Unserialize wrap the stream to count the bytes transferred. */
+typedef struct alignstream_st {
+    R_outpstream_t out;
+    R_inpstream_t in;
+    size_t pos;
+} *alignstream_t;
+
+static void OutBytesAlign(R_outpstream_t stream, void *buf, int length)
+{
+    alignstream_t as = stream->data;
+    as->out->OutBytes(as->out, buf, length);
+    as->pos += length;
+}
+
+static void OutCharAlign(R_outpstream_t stream, int c)
+{
+    alignstream_t as = stream->data;
+    as->out->OutChar(as->out, c);
+    as->pos++;
+}
+
+static void InBytesAlign(R_inpstream_t stream, void *buf, int length)
+{
+    alignstream_t as = stream->data;
+    as->in->InBytes(as->in, buf, length);
+    as->pos += length;
+}
+
+static int InCharAlign(R_inpstream_t stream)
+{
+    alignstream_t as = stream->data;
+    as->pos++;
+    return as->in->InChar(as->in);
+}
+
+static void OutAlign(R_outpstream_t stream)
+{
+    static char zeros[8];
+    alignstream_t as = stream->data;
+    int pad = (int) ((8 - as->pos % 8) % 8);
+    if (pad) stream->OutBytes(stream, zeros, pad);
+}
+
+static void InAlign(R_inpstream_t stream)
+{
+    char buf[8];
+    alignstream_t as = stream->data;
+    int pad = (int) ((8 - as->pos % 8) % 8);
+    if (pad) stream->InBytes(stream, buf, pad);
+}
+
+static SEXP InMmapView(R_inpstream_t stream, SEXPTYPE type, R_xlen_t len);
 
 static R_INLINE void
 OutIntegerVec(R_outpstream_t stream, SEXP s, R_xlen_t length)
 {
     switch (stream->type) {
     case R_pstream_xdr_format:
-    {
-	static char buf[CHUNK_SIZE * sizeof(int)];
-	R_xlen_t done, this;
-	XDR xdrs;
-	for (done = 0; done < length; done += this) {
-	    this = min2(CHUNK_SIZE, length - done);
-	    xdrmem_create(&xdrs, buf, (int)(this * sizeof(int)), XDR_ENCODE);
-	    for(int cnt = 0; cnt < this; cnt++)
-		if(!xdr_int(&xdrs, INTEGER(s) + done + cnt))
-		    error(_("XDR write failed"));
-	    xdr_destroy(&xdrs);
-	    stream->OutBytes(stream, buf, (int)(sizeof(int) * this));
-	}
+	OutBulkXDR(stream, INTEGER(s), sizeof(int), length);
 	break;
-    }
+    case R_pstream_aligned_format:
+	OutAlign(stream);
+	/* fall through */
     case R_pstream_binary_format:
-    {
-	/* write in chunks to avoid overflowing ints */
-	R_xlen_t done, this;
-	for (done = 0; done < length; done += this) {
-	    this = min2(CHUNK_SIZE, length - done);
-	    stream->OutBytes(stream, INTEGER(s) + done,
-			     (int)(sizeof(int) * this));
-	}
+	OutBulk(stream, INTEGER(s), sizeof(int), length);
 	break;
-    }
     default:
 	for (R_xlen_t cnt = 0; cnt < length; cnt++)
 	    OutInteger(stream, INTEGER(s)[cnt]);
@@ -933,31 +1079,14 @@ OutRealVec(R_outpstream_t stream, SEXP s, R_xlen_t length)
 {
     switch (stream->type) {
     case R_pstream_xdr_format:
-    {
-	static char buf[CHUNK_SIZE * sizeof(double)];
-	R_xlen_t done, this;
-	XDR xdrs;
-	for (done = 0; done < length; done += this) {
-	    this = min2(CHUNK_SIZE, length - done);
-	    xdrmem_create(&xdrs, buf, (int)(this * sizeof(double)), XDR_ENCODE);
-	    for(int cnt = 0; cnt < this; cnt++)
-		if(!xdr_double(&xdrs, REAL(s) + done + cnt))
-		    error(_("XDR write failed"));
-	    xdr_destroy(&xdrs);
-	    stream->OutBytes(stream, buf, (int)(sizeof(double) * this));
-	}
+	OutBulkXDR(stream, REAL(s), sizeof(double), length);
 	break;
-    }
+    case R_pstream_aligned_format:
+	OutAlign(stream);
+	/* fall through */
     case R_pstream_binary_format:
-    {
-	R_xlen_t done, this;
-	for (done = 0; done < length; done += this) {
-	    this = min2(CHUNK_SIZE, length - done);
-	    stream->OutBytes(stream, REAL(s) + done,
-			     (int)(sizeof(double) * this));
-	}
+	OutBulk(stream, REAL(s), sizeof(double), length);
 	break;
-    }
     default:
 	for (R_xlen_t cnt = 0; cnt < length; cnt++)
 	    OutReal(stream, REAL(s)[cnt]);
@@ -969,34 +1098,15 @@ OutComplexVec(R_outpstream_t stream, SEXP s, R_xlen_t length)
 {
     switch (stream->type) {
     case R_pstream_xdr_format:
-    {
-	static char buf[CHUNK_SIZE * sizeof(Rcomplex)];
-	R_xlen_t done, this;
-	XDR xdrs;
-	Rcomplex *c = COMPLEX(s);
-	for (done = 0; done < length; done += this) {
-	    this = min2(CHUNK_SIZE, length - done);
-	    xdrmem_create(&xdrs, buf, (int)(this * sizeof(Rcomplex)), XDR_ENCODE);
-	    for(int cnt = 0; cnt < this; cnt++) {
-		if(!xdr_double(&xdrs, &(c[done+cnt].r)) ||
-		   !xdr_double(&xdrs, &(c[done+cnt].i)))
-		    error(_("XDR write failed"));
-	    }
-	    stream->OutBytes(stream, buf, (int)(sizeof(Rcomplex) * this));
-	    xdr_destroy(&xdrs);
-	}
+	/* the real and imaginary parts are XDR doubles */
+	OutBulkXDR(stream, COMPLEX(s), sizeof(double), 2 * length);
 	break;
-    }
+    case R_pstream_aligned_format:
+	OutAlign(stream);
+	/* fall through */
     case R_pstream_binary_format:
-    {
-	R_xlen_t done, this;
-	for (done = 0; done < length; done += this) {
-	    this = min2(CHUNK_SIZE, length - done);
-	    stream->OutBytes(stream, COMPLEX(s) + done,
-			     (int)(sizeof(Rcomplex) * this));
-	}
+	OutBulk(stream, COMPLEX(s), sizeof(Rcomplex), length);
 	break;
-    }
     default:
 	for (R_xlen_t cnt = 0; cnt < length; cnt++)
 	    OutComplex(stream, COMPLEX(s)[cnt]);
@@ -1195,14 +1305,9 @@ static void WriteItem (SEXP s, SEXP ref_table, R_outpstream_t stream)
 	    switch (stream->type) {
 	    case R_pstream_xdr_format:
 	    case R_pstream_binary_format:
-	    {
-		R_xlen_t done, this;
-		for (done = 0; done < len; done += this) {
-		    this = min2(CHUNK_SIZE, len - done);
-		    stream->OutBytes(stream, RAW(s) + done, (int) this);
-		}
+	    case R_pstream_aligned_format:
+		OutBulk(stream, RAW(s), 1, len);
 		break;
-	    }
 	    default:
 		for (R_xlen_t ix = 0; ix < len; ix++)
 		    OutByte(stream, RAW(s)[ix]);
@@ -1378,6 +1483,18 @@ void R_Serialize(SEXP s, R_outpstream_t stream)
 {
     SEXP ref_table;
     int version = stream->version;
+    struct alignstream_st as;
+    struct R_outpstream_st astream;
+
+    if (stream->type == R_pstream_aligned_format) {
+	as.out = stream;
+	as.pos = 0;
+	astream = *stream;
+	astream.data = &as;
+	astream.OutBytes = OutBytesAlign;
+	astream.OutChar = OutCharAlign;
+	stream = &astream;
+    }
 
     OutFormat(stream);
 
@@ -1472,37 +1589,19 @@ static SEXP InStringVec(R_inpstream_t stream, SEXP ref_table)
     return s;
 }
 
-/* use static buffer to reuse storage */
 static R_INLINE void
 InIntegerVec(R_inpstream_t stream, SEXP obj, R_xlen_t length)
 {
     switch (stream->type) {
     case R_pstream_xdr_format:
-    {
-	static char buf[CHUNK_SIZE * sizeof(int)];
-	R_xlen_t done, this;
-	XDR xdrs;
-	for (done = 0; done < length; done += this) {
-	    this = min2(CHUNK_SIZE, length - done);
-	    stream->InBytes(stream, buf, (int)(sizeof(int) * this));
-	    xdrmem_create(&xdrs, buf, (int)(this * sizeof(int)), XDR_DECODE);
-	    for(int cnt = 0; cnt < this; cnt++)
-		if(!xdr_int(&xdrs, INTEGER(obj) + done + cnt))
-		    error(_("XDR read failed"));
-	    xdr_destroy(&xdrs);
-	}
+	InBulkXDR(stream, INTEGER(obj), sizeof(int), length);
 	break;
-    }
+    case R_pstream_aligned_format:
+	InAlign(stream);
+	/* fall through */
     case R_pstream_binary_format:
-    {
-	R_xlen_t done, this;
-	for (done = 0; done < length; done += this) {
-	    this = min2(CHUNK_SIZE, length - done);
-	    stream->InBytes(stream, INTEGER(obj) + done,
-			    (int)(sizeof(int) * this));
-	}
+	InBulk(stream, INTEGER(obj), sizeof(int), length);
 	break;
-    }
     default:
 	for (R_xlen_t cnt = 0; cnt < length; cnt++)
 	    INTEGER(obj)[cnt] = InInteger(stream);
@@ -1514,31 +1613,14 @@ InRealVec(R_inpstream_t stream, SEXP obj, R_xlen_t length)
 {
     switch (stream->type) {
     case R_pstream_xdr_format:
-    {
-	static char buf[CHUNK_SIZE * sizeof(double)];
-	R_xlen_t done, this;
-	XDR xdrs;
-	for (done = 0; done < length; done += this) {
-	    this = min2(CHUNK_SIZE, length - done);
-	    stream->InBytes(stream, buf, (int)(sizeof(double) * this));
-	    xdrmem_create(&xdrs, buf, (int)(this * sizeof(double)), XDR_DECODE);
-	    for(R_xlen_t cnt = 0; cnt < this; cnt++)
-		if(!xdr_double(&xdrs, REAL(obj) + done + cnt))
-		    error(_("XDR read failed"));
-	    xdr_destroy(&xdrs);
-	}
+	InBulkXDR(stream, REAL(obj), sizeof(double), length);
 	break;
-    }
+    case R_pstream_aligned_format:
+	InAlign(stream);
+	/* fall through */
     case R_pstream_binary_format:
-    {
-	R_xlen_t done, this;
-	for (done = 0; done < length; done += this) {
-	    this = min2(CHUNK_SIZE, length - done);
-	    stream->InBytes(stream, REAL(obj) + done,
-			    (int)(sizeof(double) * this));
-	}
+	InBulk(stream, REAL(obj), sizeof(double), length);
 	break;
-    }
     default:
 	for (R_xlen_t cnt = 0; cnt < length; cnt++)
 	    REAL(obj)[cnt] = InReal(stream);
@@ -1550,34 +1632,14 @@ InComplexVec(R_inpstream_t stream, SEXP obj, R_xlen_t length)
 {
     switch (stream->type) {
     case R_pstream_xdr_format:
-    {
-	static char buf[CHUNK_SIZE * sizeof(Rcomplex)];
-	R_xlen_t done, this;
-	XDR xdrs;
-	Rcomplex *output = COMPLEX(obj);
-	for (done = 0; done < length; done += this) {
-	    this = min2(CHUNK_SIZE, length - done);
-	    stream->InBytes(stream, buf, (int)(sizeof(Rcomplex) * this));
-	    xdrmem_create(&xdrs, buf, (int)(this * sizeof(Rcomplex)), XDR_DECODE);
-	    for(R_xlen_t cnt = 0; cnt < this; cnt++) {
-		if(!xdr_double(&xdrs, &(output[done+cnt].r)) ||
-		   !xdr_double(&xdrs, &(output[done+cnt].i)))
-		    error(_("XDR read failed"));
-	    }
-	    xdr_destroy(&xdrs);
-	}
+	InBulkXDR(stream, COMPLEX(obj), sizeof(double), 2 * length);
 	break;
-    }
+    case R_pstream_aligned_format:
+	InAlign(stream);
+	/* fall through */
     case R_pstream_binary_format:
-    {
-	R_xlen_t done, this;
-	for (done = 0; done < length; done += this) {
-	    this = min2(CHUNK_SIZE, length - done);
-	    stream->InBytes(stream, COMPLEX(obj) + done,
-			    (int)(sizeof(Rcomplex) * this));
-	}
+	InBulk(stream, COMPLEX(obj), sizeof(Rcomplex), length);
 	break;
-    }
     default:
 	for (R_xlen_t cnt = 0; cnt < length; cnt++)
 	    COMPLEX(obj)[cnt] = InComplex(stream);
@@ -1752,16 +1814,15 @@ static SEXP R_FindNamespace1(SEXP info)
 }
 
 
-static SEXP ReadItem (SEXP ref_table, R_inpstream_t stream)
+static SEXP ReadItemFlags(int flags, SEXP ref_table, R_inpstream_t stream)
 {
     SEXPTYPE type;
     SEXP s;
     R_xlen_t len, count;
-    int flags, levs, objf, hasattr, hastag, length;
+    int levs, objf, hasattr, hastag, length;
 
     R_assert(TYPEOF(ref_table) == LISTSXP && TYPEOF(CAR(ref_table)) == VECSXP);
 
-    flags = InInteger(stream);
     UnpackFlags(flags, &type, &levs, &objf, &hasattr, &hastag);
 
     switch(type) {
@@ -1930,13 +1991,21 @@ static SEXP ReadItem (SEXP ref_table, R_inpstream_t stream)
 	case LGLSXP:
 	case INTSXP:
 	    len = ReadLENGTH(stream);
-	    PROTECT(s = allocVector(type, len));
-	    InIntegerVec(stream, s, len);
+	    if ((s = InMmapView(stream, type, len)) != R_NilValue)
+		PROTECT(s);
+	    else {
+		PROTECT(s = allocVector(type, len));
+		InIntegerVec(stream, s, len);
+	    }
 	    break;
 	case REALSXP:
 	    len = ReadLENGTH(stream);
-	    PROTECT(s = allocVector(type, len));
-	    InRealVec(stream, s, len);
+	    if ((s = InMmapView(stream, type, len)) != R_NilValue)
+		PROTECT(s);
+	    else {
+		PROTECT(s = allocVector(type, len));
+		InRealVec(stream, s, len);
+	    }
 	    break;
 	case CPLXSXP:
 	    len = ReadLENGTH(stream);
@@ -1984,13 +2053,7 @@ static SEXP ReadItem (SEXP ref_table, R_inpstream_t stream)
 		}
 		break;
 	    default:
-	    {
-		R_xlen_t done, this;
-		for (done = 0; done < len; done += this) {
-		    this = min2(CHUNK_SIZE, len - done);
-		    stream->InBytes(stream, RAW(s) + done, (int) this);
-		}
-	    }
+		InBulk(stream, RAW(s), 1, len);
 	    }
 	    break;
 	case S4SXP:
@@ -2025,6 +2088,54 @@ static SEXP ReadItem (SEXP ref_table, R_inpstream_t stream)
     }
 }
 
+static SEXP ReadItem (SEXP ref_table, R_inpstream_t stream)
+{
+    return ReadItemFlags(InInteger(stream), ref_table, stream);
+}
+
+/* Reads the top level object for R_UnserializeEach.  The elements of
+   a list (or expression vector) are passed to 'fun' as soon as each is
+   read, and only the values it returns are kept, in a list with the
+   names of the serialized one.  Other objects are passed to 'fun'
+   whole, and its value is returned in a list of length one. */
+static SEXP ReadItemEach(SEXP ref_table, R_inpstream_t stream,
+			 SEXP (*fun)(SEXP, R_xlen_t, void *), void *data)
+{
+    SEXPTYPE type;
+    SEXP s, ans;
+    R_xlen_t len, count;
+    int flags, levs, objf, hasattr, hastag;
+
+    flags = InInteger(stream);
+    UnpackFlags(flags, &type, &levs, &objf, &hasattr, &hastag);
+    if (type != VECSXP && type != EXPRSXP) {
+	PROTECT(s = ReadItemFlags(flags, ref_table, stream));
+	PROTECT(ans = allocVector(VECSXP, 1));
+	SET_VECTOR_ELT(ans, 0, fun(s, 0, data));
+	UNPROTECT(2);
+	return ans;
+    }
+
+    len = ReadLENGTH(stream);
+    PROTECT(ans = allocVector(VECSXP, len));
+    R_ReadItemDepth++;
+    for (count = 0; count < len; ++count) {
+	PROTECT(s = ReadItem(ref_table, stream));
+	SET_VECTOR_ELT(ans, count, fun(s, count, data));
+	UNPROTECT(1);
+    }
+    if (hasattr) {
+	SEXP attr = PROTECT(ReadItem(ref_table, stream));
+	for (s = attr; s != R_NilValue; s = CDR(s))
+	    if (TAG(s) == R_NamesSymbol)
+		setAttrib(ans, R_NamesSymbol, CAR(s));
+	UNPROTECT(1); /* attr */
+    }
+    R_ReadItemDepth--;
+    UNPROTECT(1); /* ans */
+    return ans;
+}
+
 static SEXP ReadBC1(SEXP ref_table, SEXP reps, R_inpstream_t stream);
 
 static SEXP ReadBCLang(int type, SEXP ref_table, SEXP reps,
@@ -2139,13 +2250,25 @@ static void DecodeVersion(int packed, int *v, int *p, int *s)
     *s = packed;
 }
 
-SEXP R_Unserialize(R_inpstream_t stream)
+static SEXP Unserialize(R_inpstream_t stream,
+			SEXP (*fun)(SEXP, R_xlen_t, void *), void *data)
 {
     int version;
     int writer_version, min_reader_version;
     SEXP obj, ref_table;
+    struct alignstream_st as;
+    struct R_inpstream_st astream;
 
     InFormat(stream);
+    if (stream->type == R_pstream_aligned_format) {
+	as.in = stream;
+	as.pos = 2; /* the format header */
+	astream = *stream;
+	astream.data = &as;
+	astream.InBytes = InBytesAlign;
+	astream.InChar = InCharAlign;
+	stream = &astream;
+    }
 
     /* Read the version numbers */
     version = InInteger(stream);
@@ -2179,7 +2302,8 @@ SEXP R_Unserialize(R_inpstream_t stream)
 
     /* Read the actual object back */
     PROTECT(ref_table = MakeReadRefTable());
-    obj =  ReadItem(ref_table, stream);
+    obj = fun ? ReadItemEach(ref_table, stream, fun, data) :
+	ReadItem(ref_table, stream);
 
     if (version == 3) {
 	if (stream->nat2nat_obj && stream->nat2nat_obj != (void *)-1) {
@@ -2196,6 +2320,21 @@ SEXP R_Unserialize(R_inpstream_t stream)
     return obj;
 }
 
+SEXP R_Unserialize(R_inpstream_t stream)
+{
+    return Unserialize(stream, NULL, NULL);
+}
+
+/* Incremental unserialization: see ReadItemEach.  Only the elements
+   read so far and the references they contain are kept in memory, so
+   a large list can be processed with the memory for its largest
+   element. */
+SEXP R_UnserializeEach(R_inpstream_t stream,
+		       SEXP (*fun)(SEXP, R_xlen_t, void *), void *data)
+{
+    return Unserialize(stream, fun, data);
+}
+
 SEXP R_SerializeInfo(R_inpstream_t stream)
 {
     int version;
@@ -2241,6 +2380,9 @@ SEXP R_SerializeInfo(R_inpstream_t stream)
     case R_pstream_xdr_format:
 	SET_VECTOR_ELT(ans, 3, mkString("xdr"));
 	break;
+    case R_pstream_aligned_format:
+	SET_VECTOR_ELT(ans, 3, mkString("aligned"));
+	break;
     default:
 	error(_("unknown input format"));
     }
@@ -2611,6 +2753,143 @@ do_unserializeFromConn(SEXP call, SEXP op, SEXP args, SEXP env)
     return ans;
 }
 
+/*
+ * Streams on compressed files coded by several threads
+ */
+
+static void OutBytesMtz(R_outpstream_t stream, void *buf, int length)
+{
+    R_mtz_write((Rmtzfile) stream->data, buf, length);
+}
+
+static void OutCharMtz(R_outpstream_t stream, int c)
+{
+    char buf[1];
+    buf[0] = (char) c;
+    R_mtz_write((Rmtzfile) stream->data, buf, 1);
+}
+
+static void InBytesMtz(R_inpstream_t stream, void *buf, int length)
+{
+    if (R_mtz_read((Rmtzfile) stream->data, buf, length) != length)
+	error(_("error reading from connection"));
+}
+
+static int InCharMtz(R_inpstream_t stream)
+{
+    char buf[1];
+    InBytesMtz(stream, buf, 1);
+    return buf[0];
+}
+
+static void mtz_cleanup(void *data)
+{
+    R_mtz_free((Rmtzfile) data);
+}
+
+static int asThreads(SEXP s)
+{
+    int threads = asInteger(s);
+    if (threads == NA_INTEGER || threads < 1)
+	error(_("invalid '%s' argument"), "threads");
+    return threads;
+}
+
+/* Used from saveRDS(threads = ) for gzip and xz compression */
+SEXP attribute_hidden
+do_serializeToFile(SEXP call, SEXP op, SEXP args, SEXP env)
+{
+    /* serializeToFile(object, file, type, version, hook, threads) */
+
+    SEXP object, file, fun;
+    int type, version, threads;
+    Rmtzfile z;
+    struct R_outpstream_st out;
+    SEXP (*hook)(SEXP, SEXP);
+    RCNTXT cntxt;
+
+    checkArity(op, args);
+    object = CAR(args); args = CDR(args);
+    file = CAR(args); args = CDR(args);
+    if (!isString(file) || LENGTH(file) != 1 ||
+	STRING_ELT(file, 0) == NA_STRING)
+	error(_("invalid '%s' argument"), "file");
+    type = asInteger(CAR(args)); args = CDR(args);
+    if (type != 1 && type != 3)
+	error(_("invalid '%s' argument"), "compress");
+    if (CAR(args) == R_NilValue)
+	version = defaultSerializeVersion();
+    else
+	version = asInteger(CAR(args));
+    if (version == NA_INTEGER || version <= 0)
+	error(_("bad version value"));
+    if (version < 2)
+	error(_("cannot save to connections in version %d format"), version);
+    args = CDR(args);
+    fun = CAR(args);
+    hook = fun != R_NilValue ? CallHook : NULL;
+    threads = asThreads(CADR(args));
+
+    z = R_mtz_open(translateCharFP(STRING_ELT(file, 0)), TRUE, type, 6,
+		   threads);
+    begincontext(&cntxt, CTXT_CCODE, R_NilValue, R_BaseEnv, R_BaseEnv,
+		 R_NilValue, R_NilValue);
+    cntxt.cend = &mtz_cleanup;
+    cntxt.cenddata = z;
+    R_InitOutPStream(&out, (R_pstream_data_t) z, R_pstream_xdr_format,
+		     version, OutCharMtz, OutBytesMtz, hook, fun);
+    R_Serialize(object, &out);
+    R_mtz_finish(z);
+    endcontext(&cntxt);
+    R_mtz_free(z);
+
+    return R_NilValue;
+}
+
+static SEXP UnserializeMmap(SEXP file, SEXP (*hook)(SEXP, SEXP), SEXP fun);
+
+/* Used from readRDS(threads = , mmap = ) */
+SEXP attribute_hidden
+do_unserializeFromFile(SEXP call, SEXP op, SEXP args, SEXP env)
+{
+    /* unserializeFromFile(file, hook, threads, mmap) */
+
+    SEXP file, fun, ans;
+    Rmtzfile z;
+    struct R_inpstream_st in;
+    SEXP (*hook)(SEXP, SEXP);
+    RCNTXT cntxt;
+
+    checkArity(op, args);
+    file = CAR(args);
+    if (!isString(file) || LENGTH(file) != 1 ||
+	STRING_ELT(file, 0) == NA_STRING)
+	error(_("invalid '%s' argument"), "file");
+    fun = CADR(args);
+    hook = fun != R_NilValue ? CallHook : NULL;
+
+    if (asLogical(CADDDR(args)) == TRUE) {
+	/* uncompressed files are read from a mapping, others as usual */
+	ans = UnserializeMmap(file, hook, fun);
+	if (ans != R_UnboundValue)
+	    return ans;
+    }
+
+    z = R_mtz_open(translateCharFP(STRING_ELT(file, 0)), FALSE, 0, 0,
+		   asThreads(CADDR(args)));
+    begincontext(&cntxt, CTXT_CCODE, R_NilValue, R_BaseEnv, R_BaseEnv,
+		 R_NilValue, R_NilValue);
+    cntxt.cend = &mtz_cleanup;
+    cntxt.cenddata = z;
+    R_InitInPStream(&in, (R_pstream_data_t) z, R_pstream_any_format,
+		    InCharMtz, InBytesMtz, hook, fun);
+    PROTECT(ans = R_Unserialize(&in));
+    endcontext(&cntxt);
+    R_mtz_free(z);
+    UNPROTECT(1);
+    return ans;
+}
+
 /*
  * Persistent Buffered Binary Connection Streams
  */
@@ -2779,6 +3058,74 @@ static void InitMemInPStream(R_inpstream_t stream, membuf_t mb,
 		    InCharMem, InBytesMem, phook, pdata);
 }
 
+/* Streams on a file memory-mapped by readRDS(mmap = TRUE).  In the
+   aligned format, integer and double vectors of at least MMAP_VIEW_MIN
+   bytes are not copied but returned as ALTREP views into the mapping,
+   so processes mapping the same file share the memory holding them. */
+#define MMAP_VIEW_MIN 4096
+
+SEXP R_mmap_file_map(SEXP file, void **addr, size_t *size);
+SEXP R_mmap_view(SEXP map, size_t offset, int type, R_xlen_t length);
+
+typedef struct mmapbuf_st {
+    struct membuf_st mb;	/* first, for InBytesMem and InCharMem */
+    SEXP map;			/* external pointer to the mapping */
+} *mmapbuf_t;
+
+static int InCharMmap(R_inpstream_t stream)
+{
+    return InCharMem(stream);
+}
+
+static void InBytesMmap(R_inpstream_t stream, void *buf, int length)
+{
+    InBytesMem(stream, buf, length);
+}
+
+static SEXP InMmapView(R_inpstream_t stream, SEXPTYPE type, R_xlen_t len)
+{
+    if (stream->type != R_pstream_aligned_format ||
+	(type != INTSXP && type != REALSXP))
+	return R_NilValue;
+    alignstream_t as = stream->data;
+    if (as->in->InBytes != InBytesMmap)
+	return R_NilValue;
+    mmapbuf_t mb = as->in->data;
+    size_t size = len * (type == INTSXP ? sizeof(int) : sizeof(double));
+    if (size < MMAP_VIEW_MIN)
+	return R_NilValue;
+    InAlign(stream);
+    if (size > mb->mb.size - mb->mb.count)
+	error(_("read error"));
+    SEXP val = R_mmap_view(mb->map, mb->mb.count, type, len);
+    mb->mb.count += size;
+    as->pos += size;
+    return val;
+}
+
+/* Returns R_UnboundValue if the file is not an uncompressed
+   serialization. */
+static SEXP UnserializeMmap(SEXP file, SEXP (*hook)(SEXP, SEXP), SEXP fun)
+{
+    struct R_inpstream_st in;
+    struct mmapbuf_st mbs;
+    void *addr;
+    size_t size;
+    SEXP ans = R_UnboundValue;
+
+    mbs.map = PROTECT(R_mmap_file_map(file, &addr, &size));
+    const char *p = addr;
+    if (size > 2 && p[1] == '\n' &&
+	(p[0] == 'A' || p[0] == 'B' || p[0] == 'M' || p[0] == 'X')) {
+	InitMemInPStream(&in, &mbs.mb, addr, size, hook, fun);
+	in.InChar = InCharMmap;
+	in.InBytes = InBytesMmap;
+	ans = R_Unserialize(&in);
+    }
+    UNPROTECT(1);
+    return ans;
+}
+
 static void InitMemOutPStream(R_outpstream_t stream, membuf_t mb,
 			      R_pstream_format_t type, int version,
 			      SEXP (*phook)(SEXP, SEXP), SEXP pdata)
@@ -2838,6 +3185,7 @@ R_serialize(SEXP object, SEXP icon, SEXP ascii, SEXP Sversion, SEXP fun)
     case 1: type = R_pstream_ascii_format; break;
     case 2: type = R_pstream_asciihex_format; break;
     case 3: type = R_pstream_binary_format; break;
+    case 4: type = R_pstream_aligned_format; break;
     default: type = R_pstream_xdr_format; break;
     }
 
@@ -2873,6 +3221,43 @@ R_serialize(SEXP object, SEXP icon, SEXP ascii, SEXP Sversion, SEXP fun)
 }
 
 
+/* The callback of unserialize(FUN = ) and readRDS(FUN = ) */
+struct eachfun_st {
+    SEXP call;
+    SEXP rho;
+};
+
+static SEXP CallEachFun(SEXP x, R_xlen_t i, void *data)
+{
+    struct eachfun_st *ef = data;
+    SETCADR(ef->call, R_mkEVPROMISE(x, x));
+    return eval(ef->call, ef->rho);
+}
+
+static SEXP R_unserializeEach(SEXP icon, SEXP fun, SEXP efun, SEXP rho)
+{
+    struct R_inpstream_st in;
+    struct membuf_st mbs;
+    struct eachfun_st ef;
+    SEXP (*hook)(SEXP, SEXP);
+    SEXP ans;
+
+    if (!isFunction(efun))
+	error(_("'%s' is not a function"), "FUN");
+    hook = fun != R_NilValue ? CallHook : NULL;
+    if (TYPEOF(icon) == RAWSXP)
+	InitMemInPStream(&in, &mbs, RAW(icon), XLENGTH(icon), hook, fun);
+    else {
+	Rconnection con = getConnection(asInteger(icon));
+	R_InitConnInPStream(&in, con, R_pstream_any_format, hook, fun);
+    }
+    PROTECT(ef.call = lang2(efun, R_NilValue));
+    ef.rho = rho;
+    ans = R_UnserializeEach(&in, CallEachFun, &ef);
+    UNPROTECT(1);
+    return ans;
+}
+
 SEXP attribute_hidden R_unserialize(SEXP icon, SEXP fun)
 {
     struct R_inpstream_st in;
@@ -2958,12 +3343,214 @@ static SEXP appendRawToFile(SEXP file, SEXP bytes)
     return val;
 }
 
-/* Interface to cache the pkg.rdb files */
+/* Interface to cache the pkg.rdb files.
+
+   Where mmap is available a database is mapped into memory when it is
+   first used and entries are decompressed and unserialized directly
+   from the mapping.  Otherwise files smaller than LEN_LIMIT are read
+   into a malloc-ed buffer, and larger ones are read an entry at a time.
+
+   A mapped file stays valid if the database is replaced by a new file
+   (as on package installation), but not if it is rewritten in place:
+   so the file is checked on each fetch and an error signalled if it
+   has changed.
+
+   With threads, setting the environment variable R_LAZYLOAD_PREFETCH
+   to a positive integer makes lazyLoadDBexec start a thread that
+   decompresses all the entries of a database (up to PREFETCH_LIMIT
+   bytes) in advance, so that only the unserialization is left to the
+   main thread when the promises are forced. */
+
+#if defined(HAVE_MMAP) && !defined(Win32)
+# define LAZYDB_MMAP
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+#if defined(LAZYDB_MMAP) && defined(HAVE_PTHREAD)
+# define LAZYDB_PREFETCH
+# include <pthread.h>
+# define PREFETCH_LIMIT 64*1048576
+
+enum { PF_PENDING, PF_BUSY, PF_DONE, PF_FAILED, PF_TAKEN };
+
+typedef struct {
+    int offset, len;		/* key of the entry */
+    int state;
+    unsigned int dlen;
+    unsigned char *data;	/* decompressed entry when PF_DONE */
+} pfentry_t;
+#endif
+
+typedef struct {
+    char name[PATH_MAX];	/* "" for a vacant slot */
+    char *ptr;			/* contents of the file */
+    size_t size;
+#ifdef LAZYDB_MMAP
+    Rboolean mapped;
+    struct stat st;		/* of the file when mapped */
+#endif
+#ifdef LAZYDB_PREFETCH
+    pfentry_t *entries;		/* sorted by offset, or NULL */
+    int nentries, next, compressed;
+    Rboolean joinable, stop;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+} lazydb_t;
 
 #define NC 100
 static int used = 0;
-static char names[NC][PATH_MAX];
-static char *ptr[NC];
+static lazydb_t lazydbs[NC];
+
+/* from connections.c */
+unsigned int R_decompressed_length(const unsigned char *in);
+Rboolean R_decompress_buffer(int type, const unsigned char *in, size_t inlen,
+			     unsigned char *out);
+
+#ifdef LAZYDB_PREFETCH
+static void *lazydb_prefetch_thread(void *arg)
+{
+    lazydb_t *db = arg;
+    size_t total = 0;
+
+    pthread_mutex_lock(&db->mutex);
+    while (! db->stop && db->next < db->nentries) {
+	pfentry_t *e = db->entries + db->next++;
+	if (e->state != PF_PENDING)
+	    continue;
+	unsigned char *in = (unsigned char *) db->ptr + e->offset;
+	unsigned int dlen = R_decompressed_length(in);
+	if (total + dlen > PREFETCH_LIMIT)
+	    break;
+	e->state = PF_BUSY;
+	pthread_mutex_unlock(&db->mutex);
+
+	unsigned char *data = malloc(dlen ? dlen : 1);
+	Rboolean ok = data != NULL &&
+	    R_decompress_buffer(db->compressed, in, e->len, data);
+
+	pthread_mutex_lock(&db->mutex);
+	if (ok) {
+	    e->data = data;
+	    e->dlen = dlen;
+	    e->state = PF_DONE;
+	    total += dlen;
+	}
+	else {
+	    free(data);
+	    e->state = PF_FAILED;
+	}
+	pthread_cond_broadcast(&db->cond);
+    }
+    pthread_mutex_unlock(&db->mutex);
+    return NULL;
+}
+
+/* Takes the prefetched decompressed entry at offset, if there is one,
+   waiting for the prefetch thread if it is working on it. The caller
+   must free the result. */
+static unsigned char *lazydb_take(lazydb_t *db, int offset, int len,
+				  unsigned int *dlen)
+{
+    unsigned char *data = NULL;
+    if (db->entries == NULL)
+	return NULL;
+
+    pthread_mutex_lock(&db->mutex);
+    int lo = 0, hi = db->nentries - 1;
+    while (lo <= hi) {
+	int mid = lo + (hi - lo) / 2;
+	pfentry_t *e = db->entries + mid;
+	if (e->offset < offset)
+	    lo = mid + 1;
+	else if (e->offset > offset)
+	    hi = mid - 1;
+	else {
+	    if (e->len == len) {
+		while (e->state == PF_BUSY)
+		    pthread_cond_wait(&db->cond, &db->mutex);
+		if (e->state == PF_DONE) {
+		    data = e->data;
+		    *dlen = e->dlen;
+		    e->data = NULL;
+		}
+		e->state = PF_TAKEN;
+	    }
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&db->mutex);
+    return data;
+}
+
+static void lazydb_stop_prefetch(lazydb_t *db)
+{
+    if (db->entries == NULL)
+	return;
+    pthread_mutex_lock(&db->mutex);
+    db->stop = TRUE;
+    pthread_mutex_unlock(&db->mutex);
+    if (db->joinable)
+	pthread_join(db->thread, NULL);
+    for (int i = 0; i < db->nentries; i++)
+	free(db->entries[i].data);
+    free(db->entries);
+    db->entries = NULL;
+    pthread_cond_destroy(&db->cond);
+    pthread_mutex_destroy(&db->mutex);
+}
+
+/* A child forked while a prefetch thread runs (e.g. by mcparallel)
+   does not have the thread: it decompresses what it needs itself. */
+static void lazydb_atfork_prepare(void)
+{
+    for (int i = 0; i < used; i++)
+	if (lazydbs[i].entries)
+	    pthread_mutex_lock(&lazydbs[i].mutex);
+}
+
+static void lazydb_atfork_parent(void)
+{
+    for (int i = 0; i < used; i++)
+	if (lazydbs[i].entries)
+	    pthread_mutex_unlock(&lazydbs[i].mutex);
+}
+
+static void lazydb_atfork_child(void)
+{
+    for (int i = 0; i < used; i++) {
+	lazydb_t *db = lazydbs + i;
+	if (db->entries) {
+	    db->joinable = FALSE;
+	    db->stop = TRUE;
+	    for (int j = 0; j < db->nentries; j++)
+		if (db->entries[j].state == PF_BUSY)
+		    db->entries[j].state = PF_FAILED;
+	    pthread_mutex_unlock(&db->mutex);
+	}
+    }
+}
+#endif
+
+static void lazydb_free(lazydb_t *db)
+{
+#ifdef LAZYDB_PREFETCH
+    lazydb_stop_prefetch(db);
+#endif
+#ifdef LAZYDB_MMAP
+    if (db->mapped) {
+	if (db->size)
+	    munmap(db->ptr, db->size);
+    } else
+#endif
+	free(db->ptr);
+    db->ptr = NULL;
+    strcpy(db->name, "");
+}
 
 SEXP attribute_hidden
 do_lazyLoadDBflush(SEXP call, SEXP op, SEXP args, SEXP env)
@@ -2975,9 +3562,8 @@ do_lazyLoadDBflush(SEXP call, SEXP op, SEXP args, SEXP env)
 
     /* fprintf(stderr, "flushing file %s", cfile); */
     for (i = 0; i < used; i++)
-	if(strcmp(cfile, names[i]) == 0) {
-	    strcpy(names[i], "");
-	    free(ptr[i]);
+	if(strcmp(cfile, lazydbs[i].name) == 0) {
+	    lazydb_free(lazydbs + i);
 	    /* fprintf(stderr, " found at pos %d in cache", i); */
 	    break;
 	}
@@ -2985,93 +3571,114 @@ do_lazyLoadDBflush(SEXP call, SEXP op, SEXP args, SEXP env)
     return R_NilValue;
 }
 
-
-/* Reads, in binary mode, the bytes in the range specified by a
-   position/length vector and returns them as raw vector. */
-
 /* There are some large lazy-data examples, e.g. 80Mb for SNPMaP.cdm */
 #define LEN_LIMIT 10*1048576
-static SEXP readRawFromFile(SEXP file, SEXP key)
-{
-    FILE *fp;
-    int offset, len, in, i, icache = -1;
-    long filelen;
-    SEXP val;
-    const void *vmax;
-    const char *cfile;
 
-    if (! IS_PROPER_STRING(file))
-	error(_("not a proper file name"));
-    vmax = vmaxget();
-    cfile = translateCharFP(STRING_ELT(file, 0));
-    if (TYPEOF(key) != INTSXP || LENGTH(key) != 2)
-	error(_("bad offset/length argument"));
-
-    offset = INTEGER(key)[0];
-    len = INTEGER(key)[1];
+/* Returns the cache entry for database cfile, adding it if possible,
+   or NULL if it cannot be cached. */
+static lazydb_t *lazydb_get(const char *cfile)
+{
+    int i, icache = -1;
+    lazydb_t *db;
 
-    val = allocVector(RAWSXP, len);
     /* Do we have this database cached? */
     for (i = 0; i < used; i++)
-	if(strcmp(cfile, names[i]) == 0) {icache = i; break;}
-    if (icache >= 0) {
-	memcpy(RAW(val), ptr[icache]+offset, len);
-	vmaxset(vmax);
-	return val;
-    }
+	if(strcmp(cfile, lazydbs[i].name) == 0) {
+	    db = lazydbs + i;
+#ifdef LAZYDB_MMAP
+	    struct stat st;
+	    if (db->mapped && stat(cfile, &st) == 0 &&
+		st.st_dev == db->st.st_dev && st.st_ino == db->st.st_ino &&
+		(st.st_size != db->st.st_size ||
+		 st.st_mtime != db->st.st_mtime))
+		error(_("lazy-load database '%s' has been modified"), cfile);
+#endif
+	    return db;
+	}
 
     /* find a vacant slot? */
     for (i = 0; i < used; i++)
-	if(strcmp("", names[i]) == 0) {icache = i; break;}
+	if(strcmp("", lazydbs[i].name) == 0) {icache = i; break;}
     if(icache < 0 && used < NC) icache = used++;
+    if(icache < 0)
+	return NULL;
+    db = lazydbs + icache;
 
-    if(icache >= 0) {
-	if ((fp = R_fopen(cfile, "rb")) == NULL)
-	    error(_("cannot open file '%s': %s"), cfile, strerror(errno));
-	if (fseek(fp, 0, SEEK_END) != 0) {
-	    fclose(fp);
-	    error(_("seek failed on %s"), cfile);
-	}
-	filelen = ftell(fp);
-	if (filelen < LEN_LIMIT) {
-	    char *p;
-	    /* fprintf(stderr, "adding file '%s' at pos %d in cache, length %d\n",
-	       cfile, icache, filelen); */
-	    p = (char *) malloc(filelen);
-	    if (p) {
-		strcpy(names[icache], cfile);
-		ptr[icache] = p;
-		if (fseek(fp, 0, SEEK_SET) != 0) {
-		    fclose(fp);
-		    error(_("seek failed on %s"), cfile);
-		}
-		in = (int) fread(p, 1, filelen, fp);
-		fclose(fp);
-		if (filelen != in) error(_("read failed on %s"), cfile);
-		memcpy(RAW(val), p+offset, len);
-	    } else {
-		if (fseek(fp, offset, SEEK_SET) != 0) {
-		    fclose(fp);
-		    error(_("seek failed on %s"), cfile);
-		}
-		in = (int) fread(RAW(val), 1, len, fp);
-		fclose(fp);
-		if (len != in) error(_("read failed on %s"), cfile);
-	    }
-	    vmaxset(vmax);
-	    return val;
-	} else {
-	    if (fseek(fp, offset, SEEK_SET) != 0) {
-		fclose(fp);
-		error(_("seek failed on %s"), cfile);
-	    }
-	    in = (int) fread(RAW(val), 1, len, fp);
-	    fclose(fp);
-	    if (len != in) error(_("read failed on %s"), cfile);
-	    vmaxset(vmax);
-	    return val;
-	}
+#ifdef LAZYDB_MMAP
+    int fd = open(R_ExpandFileName(cfile), O_RDONLY);
+    if (fd < 0)
+	error(_("cannot open file '%s': %s"), cfile, strerror(errno));
+    if (fstat(fd, &db->st) != 0) {
+	close(fd);
+	error(_("cannot open file '%s': %s"), cfile, strerror(errno));
     }
+    db->size = (size_t) db->st.st_size;
+    db->ptr = NULL;
+    if (db->size > 0) {
+	void *p = mmap(NULL, db->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p != MAP_FAILED)
+	    db->ptr = p;
+    }
+    close(fd);
+    if (db->ptr != NULL || db->size == 0) {
+	/* fprintf(stderr, "mapping file '%s' at pos %d in cache, length %d\n",
+	   cfile, icache, db->size); */
+	db->mapped = TRUE;
+	strcpy(db->name, cfile);
+	return db;
+    }
+    db->mapped = FALSE;
+#endif
+
+    FILE *fp;
+    long filelen;
+    if ((fp = R_fopen(cfile, "rb")) == NULL)
+	error(_("cannot open file '%s': %s"), cfile, strerror(errno));
+    if (fseek(fp, 0, SEEK_END) != 0) {
+	fclose(fp);
+	error(_("seek failed on %s"), cfile);
+    }
+    filelen = ftell(fp);
+    char *p = filelen < LEN_LIMIT ? (char *) malloc(filelen) : NULL;
+    if (p == NULL) {
+	fclose(fp);
+	return NULL;
+    }
+    /* fprintf(stderr, "adding file '%s' at pos %d in cache, length %d\n",
+       cfile, icache, filelen); */
+    if (fseek(fp, 0, SEEK_SET) != 0) {
+	fclose(fp);
+	free(p);
+	error(_("seek failed on %s"), cfile);
+    }
+    size_t in = fread(p, 1, filelen, fp);
+    fclose(fp);
+    if (filelen != in) {
+	free(p);
+	error(_("read failed on %s"), cfile);
+    }
+    strcpy(db->name, cfile);
+    db->ptr = p;
+    db->size = filelen;
+    return db;
+}
+
+static void checkLazyLoadKey(SEXP key, int *offset, int *len)
+{
+    if (TYPEOF(key) != INTSXP || LENGTH(key) != 2)
+	error(_("bad offset/length argument"));
+    *offset = INTEGER(key)[0];
+    *len = INTEGER(key)[1];
+}
+
+/* Reads, in binary mode, the bytes in the range specified by a
+   position/length vector and returns them as raw vector. */
+
+static SEXP readRawFromFile(const char *cfile, int offset, int len)
+{
+    FILE *fp;
+    int in;
+    SEXP val = allocVector(RAWSXP, len);
 
     if ((fp = R_fopen(cfile, "rb")) == NULL)
 	error(_("cannot open file '%s': %s"), cfile, strerror(errno));
@@ -3082,7 +3689,6 @@ static SEXP readRawFromFile(SEXP file, SEXP key)
     in = (int) fread(RAW(val), 1, len, fp);
     fclose(fp);
     if (len != in) error(_("read failed on %s"), cfile);
-    vmaxset(vmax);
     return val;
 }
 
@@ -3165,6 +3771,20 @@ R_lazyLoadDBinsertValue(SEXP value, SEXP file, SEXP ascii,
     return key;
 }
 
+static void free_lazydb_data(void *data)
+{
+    free(data);
+}
+
+static SEXP unserializeFromBuffer(void *buf, R_size_t length, SEXP fun)
+{
+    struct R_inpstream_st in;
+    struct membuf_st mbs;
+    InitMemInPStream(&in, &mbs, buf, length,
+		     fun != R_NilValue ? CallHook : NULL, fun);
+    return R_Unserialize(&in);
+}
+
 /* Retrieves a sequence of bytes as specified by a position/length key
    from a file, optionally decompresses, and unserializes the bytes.
    If the result is a promise, then the promise is forced. */
@@ -3174,7 +3794,7 @@ do_lazyLoadDBfetch(SEXP call, SEXP op, SEXP args, SEXP env)
 {
     SEXP key, file, compsxp, hook;
     PROTECT_INDEX vpi;
-    int compressed;
+    int compressed, offset, len;
     Rboolean err = FALSE;
     SEXP val;
 
@@ -3185,18 +3805,57 @@ do_lazyLoadDBfetch(SEXP call, SEXP op, SEXP args, SEXP env)
     hook = CAR(args);
     compressed = asInteger(compsxp);
 
-    PROTECT_WITH_INDEX(val = readRawFromFile(file, key), &vpi);
-    if (compressed == 3)
-	REPROTECT(val = R_decompress3(val, &err), vpi);
-    else if (compressed == 2)
-	REPROTECT(val = R_decompress2(val, &err), vpi);
-    else if (compressed)
-	REPROTECT(val = R_decompress1(val, &err), vpi);
-    if (err) error("lazy-load database '%s' is corrupt",
-		   translateChar(STRING_ELT(file, 0)));
-    val = R_unserialize(val, hook);
+    if (! IS_PROPER_STRING(file))
+	error(_("not a proper file name"));
+    const void *vmax = vmaxget();
+    const char *cfile = translateCharFP(STRING_ELT(file, 0));
+    checkLazyLoadKey(key, &offset, &len);
+
+    lazydb_t *db = lazydb_get(cfile);
+    if (db != NULL) {
+	if (offset < 0 || len < 0 || (size_t) offset + len > db->size ||
+	    (compressed && len < 5))
+	    error(_("lazy-load database '%s' is corrupt"), cfile);
+	unsigned char *p = (unsigned char *) db->ptr + offset;
+#ifdef LAZYDB_PREFETCH
+	unsigned int dlen;
+	unsigned char *data = compressed ?
+	    lazydb_take(db, offset, len, &dlen) : NULL;
+	if (data != NULL) {
+	    RCNTXT cntxt;
+	    begincontext(&cntxt, CTXT_CCODE, R_NilValue, R_BaseEnv, R_BaseEnv,
+			 R_NilValue, R_NilValue);
+	    cntxt.cend = &free_lazydb_data;
+	    cntxt.cenddata = data;
+	    val = unserializeFromBuffer(data, dlen, hook);
+	    endcontext(&cntxt);
+	    free(data);
+	} else
+#endif
+	if (compressed) {
+	    PROTECT(val = allocVector(RAWSXP, R_decompressed_length(p)));
+	    if (! R_decompress_buffer(compressed, p, len, RAW(val)))
+		error(_("lazy-load database '%s' is corrupt"), cfile);
+	    val = unserializeFromBuffer(RAW(val), XLENGTH(val), hook);
+	    UNPROTECT(1);
+	}
+	else
+	    val = unserializeFromBuffer(p, len, hook);
+	PROTECT_WITH_INDEX(val, &vpi);
+    }
+    else {
+	PROTECT_WITH_INDEX(val = readRawFromFile(cfile, offset, len), &vpi);
+	if (compressed == 3)
+	    REPROTECT(val = R_decompress3(val, &err), vpi);
+	else if (compressed == 2)
+	    REPROTECT(val = R_decompress2(val, &err), vpi);
+	else if (compressed)
+	    REPROTECT(val = R_decompress1(val, &err), vpi);
+	if (err) error("lazy-load database '%s' is corrupt", cfile);
+	REPROTECT(val = R_unserialize(val, hook), vpi);
+    }
+    vmaxset(vmax);
     if (TYPEOF(val) == PROMSXP) {
-	REPROTECT(val, vpi);
 	val = eval(val, R_GlobalEnv);
 	ENSURE_NAMEDMAX(val);
     }
@@ -3204,6 +3863,98 @@ do_lazyLoadDBfetch(SEXP call, SEXP op, SEXP args, SEXP env)
     return val;
 }
 
+#ifdef LAZYDB_PREFETCH
+static int prefetch_enabled = -1;
+
+static int compare_pfentry(const void *a, const void *b)
+{
+    int x = ((const pfentry_t *) a)->offset, y = ((const pfentry_t *) b)->offset;
+    return x < y ? -1 : (x > y);
+}
+
+static void add_pfentry(lazydb_t *db, SEXP key)
+{
+    if (TYPEOF(key) == VECSXP) { /* eager and lazy keys of an environment */
+	SEXP names = getAttrib(key, R_NamesSymbol);
+	SEXP eager = R_NilValue;
+	for (int i = 0; i < length(names); i++)
+	    if (strcmp(CHAR(STRING_ELT(names, i)), "eagerKey") == 0)
+		eager = VECTOR_ELT(key, i);
+	key = eager;
+    }
+    if (TYPEOF(key) != INTSXP || LENGTH(key) != 2)
+	return;
+    int offset = INTEGER(key)[0], len = INTEGER(key)[1];
+    if (offset < 0 || len < 5 || (size_t) offset + len > db->size)
+	return;
+    pfentry_t *e = db->entries + db->nentries++;
+    e->offset = offset;
+    e->len = len;
+    e->state = PF_PENDING;
+    e->dlen = 0;
+    e->data = NULL;
+}
+#endif
+
+/* .Internal(lazyLoadDBprefetch(file, compressed, vals, refs)) starts
+   decompressing the entries with the keys in lists vals and refs in a
+   background thread, if this is enabled.  Called by lazyLoadDBexec. */
+SEXP attribute_hidden
+do_lazyLoadDBprefetch(SEXP call, SEXP op, SEXP args, SEXP env)
+{
+    checkArity(op, args);
+#ifdef LAZYDB_PREFETCH
+    SEXP file = CAR(args);
+    int compressed = asInteger(CADR(args));
+    SEXP vals = CADDR(args), refs = CADDDR(args);
+
+    if (prefetch_enabled < 0) {
+	char *p = getenv("R_LAZYLOAD_PREFETCH");
+	prefetch_enabled = p != NULL && atoi(p) > 0;
+	if (prefetch_enabled &&
+	    pthread_atfork(lazydb_atfork_prepare, lazydb_atfork_parent,
+			   lazydb_atfork_child) != 0)
+	    prefetch_enabled = 0;
+    }
+    if (! prefetch_enabled || ! IS_PROPER_STRING(file) ||
+	compressed == NA_INTEGER || compressed < 1 || compressed > 3 ||
+	TYPEOF(vals) != VECSXP || TYPEOF(refs) != VECSXP)
+	return R_NilValue;
+
+    lazydb_t *db = lazydb_get(translateCharFP(STRING_ELT(file, 0)));
+    if (db == NULL || ! db->mapped || db->entries != NULL || db->size == 0)
+	return R_NilValue;
+    madvise(db->ptr, db->size, MADV_WILLNEED);
+
+    R_xlen_t n = XLENGTH(vals) + XLENGTH(refs);
+    pfentry_t *entries = malloc((n ? n : 1) * sizeof(pfentry_t));
+    if (entries == NULL)
+	return R_NilValue;
+    db->entries = entries;
+    db->nentries = 0;
+    for (R_xlen_t i = 0; i < XLENGTH(vals); i++)
+	add_pfentry(db, VECTOR_ELT(vals, i));
+    for (R_xlen_t i = 0; i < XLENGTH(refs); i++)
+	add_pfentry(db, VECTOR_ELT(refs, i));
+    db->entries = NULL;
+    if (db->nentries == 0) {
+	free(entries);
+	return R_NilValue;
+    }
+    qsort(entries, db->nentries, sizeof(pfentry_t), compare_pfentry);
+
+    db->next = 0;
+    db->compressed = compressed;
+    db->stop = FALSE;
+    pthread_mutex_init(&db->mutex, NULL);
+    pthread_cond_init(&db->cond, NULL);
+    db->entries = entries;
+    db->joinable =
+	pthread_create(&db->thread, NULL, lazydb_prefetch_thread, db) == 0;
+#endif
+    return R_NilValue;
+}
+
 SEXP attribute_hidden
 do_getVarsFromFrame(SEXP call, SEXP op, SEXP args, SEXP env)
 {
@@ -3230,6 +3981,8 @@ do_serialize(SEXP call, SEXP op, SEXP args, SEXP env)
 {
     checkArity(op, args);
     if (PRIMVAL(op) == 2) return R_unserialize(CAR(args), CADR(args));
+    if (PRIMVAL(op) == 3)
+	return R_unserializeEach(CAR(args), CADR(args), CADDR(args), env);
 
     SEXP object, icon, type, ver, fun;
     object = CAR(args); args = CDR(args);